@@ -1,6 +1,36 @@
 #include <gtest/gtest.h>
 
+#include <CPP/Batch.h>
+#include <CPP/Expression.h>
+#include <CPP/FileCache.h>
+#include <CPP/Grammar.h>
+#include <CPP/Lexer.h>
+#include <CPP/PersistentAtomMap.h>
+#include <CPP/Phases.h>
+#include <CPP/Preprocessor.h>
 #include <CPP/Rules.h>
+#include <CPP/RulesCompiler.h>
+#include <CPP/Sink.h>
+#include <CPP/Snapshot.h>
+#include <CPP/SourceMap.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <thread>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+// the logging macros of Rules.h allocate their rule with new, these make it
+// in grammar, which owns every rule of a test
+#define Grammar_LogInput1(grammar, rule, custom_name) (grammar).make<CPP::Rules::LogInput>(rule, custom_name)
+#define Grammar_LogInput(grammar, rule) Grammar_LogInput1(grammar, rule, #rule)
+#define Grammar_LogCapture1(grammar, rule, custom_name) (grammar).make<CPP::Rules::LogCapture>(rule, custom_name)
+#define Grammar_LogCapture(grammar, rule) Grammar_LogCapture1(grammar, rule, #rule)
+#define Grammar_LogMatchStatus1(grammar, rule, custom_name) (grammar).make<CPP::Rules::LogMatchStatus>(rule, custom_name)
+#define Grammar_LogMatchStatus(grammar, rule) Grammar_LogMatchStatus1(grammar, rule, #rule)
 
 #ifdef GTEST_API_
 TEST(Rules, success_test_01) {
@@ -171,61 +201,84 @@ TEST(Rules, range_test_rescan) {
     EXPECT_EQ(b.peekNext(), 'H');
 }
 
+TEST(Rules, range_test_bounds) {
+    CPP::Rules::Range identifier({'a', 'z', 'A', 'Z', '0', '9', '_'});
+    EXPECT_TRUE(identifier.contains('q'));
+    EXPECT_TRUE(identifier.contains('Q'));
+    EXPECT_TRUE(identifier.contains('5'));
+    EXPECT_TRUE(identifier.contains('_'));
+    EXPECT_FALSE(identifier.contains('-'));
+    EXPECT_FALSE(identifier.contains(' '));
+    // a trailing letter matches everything from it upwards
+    CPP::Rules::Range upwards({'a', 'c', 'x'});
+    EXPECT_TRUE(upwards.contains('b'));
+    EXPECT_FALSE(upwards.contains('d'));
+    EXPECT_TRUE(upwards.contains('z'));
+    EXPECT_TRUE(upwards.contains('~'));
+}
+
 TEST(Rules, at_test_pass) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
-    EXPECT_TRUE(CPP::Rules::At(new CPP::Rules::Char('H')).match(b));
+    EXPECT_TRUE(CPP::Rules::At(rules.make<CPP::Rules::Char>('H')).match(b));
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'H');
 }
 
 TEST(Rules, at_test_fail) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
-    EXPECT_FALSE(CPP::Rules::At(new CPP::Rules::Char('e')).match(b));
+    EXPECT_FALSE(CPP::Rules::At(rules.make<CPP::Rules::Char>('e')).match(b));
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'H');
 }
 
 TEST(Rules, notat_test_pass) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
-    EXPECT_FALSE(CPP::Rules::NotAt(new CPP::Rules::Char('H')).match(b));
+    EXPECT_FALSE(CPP::Rules::NotAt(rules.make<CPP::Rules::Char>('H')).match(b));
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'H');
 }
 
 TEST(Rules, notat_test_fail) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
-    EXPECT_TRUE(CPP::Rules::NotAt(new CPP::Rules::Char('e')).match(b));
+    EXPECT_TRUE(CPP::Rules::NotAt(rules.make<CPP::Rules::Char>('e')).match(b));
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'H');
 }
 
 TEST(Rules, sequence_test_pass) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
     using namespace CPP::Rules;
-    EXPECT_TRUE(Sequence({new Char('H'), new Char('e'), new Char('l')}).match(b));
+    EXPECT_TRUE(Sequence({rules.make<Char>('H'), rules.make<Char>('e'), rules.make<Char>('l')}).match(b));
     EXPECT_EQ(b.currentPosition(), 3);
     EXPECT_EQ(b.peekNext(), 'l');
 }
 
 TEST(Rules, sequence_test_fail) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
     using namespace CPP::Rules;
-    EXPECT_FALSE(Sequence({new Char('H'), new Char('e'), new Char('x')}).match(b));
+    EXPECT_FALSE(Sequence({rules.make<Char>('H'), rules.make<Char>('e'), rules.make<Char>('x')}).match(b));
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'H');
 }
 
 TEST(Rules, sequence_test_backtrack) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
     using namespace CPP::Rules;
-    auto match = Sequence({new Char('H'), new Char('e'), new Char('l')}).match(b);
+    auto match = Sequence({rules.make<Char>('H'), rules.make<Char>('e'), rules.make<Char>('l')}).match(b);
     EXPECT_TRUE(match);
     b.popIterator(match.matches);
     EXPECT_EQ(b.currentPosition(), 0);
@@ -233,38 +286,42 @@ TEST(Rules, sequence_test_backtrack) {
 }
 
 TEST(Rules, sequence_test_rescan) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
     using namespace CPP::Rules;
-    auto match = Sequence({new Char('H'), new Char('e'), new Char('l')}, [] (CPP::Rules::Input input) { input.rescan(); }).match(b);
+    auto match = Sequence({rules.make<Char>('H'), rules.make<Char>('e'), rules.make<Char>('l')}, [] (CPP::Rules::Input input) { input.rescan(); }).match(b);
     EXPECT_TRUE(match);
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'H');
 }
 
 TEST(Rules, or_test_pass) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
     using namespace CPP::Rules;
-    EXPECT_TRUE(Or({new Char('H'), new Char('e'), new Char('l')}).match(b));
+    EXPECT_TRUE(Or({rules.make<Char>('H'), rules.make<Char>('e'), rules.make<Char>('l')}).match(b));
     EXPECT_EQ(b.currentPosition(), 1);
     EXPECT_EQ(b.peekNext(), 'e');
 }
 
 TEST(Rules, or_test_fail) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
     using namespace CPP::Rules;
-    EXPECT_FALSE(Or({new Char('z'), new Char('z'), new Char('z')}).match(b));
+    EXPECT_FALSE(Or({rules.make<Char>('z'), rules.make<Char>('z'), rules.make<Char>('z')}).match(b));
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'H');
 }
 
 TEST(Rules, or_test_backtrack) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
     using namespace CPP::Rules;
-    auto match = Or({new Char('H'), new Char('e'), new Char('l')}).match(b);
+    auto match = Or({rules.make<Char>('H'), rules.make<Char>('e'), rules.make<Char>('l')}).match(b);
     EXPECT_TRUE(match);
     b.popIterator(match.matches);
     EXPECT_EQ(b.currentPosition(), 0);
@@ -272,73 +329,79 @@ TEST(Rules, or_test_backtrack) {
 }
 
 TEST(Rules, or_test_rescan) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
     using namespace CPP::Rules;
-    auto match = Or({new Char('H'), new Char('e'), new Char('l')}, [] (CPP::Rules::Input input) { input.rescan(); }).match(b);
+    auto match = Or({rules.make<Char>('H'), rules.make<Char>('e'), rules.make<Char>('l')}, [] (CPP::Rules::Input input) { input.rescan(); }).match(b);
     EXPECT_TRUE(match);
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'H');
 }
 
 TEST(Rules, at_sequence_test_pass) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
     using namespace CPP::Rules;
-    EXPECT_TRUE(At(new Sequence({new Char('H'), new Char('e'), new Char('l')})).match(b));
+    EXPECT_TRUE(At(rules.make<Sequence>({rules.make<Char>('H'), rules.make<Char>('e'), rules.make<Char>('l')})).match(b));
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'H');
 }
 
 TEST(Rules, at_sequence_test_fail) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
     using namespace CPP::Rules;
-    EXPECT_FALSE(At(new Sequence({new Char('H'), new Char('e'), new Char('x')})).match(b));
+    EXPECT_FALSE(At(rules.make<Sequence>({rules.make<Char>('H'), rules.make<Char>('e'), rules.make<Char>('x')})).match(b));
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'H');
 }
 
 TEST(Rules, optional_test_pass) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
     using namespace CPP::Rules;
-    EXPECT_TRUE(Optional(new Sequence({new Char('H'), new Char('e'), new Char('l')})).match(b));
+    EXPECT_TRUE(Optional(rules.make<Sequence>({rules.make<Char>('H'), rules.make<Char>('e'), rules.make<Char>('l')})).match(b));
     EXPECT_EQ(b.currentPosition(), 3);
     EXPECT_EQ(b.peekNext(), 'l');
 }
 
 TEST(Rules, optional_test_fail) {
+    CPP::Rules::Grammar rules;
     std::string a = "Hello World!";
     CPP::Iterator<std::string> b(a);
     using namespace CPP::Rules;
-    EXPECT_TRUE(Optional(new Sequence({new Char('H'), new Char('e'), new Char('x')})).match(b));
+    EXPECT_TRUE(Optional(rules.make<Sequence>({rules.make<Char>('H'), rules.make<Char>('e'), rules.make<Char>('x')})).match(b));
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'H');
 }
 
 TEST(Rules_Extra, test_01) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP::Rules;
 
-    auto whitespaces = new OneOrMore(new Char(' '));
-    auto optional_whitespaces = new Optional(whitespaces);
+    auto whitespaces = rules.make<OneOrMore>(rules.make<Char>(' '));
+    auto optional_whitespaces = rules.make<Optional>(whitespaces);
 
-    auto identifier = new Sequence({
-                new Range({'a', 'z', 'A', 'Z', '_'}),
-                new Optional(
-                    new OneOrMore(
-                        new Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = rules.make<Sequence>({
+                rules.make<Range>({'a', 'z', 'A', 'Z', '_'}),
+                rules.make<Optional>(
+                    rules.make<OneOrMore>(
+                        rules.make<Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
                     )
                 )
             });
 
-    auto parens_open = new Char('(');
+    auto parens_open = rules.make<Char>('(');
 
-    TemporaryAction * function_name = new TemporaryAction(identifier);
+    TemporaryAction * function_name = rules.make<TemporaryAction>(identifier);
 
-    EXPECT_TRUE(At(new Sequence({
+    EXPECT_TRUE(At(rules.make<Sequence>({
                     function_name, optional_whitespaces, parens_open
                 })).match(b));
 
@@ -347,68 +410,69 @@ TEST(Rules_Extra, test_01) {
 }
 
 TEST(Rules_Extra, test_02) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    auto newline = new Rules::Char('\n');
-    auto whitespaces = new Rules::OneOrMore(new Rules::Char(' '));
-    auto optional_whitespaces = new Rules::Optional(whitespaces);
+    auto newline = rules.make<Rules::Char>('\n');
+    auto whitespaces = rules.make<Rules::OneOrMore>(rules.make<Rules::Char>(' '));
+    auto optional_whitespaces = rules.make<Rules::Optional>(whitespaces);
 
-    auto identifier = Rules_NS_LogCapture1(new Rules::Sequence({
-        new Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new Rules::Optional(
-            new Rules::OneOrMore(
-                new Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = Grammar_LogCapture1(rules, rules.make<Rules::Sequence>({
+        rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<Rules::Optional>(
+            rules.make<Rules::OneOrMore>(
+                rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
             )
         )
     }), "identifier");
 
-    auto parens_open = new Rules::Char('(');
+    auto parens_open = rules.make<Rules::Char>('(');
 
-    Rules::TemporaryAction * function_name = new Rules::TemporaryAction(identifier);
+    Rules::TemporaryAction * function_name = rules.make<Rules::TemporaryAction>(identifier);
 
-    auto g = Rules_NS_LogInput(new Rules::At(new Rules::Sequence({
-                                                                         Rules_NS_LogInput(function_name),
-                                                                         Rules_NS_LogInput(optional_whitespaces),
-                                                                         Rules_NS_LogInput(parens_open)
+    auto g = Grammar_LogInput(rules, rules.make<Rules::At>(rules.make<Rules::Sequence>({
+                                                                         Grammar_LogInput(rules, function_name),
+                                                                         Grammar_LogInput(rules, optional_whitespaces),
+                                                                         Grammar_LogInput(rules, parens_open)
                                                                  })));
 
     EXPECT_TRUE(g->match(b));
-    delete g;
 
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'A');
 }
 
 TEST(Rules_Extra, test_03) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    auto newline = new Rules::Char('\n');
-    auto whitespaces = new Rules::OneOrMore(new Rules::Char(' '));
-    auto optional_whitespaces = new Rules::Optional(whitespaces);
+    auto newline = rules.make<Rules::Char>('\n');
+    auto whitespaces = rules.make<Rules::OneOrMore>(rules.make<Rules::Char>(' '));
+    auto optional_whitespaces = rules.make<Rules::Optional>(whitespaces);
 
-    auto identifier = Rules_NS_LogCapture1(new Rules::Sequence({
-        new Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new Rules::Optional(
-            new Rules::OneOrMore(
-                new Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = Grammar_LogCapture1(rules, rules.make<Rules::Sequence>({
+        rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<Rules::Optional>(
+            rules.make<Rules::OneOrMore>(
+                rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
             )
         )
     }), "identifier");
 
-    auto parens_open = new Rules::Char('(');
+    auto parens_open = rules.make<Rules::Char>('(');
 
-    Rules::TemporaryAction * function_name = new Rules::TemporaryAction(identifier);
+    Rules::TemporaryAction * function_name = rules.make<Rules::TemporaryAction>(identifier);
 
     EXPECT_TRUE(Rules::Sequence({
-                Rules_NS_LogInput1(new Rules::Success(), "function call sequence start"),
-                Rules_NS_LogInput(new Rules::At(new Rules::Sequence({
-                    Rules_NS_LogInput(function_name),
-                    Rules_NS_LogInput(optional_whitespaces),
-                    Rules_NS_LogInput(parens_open)
+                Grammar_LogInput1(rules, rules.make<Rules::Success>(), "function call sequence start"),
+                Grammar_LogInput(rules, rules.make<Rules::At>(rules.make<Rules::Sequence>({
+                    Grammar_LogInput(rules, function_name),
+                    Grammar_LogInput(rules, optional_whitespaces),
+                    Grammar_LogInput(rules, parens_open)
                 })))
     }).match(b));
 
@@ -417,36 +481,37 @@ TEST(Rules_Extra, test_03) {
 }
 
 TEST(Rules_Extra, test_04_a) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    auto newline = new Rules::Char('\n');
-    auto whitespaces = new Rules::OneOrMore(new Rules::Char(' '));
-    auto optional_whitespaces = new Rules::Optional(whitespaces);
+    auto newline = rules.make<Rules::Char>('\n');
+    auto whitespaces = rules.make<Rules::OneOrMore>(rules.make<Rules::Char>(' '));
+    auto optional_whitespaces = rules.make<Rules::Optional>(whitespaces);
 
-    auto identifier = Rules_NS_LogCapture1(new Rules::Sequence({
-        new Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new Rules::Optional(
-            new Rules::OneOrMore(
-                new Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = Grammar_LogCapture1(rules, rules.make<Rules::Sequence>({
+        rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<Rules::Optional>(
+            rules.make<Rules::OneOrMore>(
+                rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
             )
         )
     }), "identifier");
 
-    auto parens_open = new Rules::Char('(');
+    auto parens_open = rules.make<Rules::Char>('(');
 
-    Rules::TemporaryAction * function_name = new Rules::TemporaryAction(identifier);
+    Rules::TemporaryAction * function_name = rules.make<Rules::TemporaryAction>(identifier);
 
     EXPECT_TRUE(Rules::Or({
-                            new Rules::Sequence({
-                                Rules_NS_LogInput1(new Rules::Success(), "function call sequence start"),
-                                Rules_NS_LogInput(new Rules::At(new Rules::Sequence({
+                            rules.make<Rules::Sequence>({
+                                Grammar_LogInput1(rules, rules.make<Rules::Success>(), "function call sequence start"),
+                                Grammar_LogInput(rules, rules.make<Rules::At>(rules.make<Rules::Sequence>({
                                     function_name
                                 }))),
-                                new Rules::Fail()
+                                rules.make<Rules::Fail>()
                             }),
-                            Rules_NS_LogInput(new Rules::Any()),
+                            Grammar_LogInput(rules, rules.make<Rules::Any>()),
                         })
                         .match(b));
 
@@ -455,34 +520,35 @@ TEST(Rules_Extra, test_04_a) {
 }
 
 TEST(Rules_Extra, test_04_b) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    auto newline = new Rules::Char('\n');
-    auto whitespaces = new Rules::OneOrMore(new Rules::Char(' '));
-    auto optional_whitespaces = new Rules::Optional(whitespaces);
+    auto newline = rules.make<Rules::Char>('\n');
+    auto whitespaces = rules.make<Rules::OneOrMore>(rules.make<Rules::Char>(' '));
+    auto optional_whitespaces = rules.make<Rules::Optional>(whitespaces);
 
-    auto identifier = Rules_NS_LogCapture1(new Rules::Sequence({
-        new Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new Rules::Optional(
-            new Rules::OneOrMore(
-                new Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = Grammar_LogCapture1(rules, rules.make<Rules::Sequence>({
+        rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<Rules::Optional>(
+            rules.make<Rules::OneOrMore>(
+                rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
             )
         )
     }), "identifier");
 
-    auto parens_open = new Rules::Char('(');
+    auto parens_open = rules.make<Rules::Char>('(');
 
-    Rules::TemporaryAction * function_name = new Rules::TemporaryAction(identifier);
+    Rules::TemporaryAction * function_name = rules.make<Rules::TemporaryAction>(identifier);
 
     EXPECT_TRUE(Rules::Or({
-                            new Rules::Sequence({
-                                Rules_NS_LogInput1(new Rules::Success(), "function call sequence start"),
-                                Rules_NS_LogInput(new Rules::At(new Rules::Success())),
-                                new Rules::Fail()
+                            rules.make<Rules::Sequence>({
+                                Grammar_LogInput1(rules, rules.make<Rules::Success>(), "function call sequence start"),
+                                Grammar_LogInput(rules, rules.make<Rules::At>(rules.make<Rules::Success>())),
+                                rules.make<Rules::Fail>()
                             }),
-                            Rules_NS_LogInput(new Rules::Any()),
+                            Grammar_LogInput(rules, rules.make<Rules::Any>()),
                         })
                         .match(b));
 
@@ -491,34 +557,35 @@ TEST(Rules_Extra, test_04_b) {
 }
 
 TEST(Rules_Extra, test_04_c) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    auto newline = new Rules::Char('\n');
-    auto whitespaces = new Rules::OneOrMore(new Rules::Char(' '));
-    auto optional_whitespaces = new Rules::Optional(whitespaces);
+    auto newline = rules.make<Rules::Char>('\n');
+    auto whitespaces = rules.make<Rules::OneOrMore>(rules.make<Rules::Char>(' '));
+    auto optional_whitespaces = rules.make<Rules::Optional>(whitespaces);
 
-    auto identifier = Rules_NS_LogCapture1(new Rules::Sequence({
-        new Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new Rules::Optional(
-            new Rules::OneOrMore(
-                new Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = Grammar_LogCapture1(rules, rules.make<Rules::Sequence>({
+        rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<Rules::Optional>(
+            rules.make<Rules::OneOrMore>(
+                rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
             )
         )
     }), "identifier");
 
-    auto parens_open = new Rules::Char('(');
+    auto parens_open = rules.make<Rules::Char>('(');
 
-    Rules::TemporaryAction * function_name = new Rules::TemporaryAction(identifier);
+    Rules::TemporaryAction * function_name = rules.make<Rules::TemporaryAction>(identifier);
 
     EXPECT_TRUE(Rules::Or({
-                            new Rules::Sequence({
-                                Rules_NS_LogInput1(new Rules::Success(), "function call sequence start"),
-                                Rules_NS_LogInput(new Rules::At(new Rules::AdvanceInputBy(1))),
-                                new Rules::Fail()
+                            rules.make<Rules::Sequence>({
+                                Grammar_LogInput1(rules, rules.make<Rules::Success>(), "function call sequence start"),
+                                Grammar_LogInput(rules, rules.make<Rules::At>(rules.make<Rules::AdvanceInputBy>(1))),
+                                rules.make<Rules::Fail>()
                             }),
-                            Rules_NS_LogInput(new Rules::Any()),
+                            Grammar_LogInput(rules, rules.make<Rules::Any>()),
                         })
                         .match(b));
 
@@ -527,33 +594,34 @@ TEST(Rules_Extra, test_04_c) {
 }
 
 TEST(Rules_Extra, test_04_d) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    auto newline = new Rules::Char('\n');
-    auto whitespaces = new Rules::OneOrMore(new Rules::Char(' '));
-    auto optional_whitespaces = new Rules::Optional(whitespaces);
+    auto newline = rules.make<Rules::Char>('\n');
+    auto whitespaces = rules.make<Rules::OneOrMore>(rules.make<Rules::Char>(' '));
+    auto optional_whitespaces = rules.make<Rules::Optional>(whitespaces);
 
-    auto identifier = Rules_NS_LogCapture1(new Rules::Sequence({
-        new Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new Rules::Optional(
-            new Rules::OneOrMore(
-                new Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = Grammar_LogCapture1(rules, rules.make<Rules::Sequence>({
+        rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<Rules::Optional>(
+            rules.make<Rules::OneOrMore>(
+                rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
             )
         )
     }), "identifier");
 
-    auto parens_open = new Rules::Char('(');
+    auto parens_open = rules.make<Rules::Char>('(');
 
-    Rules::TemporaryAction * function_name = new Rules::TemporaryAction(identifier);
+    Rules::TemporaryAction * function_name = rules.make<Rules::TemporaryAction>(identifier);
 
     EXPECT_TRUE(Rules::Or({
-                            new Rules::Sequence({
-                                new Rules::At(new Rules::AdvanceInputBy(1)),
-                                new Rules::Fail()
+                            rules.make<Rules::Sequence>({
+                                rules.make<Rules::At>(rules.make<Rules::AdvanceInputBy>(1)),
+                                rules.make<Rules::Fail>()
                             }),
-                            new Rules::Any(),
+                            rules.make<Rules::Any>(),
                         })
                         .match(b));
 
@@ -562,16 +630,17 @@ TEST(Rules_Extra, test_04_d) {
 }
 
 TEST(Rules_Extra, test_04_e) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
     EXPECT_TRUE(Rules::Or({
-                            new Rules::Sequence({
-                                new Rules::AdvanceInputBy(1),
-                                new Rules::Fail()
+                            rules.make<Rules::Sequence>({
+                                rules.make<Rules::AdvanceInputBy>(1),
+                                rules.make<Rules::Fail>()
                             }),
-                            new Rules::Any(),
+                            rules.make<Rules::Any>(),
                         })
                         .match(b));
 
@@ -580,13 +649,14 @@ TEST(Rules_Extra, test_04_e) {
 }
 
 TEST(Rules_Extra, test_04_e_a) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
     EXPECT_TRUE(Rules::Or({
-                            new Rules::Char('K'),
-                            new Rules::Char('A'),
+                            rules.make<Rules::Char>('K'),
+                            rules.make<Rules::Char>('A'),
                         })
                         .match(b));
 
@@ -595,30 +665,31 @@ TEST(Rules_Extra, test_04_e_a) {
 }
 
 TEST(Rules_Extra, test_04_f) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    auto newline = new Rules::Char('\n');
-    auto whitespaces = new Rules::OneOrMore(new Rules::Char(' '));
-    auto optional_whitespaces = new Rules::Optional(whitespaces);
+    auto newline = rules.make<Rules::Char>('\n');
+    auto whitespaces = rules.make<Rules::OneOrMore>(rules.make<Rules::Char>(' '));
+    auto optional_whitespaces = rules.make<Rules::Optional>(whitespaces);
 
-    auto identifier = Rules_NS_LogCapture1(new Rules::Sequence({
-        new Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new Rules::Optional(
-            new Rules::OneOrMore(
-                new Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = Grammar_LogCapture1(rules, rules.make<Rules::Sequence>({
+        rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<Rules::Optional>(
+            rules.make<Rules::OneOrMore>(
+                rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
             )
         )
     }), "identifier");
 
-    auto parens_open = new Rules::Char('(');
+    auto parens_open = rules.make<Rules::Char>('(');
 
-    Rules::TemporaryAction * function_name = new Rules::TemporaryAction(identifier);
+    Rules::TemporaryAction * function_name = rules.make<Rules::TemporaryAction>(identifier);
 
     EXPECT_FALSE(Rules::Sequence({
-                    new Rules::AdvanceInputBy(1),
-                    new Rules::Fail()
+                    rules.make<Rules::AdvanceInputBy>(1),
+                    rules.make<Rules::Fail>()
     }).match(b));
 
     EXPECT_EQ(b.currentPosition(), 0);
@@ -626,30 +697,31 @@ TEST(Rules_Extra, test_04_f) {
 }
 
 TEST(Rules_Extra, test_04_g) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    auto newline = new Rules::Char('\n');
-    auto whitespaces = new Rules::OneOrMore(new Rules::Char(' '));
-    auto optional_whitespaces = new Rules::Optional(whitespaces);
+    auto newline = rules.make<Rules::Char>('\n');
+    auto whitespaces = rules.make<Rules::OneOrMore>(rules.make<Rules::Char>(' '));
+    auto optional_whitespaces = rules.make<Rules::Optional>(whitespaces);
 
-    auto identifier = Rules_NS_LogCapture1(new Rules::Sequence({
-        new Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new Rules::Optional(
-            new Rules::OneOrMore(
-                new Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = Grammar_LogCapture1(rules, rules.make<Rules::Sequence>({
+        rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<Rules::Optional>(
+            rules.make<Rules::OneOrMore>(
+                rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
             )
         )
     }), "identifier");
 
-    auto parens_open = new Rules::Char('(');
+    auto parens_open = rules.make<Rules::Char>('(');
 
-    Rules::TemporaryAction * function_name = new Rules::TemporaryAction(identifier);
+    Rules::TemporaryAction * function_name = rules.make<Rules::TemporaryAction>(identifier);
 
     EXPECT_FALSE(Rules::Sequence({
-                    new Rules::Char('H'),
-                    new Rules::Char('H')
+                    rules.make<Rules::Char>('H'),
+                    rules.make<Rules::Char>('H')
     }).match(b));
 
     EXPECT_EQ(b.currentPosition(), 0);
@@ -657,30 +729,31 @@ TEST(Rules_Extra, test_04_g) {
 }
 
 TEST(Rules_Extra, test_04_h) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    auto newline = new Rules::Char('\n');
-    auto whitespaces = new Rules::OneOrMore(new Rules::Char(' '));
-    auto optional_whitespaces = new Rules::Optional(whitespaces);
+    auto newline = rules.make<Rules::Char>('\n');
+    auto whitespaces = rules.make<Rules::OneOrMore>(rules.make<Rules::Char>(' '));
+    auto optional_whitespaces = rules.make<Rules::Optional>(whitespaces);
 
-    auto identifier = Rules_NS_LogCapture1(new Rules::Sequence({
-        new Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new Rules::Optional(
-            new Rules::OneOrMore(
-                new Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = Grammar_LogCapture1(rules, rules.make<Rules::Sequence>({
+        rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<Rules::Optional>(
+            rules.make<Rules::OneOrMore>(
+                rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
             )
         )
     }), "identifier");
 
-    auto parens_open = new Rules::Char('(');
+    auto parens_open = rules.make<Rules::Char>('(');
 
-    Rules::TemporaryAction * function_name = new Rules::TemporaryAction(identifier);
+    Rules::TemporaryAction * function_name = rules.make<Rules::TemporaryAction>(identifier);
 
     EXPECT_FALSE(Rules::Sequence({
-                    new Rules::Char('H'),
-                    new Rules::Fail()
+                    rules.make<Rules::Char>('H'),
+                    rules.make<Rules::Fail>()
     }).match(b));
 
     EXPECT_EQ(b.currentPosition(), 0);
@@ -688,13 +761,14 @@ TEST(Rules_Extra, test_04_h) {
 }
 
 TEST(Rules_Extra, test_04_i) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
     EXPECT_FALSE(Rules::Sequence({
-                    new Rules::Char('H'),
-                    new Rules::Fail()
+                    rules.make<Rules::Char>('H'),
+                    rules.make<Rules::Fail>()
     }).match(b));
 
     EXPECT_EQ(b.currentPosition(), 0);
@@ -702,56 +776,61 @@ TEST(Rules_Extra, test_04_i) {
 }
 
 TEST(Rules_Extra, test_04_j) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
-    EXPECT_FALSE(Rules::Sequence({new Rules::Char('H'), new Rules::Char('e')}).match(b));
+    EXPECT_FALSE(Rules::Sequence({rules.make<Rules::Char>('H'), rules.make<Rules::Char>('e')}).match(b));
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'A');
 }
 
 TEST(Rules_Extra, test_04_k) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
-    EXPECT_FALSE(Rules::Sequence({new Rules::Char('H'), new Rules::Fail()}).match(b));
+    EXPECT_FALSE(Rules::Sequence({rules.make<Rules::Char>('H'), rules.make<Rules::Fail>()}).match(b));
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'A');
 }
 
 TEST(Rules_Extra, test_04_l) {
+    CPP::Rules::Grammar rules;
     std::string a = "AAAB";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    EXPECT_TRUE(Rules::OneOrMore(new Rules::Char('A')).match(b));
+    EXPECT_TRUE(Rules::OneOrMore(rules.make<Rules::Char>('A')).match(b));
 
     EXPECT_EQ(b.currentPosition(), 3);
     EXPECT_EQ(b.peekNext(), 'B');
 }
 
 TEST(Rules_Extra, test_04_m) {
+    CPP::Rules::Grammar rules;
     std::string a = "AAAB";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    EXPECT_FALSE(Rules::OneOrMore(new Rules::Char('B')).match(b));
+    EXPECT_FALSE(Rules::OneOrMore(rules.make<Rules::Char>('B')).match(b));
 
     EXPECT_EQ(b.currentPosition(), 0);
     EXPECT_EQ(b.peekNext(), 'A');
 }
 
 TEST(Rules_Extra, test_04_n) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    EXPECT_TRUE(Rules::OneOrMore(new Rules::Or({
-        new Rules::Sequence({
-            new Rules::Char('H'),
-            new Rules::Fail()
+    EXPECT_TRUE(Rules::OneOrMore(rules.make<Rules::Or>({
+        rules.make<Rules::Sequence>({
+            rules.make<Rules::Char>('H'),
+            rules.make<Rules::Fail>()
         }),
-        new Rules::Any()
+        rules.make<Rules::Any>()
     })).match(b));
 
     EXPECT_EQ(b.currentPosition(), 4);
@@ -759,38 +838,39 @@ TEST(Rules_Extra, test_04_n) {
 }
 
 TEST(Rules_Extra, test_04) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    auto newline = new Rules::Char('\n');
-    auto whitespaces = new Rules::OneOrMore(new Rules::Char(' '));
-    auto optional_whitespaces = new Rules::Optional(whitespaces);
+    auto newline = rules.make<Rules::Char>('\n');
+    auto whitespaces = rules.make<Rules::OneOrMore>(rules.make<Rules::Char>(' '));
+    auto optional_whitespaces = rules.make<Rules::Optional>(whitespaces);
 
-    auto identifier = Rules_NS_LogCapture1(new Rules::Sequence({
-        new Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new Rules::Optional(
-            new Rules::OneOrMore(
-                new Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = Grammar_LogCapture1(rules, rules.make<Rules::Sequence>({
+        rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<Rules::Optional>(
+            rules.make<Rules::OneOrMore>(
+                rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
             )
         )
     }), "identifier");
 
-    auto parens_open = new Rules::Char('(');
+    auto parens_open = rules.make<Rules::Char>('(');
 
-    Rules::TemporaryAction * function_name = new Rules::TemporaryAction(identifier);
+    Rules::TemporaryAction * function_name = rules.make<Rules::TemporaryAction>(identifier);
 
     EXPECT_TRUE(Rules::Or({
-                            new Rules::Sequence({
-                                Rules_NS_LogInput1(new Rules::Success(), "function call sequence start"),
-                                Rules_NS_LogInput(new Rules::At(new Rules::Sequence({
+                            rules.make<Rules::Sequence>({
+                                Grammar_LogInput1(rules, rules.make<Rules::Success>(), "function call sequence start"),
+                                Grammar_LogInput(rules, rules.make<Rules::At>(rules.make<Rules::Sequence>({
                                     function_name,
                                     optional_whitespaces,
                                     parens_open
                                 }))),
-                                new Rules::Fail()
+                                rules.make<Rules::Fail>()
                             }),
-                            Rules_NS_LogInput(new Rules::Any()),
+                            Grammar_LogInput(rules, rules.make<Rules::Any>()),
                         })
                         .match(b));
 
@@ -799,38 +879,39 @@ TEST(Rules_Extra, test_04) {
 }
 
 TEST(Rules_Extra, test_05) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    auto newline = new Rules::Char('\n');
-    auto whitespaces = new Rules::OneOrMore(new Rules::Char(' '));
-    auto optional_whitespaces = new Rules::Optional(whitespaces);
+    auto newline = rules.make<Rules::Char>('\n');
+    auto whitespaces = rules.make<Rules::OneOrMore>(rules.make<Rules::Char>(' '));
+    auto optional_whitespaces = rules.make<Rules::Optional>(whitespaces);
 
-    auto identifier = Rules_NS_LogCapture1(new Rules::Sequence({
-        new Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new Rules::Optional(
-            new Rules::OneOrMore(
-                new Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = Grammar_LogCapture1(rules, rules.make<Rules::Sequence>({
+        rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<Rules::Optional>(
+            rules.make<Rules::OneOrMore>(
+                rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
             )
         )
     }), "identifier");
 
-    auto parens_open = new Rules::Char('(');
+    auto parens_open = rules.make<Rules::Char>('(');
 
-    Rules::TemporaryAction * function_name = new Rules::TemporaryAction(identifier);
+    Rules::TemporaryAction * function_name = rules.make<Rules::TemporaryAction>(identifier);
 
-    EXPECT_TRUE(Rules::RuleHolder(new Rules::Or({
-                            new Rules::Sequence({
-                                Rules_NS_LogInput1(new Rules::Success(), "function call sequence start"),
-                                Rules_NS_LogInput(new Rules::At(new Rules::Sequence({
+    EXPECT_TRUE(Rules::RuleHolder(rules.make<Rules::Or>({
+                            rules.make<Rules::Sequence>({
+                                Grammar_LogInput1(rules, rules.make<Rules::Success>(), "function call sequence start"),
+                                Grammar_LogInput(rules, rules.make<Rules::At>(rules.make<Rules::Sequence>({
                                     function_name,
                                     optional_whitespaces,
                                     parens_open
                                 }))),
-                                new Rules::Fail()
+                                rules.make<Rules::Fail>()
                             }),
-                            Rules_NS_LogInput(new Rules::Any()),
+                            Grammar_LogInput(rules, rules.make<Rules::Any>()),
                         }))
                         .match(b));
 
@@ -839,38 +920,39 @@ TEST(Rules_Extra, test_05) {
 }
 
 TEST(Rules_Extra, test_06) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    auto newline = new Rules::Char('\n');
-    auto whitespaces = new Rules::OneOrMore(new Rules::Char(' '));
-    auto optional_whitespaces = new Rules::Optional(whitespaces);
+    auto newline = rules.make<Rules::Char>('\n');
+    auto whitespaces = rules.make<Rules::OneOrMore>(rules.make<Rules::Char>(' '));
+    auto optional_whitespaces = rules.make<Rules::Optional>(whitespaces);
 
-    auto identifier = Rules_NS_LogCapture1(new Rules::Sequence({
-        new Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new Rules::Optional(
-            new Rules::OneOrMore(
-                new Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = Grammar_LogCapture1(rules, rules.make<Rules::Sequence>({
+        rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<Rules::Optional>(
+            rules.make<Rules::OneOrMore>(
+                rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
             )
         )
     }), "identifier");
 
-    auto parens_open = new Rules::Char('(');
+    auto parens_open = rules.make<Rules::Char>('(');
 
-    Rules::TemporaryAction * function_name = new Rules::TemporaryAction(identifier);
+    Rules::TemporaryAction * function_name = rules.make<Rules::TemporaryAction>(identifier);
 
-    EXPECT_TRUE(Rules::LogInput(new Rules::Or({
-                            new Rules::Sequence({
-                                Rules_NS_LogInput1(new Rules::Success(), "function call sequence start"),
-                                Rules_NS_LogInput(new Rules::At(new Rules::Sequence({
+    EXPECT_TRUE(Rules::LogInput(rules.make<Rules::Or>({
+                            rules.make<Rules::Sequence>({
+                                Grammar_LogInput1(rules, rules.make<Rules::Success>(), "function call sequence start"),
+                                Grammar_LogInput(rules, rules.make<Rules::At>(rules.make<Rules::Sequence>({
                                     function_name,
                                     optional_whitespaces,
                                     parens_open
                                 }))),
-                                new Rules::Fail()
+                                rules.make<Rules::Fail>()
                             }),
-                            Rules_NS_LogInput(new Rules::Any()),
+                            Grammar_LogInput(rules, rules.make<Rules::Any>()),
                         }), "CUSTOM OR")
                         .match(b));
 
@@ -880,40 +962,41 @@ TEST(Rules_Extra, test_06) {
 
 
 TEST(Rules_Extra, test_07) {
+    CPP::Rules::Grammar rules;
     std::string a = "A(B)";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
-    auto newline = new Rules::Char('\n');
-    auto whitespaces = new Rules::OneOrMore(new Rules::Char(' '));
-    auto optional_whitespaces = new Rules::Optional(whitespaces);
+    auto newline = rules.make<Rules::Char>('\n');
+    auto whitespaces = rules.make<Rules::OneOrMore>(rules.make<Rules::Char>(' '));
+    auto optional_whitespaces = rules.make<Rules::Optional>(whitespaces);
 
-    auto identifier = Rules_NS_LogCapture1(new Rules::Sequence({
-        new Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new Rules::Optional(
-            new Rules::OneOrMore(
-                new Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = Grammar_LogCapture1(rules, rules.make<Rules::Sequence>({
+        rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<Rules::Optional>(
+            rules.make<Rules::OneOrMore>(
+                rules.make<Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
             )
         )
     }), "identifier");
 
-    auto parens_open = new Rules::Char('(');
+    auto parens_open = rules.make<Rules::Char>('(');
 
-    Rules::TemporaryAction * function_name = new Rules::TemporaryAction(identifier);
+    Rules::TemporaryAction * function_name = rules.make<Rules::TemporaryAction>(identifier);
 
     EXPECT_TRUE(
             Rules::OneOrMore(
-                        Rules_NS_LogInput1(new Rules::Or({
-                            new Rules::Sequence({
-                                Rules_NS_LogInput1(new Rules::Success(), "function call sequence start"),
-                                Rules_NS_LogInput(new Rules::At(new Rules::Sequence({
+                        Grammar_LogInput1(rules, rules.make<Rules::Or>({
+                            rules.make<Rules::Sequence>({
+                                Grammar_LogInput1(rules, rules.make<Rules::Success>(), "function call sequence start"),
+                                Grammar_LogInput(rules, rules.make<Rules::At>(rules.make<Rules::Sequence>({
                                     function_name,
                                     optional_whitespaces,
                                     parens_open
                                 }))),
-                                new Rules::Fail()
+                                rules.make<Rules::Fail>()
                             }),
-                            Rules_NS_LogInput(new Rules::Any()),
+                            Grammar_LogInput(rules, rules.make<Rules::Any>()),
                         }), "CUSTOM OR")
                         )
                         .match(b));
@@ -923,25 +1006,26 @@ TEST(Rules_Extra, test_07) {
 }
 
 TEST(Rules, rescan_test_01) {
+    CPP::Rules::Grammar rules;
     std::string a = "12345";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
     EXPECT_TRUE(
             Rules::Sequence({
-                new Rules::Char('1'),
-                new Rules::Or({
-                    new Rules::Sequence({
-                        new Rules::Char('2'),
-                        new Rules::Char('3'),
-                        new Rules::Sequence({
-                                new Rules::Char('4'),
-                                new Rules::Char('5')
+                rules.make<Rules::Char>('1'),
+                rules.make<Rules::Or>({
+                    rules.make<Rules::Sequence>({
+                        rules.make<Rules::Char>('2'),
+                        rules.make<Rules::Char>('3'),
+                        rules.make<Rules::Sequence>({
+                                rules.make<Rules::Char>('4'),
+                                rules.make<Rules::Char>('5')
                             }, [] (auto x) { x.rescan(); }
                         ),
-                        new Rules::Char('8')
+                        rules.make<Rules::Char>('8')
                     }),
-                    new Rules::Char('2'),
+                    rules.make<Rules::Char>('2'),
                 })
             })
     .match(b));
@@ -951,13 +1035,14 @@ TEST(Rules, rescan_test_01) {
 }
 
 TEST(Rules, erase_test_01) {
+    CPP::Rules::Grammar rules;
     std::string a = "1234";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
     auto match = Rules_NS_LogInput_NO_ALLOC(
-            Rules_NS_LogCapture(
-                new Rules::String("12", [] (auto x) { x.eraseAndRescan(); })
+            Grammar_LogCapture(rules, 
+                rules.make<Rules::String>("12", [] (auto x) { x.eraseAndRescan(); })
             )
     ).match(b);
 
@@ -970,21 +1055,22 @@ TEST(Rules, erase_test_01) {
 }
 
 TEST(Rules, erase_test_02) {
+    CPP::Rules::Grammar rules;
     std::string a = "1234";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
     auto match = Rules_NS_LogInput_NO_ALLOC(
-            Rules_NS_LogCapture(
-                    new Rules::Sequence({
-                        Rules_NS_LogInput(
-                            Rules_NS_LogCapture(
-                                new Rules::String("12", [] (auto x) { x.eraseAndRescan(); })
+            Grammar_LogCapture(rules, 
+                    rules.make<Rules::Sequence>({
+                        Grammar_LogInput(rules, 
+                            Grammar_LogCapture(rules, 
+                                rules.make<Rules::String>("12", [] (auto x) { x.eraseAndRescan(); })
                             )
                         ),
-                        Rules_NS_LogInput(
-                            Rules_NS_LogCapture(
-                                new Rules::Char('3')
+                        Grammar_LogInput(rules, 
+                            Grammar_LogCapture(rules, 
+                                rules.make<Rules::Char>('3')
                             )
                         )
                     })
@@ -1000,26 +1086,27 @@ TEST(Rules, erase_test_02) {
 }
 
 TEST(Rules, erase_test_03) {
+    CPP::Rules::Grammar rules;
     std::string a = "1234";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
     auto match = Rules_NS_LogInput_NO_ALLOC(
-            Rules_NS_LogCapture(
-                    new Rules::Sequence({
-                        Rules_NS_LogInput(
-                            Rules_NS_LogCapture(
-                                new Rules::Char('1')
+            Grammar_LogCapture(rules, 
+                    rules.make<Rules::Sequence>({
+                        Grammar_LogInput(rules, 
+                            Grammar_LogCapture(rules, 
+                                rules.make<Rules::Char>('1')
                             )
                         ),
-                        Rules_NS_LogInput(
-                            Rules_NS_LogCapture(
-                                new Rules::String("23", [] (auto x) { x.eraseAndRescan(); })
+                        Grammar_LogInput(rules, 
+                            Grammar_LogCapture(rules, 
+                                rules.make<Rules::String>("23", [] (auto x) { x.eraseAndRescan(); })
                             )
                         ),
-                        Rules_NS_LogInput(
-                            Rules_NS_LogCapture(
-                                new Rules::Char('4')
+                        Grammar_LogInput(rules, 
+                            Grammar_LogCapture(rules, 
+                                rules.make<Rules::Char>('4')
                             )
                         )
                     })
@@ -1035,13 +1122,14 @@ TEST(Rules, erase_test_03) {
 }
 
 TEST(Rules, replace_test_01) {
+    CPP::Rules::Grammar rules;
     std::string a = "1234";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
     auto match = Rules_NS_LogInput_NO_ALLOC(
-            Rules_NS_LogCapture(
-                new Rules::String("12", [] (auto x) { x.replaceAndRescan(""); })
+            Grammar_LogCapture(rules, 
+                rules.make<Rules::String>("12", [] (auto x) { x.replaceAndRescan(""); })
             )
     ).match(b);
 
@@ -1054,21 +1142,22 @@ TEST(Rules, replace_test_01) {
 }
 
 TEST(Rules, replace_test_02) {
+    CPP::Rules::Grammar rules;
     std::string a = "1234";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
     auto match = Rules_NS_LogInput_NO_ALLOC(
-            Rules_NS_LogCapture(
-                    new Rules::Sequence({
-                        Rules_NS_LogInput(
-                            Rules_NS_LogCapture(
-                                new Rules::String("12", [] (auto x) { x.replaceAndRescan(""); })
+            Grammar_LogCapture(rules, 
+                    rules.make<Rules::Sequence>({
+                        Grammar_LogInput(rules, 
+                            Grammar_LogCapture(rules, 
+                                rules.make<Rules::String>("12", [] (auto x) { x.replaceAndRescan(""); })
                             )
                         ),
-                        Rules_NS_LogInput(
-                            Rules_NS_LogCapture(
-                                new Rules::Char('3')
+                        Grammar_LogInput(rules, 
+                            Grammar_LogCapture(rules, 
+                                rules.make<Rules::Char>('3')
                             )
                         )
                     })
@@ -1084,13 +1173,14 @@ TEST(Rules, replace_test_02) {
 }
 
 TEST(Rules, replace_test_03) {
+    CPP::Rules::Grammar rules;
     std::string a = "1234";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
     auto match = Rules_NS_LogInput_NO_ALLOC(
-            Rules_NS_LogCapture(
-                new Rules::String("12", [] (auto x) { x.replaceAndRescan("5"); })
+            Grammar_LogCapture(rules, 
+                rules.make<Rules::String>("12", [] (auto x) { x.replaceAndRescan("5"); })
             )
     ).match(b);
 
@@ -1103,26 +1193,27 @@ TEST(Rules, replace_test_03) {
 }
 
 TEST(Rules, replace_test_04) {
+    CPP::Rules::Grammar rules;
     std::string a = "1234";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
     auto match = Rules_NS_LogInput_NO_ALLOC(
-            Rules_NS_LogCapture(
-                    new Rules::Sequence({
-                        Rules_NS_LogInput(
-                            Rules_NS_LogCapture(
-                                new Rules::String("12", [] (auto x) { x.replaceAndRescan("5"); })
+            Grammar_LogCapture(rules, 
+                    rules.make<Rules::Sequence>({
+                        Grammar_LogInput(rules, 
+                            Grammar_LogCapture(rules, 
+                                rules.make<Rules::String>("12", [] (auto x) { x.replaceAndRescan("5"); })
                             )
                         ),
-                        Rules_NS_LogInput(
-                            Rules_NS_LogCapture(
-                                new Rules::Char('5')
+                        Grammar_LogInput(rules, 
+                            Grammar_LogCapture(rules, 
+                                rules.make<Rules::Char>('5')
                             )
                         ),
-                        Rules_NS_LogInput(
-                            Rules_NS_LogCapture(
-                                new Rules::Char('3')
+                        Grammar_LogInput(rules, 
+                            Grammar_LogCapture(rules, 
+                                rules.make<Rules::Char>('3')
                             )
                         )
                     })
@@ -1138,16 +1229,17 @@ TEST(Rules, replace_test_04) {
 }
 
 TEST(Rules, replace_test_05) {
+    CPP::Rules::Grammar rules;
     std::string a = "1234";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
     auto match = Rules_NS_LogInput_NO_ALLOC(
-            Rules_NS_LogCapture(
-                    new Rules::Sequence({
-                        Rules_NS_LogInput(
-                            Rules_NS_LogCapture(
-                                new Rules::String("12", [] (auto x) { x.replaceAndRescan("5"); })
+            Grammar_LogCapture(rules, 
+                    rules.make<Rules::Sequence>({
+                        Grammar_LogInput(rules, 
+                            Grammar_LogCapture(rules, 
+                                rules.make<Rules::String>("12", [] (auto x) { x.replaceAndRescan("5"); })
                             )
                         ),
                     })
@@ -1163,21 +1255,22 @@ TEST(Rules, replace_test_05) {
 }
 
 TEST(Rules, replace_test_06) {
+    CPP::Rules::Grammar rules;
     std::string a = "1234";
     CPP::Iterator<std::string> b(a);
     using namespace CPP;
 
     auto match = Rules_NS_LogInput_NO_ALLOC(
-            Rules_NS_LogCapture(
-                    new Rules::Sequence({
-                        Rules_NS_LogInput(
-                            Rules_NS_LogCapture(
-                                new Rules::String("12", [] (auto x) { x.replaceAndRescan("5"); })
+            Grammar_LogCapture(rules, 
+                    rules.make<Rules::Sequence>({
+                        Grammar_LogInput(rules, 
+                            Grammar_LogCapture(rules, 
+                                rules.make<Rules::String>("12", [] (auto x) { x.replaceAndRescan("5"); })
                             )
                         ),
-                        Rules_NS_LogInput(
-                            Rules_NS_LogCapture(
-                                new Rules::Char('5')
+                        Grammar_LogInput(rules, 
+                            Grammar_LogCapture(rules, 
+                                rules.make<Rules::Char>('5')
                             )
                         ),
                     })
@@ -1204,6 +1297,7 @@ TEST(BackTracking, test_01) {
 }
 
 TEST(CPP_TESTS, General) {
+    CPP::Rules::Grammar rules;
     std::string a = "a";
     EXPECT_TRUE(CPP::Rules::Range({'a'}).match(a));
     a = "b";
@@ -1215,28 +1309,28 @@ TEST(CPP_TESTS, General) {
 
     std::string b = "abcd";
     CPP::Iterator A(b);
-    auto s = new CPP::Rules::Sequence(
+    auto s = rules.make<CPP::Rules::Sequence>(
             {
-                    new CPP::Rules::Char('a'), new CPP::Rules::Char('b'),
-                    new CPP::Rules::Char('c'), new CPP::Rules::Char('d')
+                    rules.make<CPP::Rules::Char>('a'), rules.make<CPP::Rules::Char>('b'),
+                    rules.make<CPP::Rules::Char>('c'), rules.make<CPP::Rules::Char>('d')
             });
-    auto s1 = new CPP::Rules::RuleHolder(s);
+    auto s1 = rules.make<CPP::Rules::RuleHolder>(s);
     EXPECT_TRUE(!CPP::Rules::NotAt(s1).match(A));
     A.reset();
-    auto m = new CPP::Rules::NotAt(new CPP::Rules::Sequence(
+    auto m = rules.make<CPP::Rules::NotAt>(rules.make<CPP::Rules::Sequence>(
             {
-                    new CPP::Rules::Char('a'), new CPP::Rules::Char('b'),
-                    new CPP::Rules::Char('c'), new CPP::Rules::Char('e')
+                    rules.make<CPP::Rules::Char>('a'), rules.make<CPP::Rules::Char>('b'),
+                    rules.make<CPP::Rules::Char>('c'), rules.make<CPP::Rules::Char>('e')
             }));
-    auto m1 = new CPP::Rules::At(s);
+    auto m1 = rules.make<CPP::Rules::At>(s);
     EXPECT_TRUE(CPP::Rules::At(s).match(A));
     EXPECT_TRUE(CPP::Rules::Sequence({m1, m, m1, m, s}).match(A));
 
 
     std::string c = "a";
     CPP::Iterator ci(c);
-    auto anyA = new CPP::Rules::Any([](CPP::Rules::Input) { XOut << "A" << std::endl; });
-    auto anyB = new CPP::Rules::RuleHolder(new CPP::Rules::TemporaryAction(anyA), [](CPP::Rules::Input) { XOut << "B" << std::endl; });
+    auto anyA = rules.make<CPP::Rules::Any>([](CPP::Rules::Input) { XOut << "A" << std::endl; });
+    auto anyB = rules.make<CPP::Rules::RuleHolder>(rules.make<CPP::Rules::TemporaryAction>(anyA), [](CPP::Rules::Input) { XOut << "B" << std::endl; });
     EXPECT_TRUE(anyA->match(ci));
     ci.reset();
     EXPECT_TRUE(anyB->match(ci));
@@ -1245,43 +1339,43 @@ TEST(CPP_TESTS, General) {
     EXPECT_TRUE(!CPP::Rules::Fail().match(c));
     EXPECT_TRUE(CPP::Rules::AdvanceInputBy().match(c));
     EXPECT_TRUE(CPP::Rules::AdvanceInputBy(1).match(c));
-    EXPECT_TRUE(CPP::Rules::Sequence({new CPP::Rules::Success(), new CPP::Rules::Char('a')}).match(c));
-    EXPECT_TRUE(CPP::Rules::Or({new CPP::Rules::Char('b'), new CPP::Rules::Char('a')}).match(c));
-    EXPECT_TRUE(CPP::Rules::Or({new CPP::Rules::Sequence({new CPP::Rules::Char('b')}), new CPP::Rules::Char('a')}).match(c));
-    EXPECT_TRUE(CPP::Rules::Or({new CPP::Rules::Sequence({new CPP::Rules::Char('a'), new CPP::Rules::Char('b')}), new CPP::Rules::Char('a')}).match(c));
-    EXPECT_TRUE(CPP::Rules::Or({new CPP::Rules::Sequence({new CPP::Rules::Char('b'), new CPP::Rules::Char('a')}), new CPP::Rules::Char('a')}).match(c));
-    EXPECT_TRUE(CPP::Rules::Or({new CPP::Rules::Sequence({new CPP::Rules::Success(), new CPP::Rules::Char('b')}), new CPP::Rules::Char('a')}).match(c));
-    EXPECT_TRUE(CPP::Rules::Or({new CPP::Rules::Sequence({new CPP::Rules::Success(), new CPP::Rules::Fail()}), new CPP::Rules::Char('a')}).match(c));
-    EXPECT_TRUE(CPP::Rules::Or({new CPP::Rules::Sequence({new CPP::Rules::Fail(), new CPP::Rules::Char('b')}), new CPP::Rules::Char('a')}).match(c));
-    EXPECT_TRUE(CPP::Rules::Or({new CPP::Rules::Sequence({new CPP::Rules::Any(), new CPP::Rules::Char('b')}), new CPP::Rules::Char('a')}).match(c));
-    EXPECT_TRUE(CPP::Rules::Or({new CPP::Rules::Sequence({new CPP::Rules::AdvanceInputBy(5), new CPP::Rules::Fail()}), new CPP::Rules::Char('a')}).match(c));
-    EXPECT_TRUE(CPP::Rules::Or({new CPP::Rules::Sequence({new CPP::Rules::RuleHolder(new CPP::Rules::AdvanceInputBy(5)), new CPP::Rules::Fail()}), new CPP::Rules::Char('a')}).match(c));
-    EXPECT_TRUE(CPP::Rules::Or({new CPP::Rules::Sequence({new CPP::Rules::Success(), new CPP::Rules::Fail()}), new CPP::Rules::Char('a')}).match(c));
-    EXPECT_TRUE(CPP::Rules::Or({new CPP::Rules::TemporaryAction(
-        new CPP::Rules::Or({
-            new CPP::Rules::Sequence({
-                new CPP::Rules::Success(),
-                new CPP::Rules::Fail()
+    EXPECT_TRUE(CPP::Rules::Sequence({rules.make<CPP::Rules::Success>(), rules.make<CPP::Rules::Char>('a')}).match(c));
+    EXPECT_TRUE(CPP::Rules::Or({rules.make<CPP::Rules::Char>('b'), rules.make<CPP::Rules::Char>('a')}).match(c));
+    EXPECT_TRUE(CPP::Rules::Or({rules.make<CPP::Rules::Sequence>({rules.make<CPP::Rules::Char>('b')}), rules.make<CPP::Rules::Char>('a')}).match(c));
+    EXPECT_TRUE(CPP::Rules::Or({rules.make<CPP::Rules::Sequence>({rules.make<CPP::Rules::Char>('a'), rules.make<CPP::Rules::Char>('b')}), rules.make<CPP::Rules::Char>('a')}).match(c));
+    EXPECT_TRUE(CPP::Rules::Or({rules.make<CPP::Rules::Sequence>({rules.make<CPP::Rules::Char>('b'), rules.make<CPP::Rules::Char>('a')}), rules.make<CPP::Rules::Char>('a')}).match(c));
+    EXPECT_TRUE(CPP::Rules::Or({rules.make<CPP::Rules::Sequence>({rules.make<CPP::Rules::Success>(), rules.make<CPP::Rules::Char>('b')}), rules.make<CPP::Rules::Char>('a')}).match(c));
+    EXPECT_TRUE(CPP::Rules::Or({rules.make<CPP::Rules::Sequence>({rules.make<CPP::Rules::Success>(), rules.make<CPP::Rules::Fail>()}), rules.make<CPP::Rules::Char>('a')}).match(c));
+    EXPECT_TRUE(CPP::Rules::Or({rules.make<CPP::Rules::Sequence>({rules.make<CPP::Rules::Fail>(), rules.make<CPP::Rules::Char>('b')}), rules.make<CPP::Rules::Char>('a')}).match(c));
+    EXPECT_TRUE(CPP::Rules::Or({rules.make<CPP::Rules::Sequence>({rules.make<CPP::Rules::Any>(), rules.make<CPP::Rules::Char>('b')}), rules.make<CPP::Rules::Char>('a')}).match(c));
+    EXPECT_TRUE(CPP::Rules::Or({rules.make<CPP::Rules::Sequence>({rules.make<CPP::Rules::AdvanceInputBy>(5), rules.make<CPP::Rules::Fail>()}), rules.make<CPP::Rules::Char>('a')}).match(c));
+    EXPECT_TRUE(CPP::Rules::Or({rules.make<CPP::Rules::Sequence>({rules.make<CPP::Rules::RuleHolder>(rules.make<CPP::Rules::AdvanceInputBy>(5)), rules.make<CPP::Rules::Fail>()}), rules.make<CPP::Rules::Char>('a')}).match(c));
+    EXPECT_TRUE(CPP::Rules::Or({rules.make<CPP::Rules::Sequence>({rules.make<CPP::Rules::Success>(), rules.make<CPP::Rules::Fail>()}), rules.make<CPP::Rules::Char>('a')}).match(c));
+    EXPECT_TRUE(CPP::Rules::Or({rules.make<CPP::Rules::TemporaryAction>(
+        rules.make<CPP::Rules::Or>({
+            rules.make<CPP::Rules::Sequence>({
+                rules.make<CPP::Rules::Success>(),
+                rules.make<CPP::Rules::Fail>()
             }),
-            new CPP::Rules::Fail([](auto x) {
+            rules.make<CPP::Rules::Fail>([](auto x) {
                 XOut << "fail" << std::endl;
             }),
         }), [](auto x) {
             XOut << "or success" << std::endl;
         }),
-        new CPP::Rules::Char('a')
+        rules.make<CPP::Rules::Char>('a')
     }).match(c));
 
     EXPECT_TRUE(CPP::Rules::OneOrMore(
-        new CPP::Rules::Or({
-            new CPP::Rules::Sequence({
-                new CPP::Rules::Success(),
-                new CPP::Rules::At(new CPP::Rules::Char('f')),
-                new CPP::Rules::Char('f')
+        rules.make<CPP::Rules::Or>({
+            rules.make<CPP::Rules::Sequence>({
+                rules.make<CPP::Rules::Success>(),
+                rules.make<CPP::Rules::At>(rules.make<CPP::Rules::Char>('f')),
+                rules.make<CPP::Rules::Char>('f')
             }, [](auto x) {
                 XOut << "sequence success" << std::endl;
             }),
-            new CPP::Rules::Any([](CPP::Rules::Input x) {
+            rules.make<CPP::Rules::Any>([](CPP::Rules::Input x) {
                 XOut << "any success: " << x.string() << std::endl;
             })
         }, [](CPP::Rules::Input x) {
@@ -1294,73 +1388,74 @@ TEST(CPP_TESTS, General) {
 // 1 foo(foo) 2 foo(bar) 3
 
 TEST(Macro_Tests, A) {
+    CPP::Rules::Grammar rules;
     std::string a = "1 foo(foo) 2 foo(bar) 3";
 
     XOut << "a: " << a << std::endl;
 
-    auto grammar = new CPP::Rules::Sequence({
-        CPP_Rules_LogMatchStatus(new CPP::Rules::String("1 ")),
-        CPP_Rules_LogMatchStatus(new CPP::Rules::String("foo(foo)", [] (CPP::Rules::Input in) {
+    auto grammar = rules.make<CPP::Rules::Sequence>({
+        Grammar_LogMatchStatus(rules, rules.make<CPP::Rules::String>("1 ")),
+        Grammar_LogMatchStatus(rules, rules.make<CPP::Rules::String>("foo(foo)", [] (CPP::Rules::Input in) {
             XOut << "capture: " << in.string() << std::endl;
             in.replace("9 x(x) 9");
         })),
-        CPP_Rules_LogMatchStatus(new CPP::Rules::String(" 2 ")),
-        CPP_Rules_LogMatchStatus(new CPP::Rules::String("foo(bar)", [] (CPP::Rules::Input in) {
+        Grammar_LogMatchStatus(rules, rules.make<CPP::Rules::String>(" 2 ")),
+        Grammar_LogMatchStatus(rules, rules.make<CPP::Rules::String>("foo(bar)", [] (CPP::Rules::Input in) {
             XOut << "capture: " << in.string() << std::endl;
             in.replace("9 x(x) 9");
         })),
-        CPP_Rules_LogMatchStatus(new CPP::Rules::String(" 3"))
+        Grammar_LogMatchStatus(rules, rules.make<CPP::Rules::String>(" 3"))
     });
 
     EXPECT_TRUE(grammar->match(a));
 
     XOut << "a: " << a << std::endl;
 
-    delete grammar;
 }
 
 TEST(Macro_Tests, B) {
+    CPP::Rules::Grammar rules;
     std::string a = "1 foo(foo) 2 foo(bar) 3";
 
     XOut << "a: " << a << std::endl;
 
-    auto grammar = new CPP::Rules::Sequence({
-        CPP_Rules_LogMatchStatus(new CPP::Rules::String("1 ")),
-        CPP_Rules_LogMatchStatus(new CPP::Rules::String("foo(foo)", [] (CPP::Rules::Input in) {
+    auto grammar = rules.make<CPP::Rules::Sequence>({
+        Grammar_LogMatchStatus(rules, rules.make<CPP::Rules::String>("1 ")),
+        Grammar_LogMatchStatus(rules, rules.make<CPP::Rules::String>("foo(foo)", [] (CPP::Rules::Input in) {
             XOut << "capture: " << in.string() << std::endl;
             in.replace("9 foo(foo) 9");
         })),
-        CPP_Rules_LogMatchStatus(new CPP::Rules::String(" 2 ")),
-        CPP_Rules_LogMatchStatus(new CPP::Rules::String("foo(bar)", [] (CPP::Rules::Input in) {
+        Grammar_LogMatchStatus(rules, rules.make<CPP::Rules::String>(" 2 ")),
+        Grammar_LogMatchStatus(rules, rules.make<CPP::Rules::String>("foo(bar)", [] (CPP::Rules::Input in) {
             XOut << "capture: " << in.string() << std::endl;
             in.replace("9 bar(bar) 9");
         })),
-        CPP_Rules_LogMatchStatus(new CPP::Rules::String(" 3"))
+        Grammar_LogMatchStatus(rules, rules.make<CPP::Rules::String>(" 3"))
     });
 
     EXPECT_TRUE(grammar->match(a));
 
     XOut << "a: " << a << std::endl;
 
-    delete grammar;
 }
 
 TEST(Macro_Tests, C) {
+    CPP::Rules::Grammar rules;
     std::string a = "1 foo(foo) 2 foo(bar) 3";
 
     XOut << "a: " << a << std::endl;
 
-    auto identifier = new CPP::Rules::Sequence({
-        new CPP::Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new CPP::Rules::ZeroOrMore(
-            new CPP::Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = rules.make<CPP::Rules::Sequence>({
+        rules.make<CPP::Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<CPP::Rules::ZeroOrMore>(
+            rules.make<CPP::Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
         )
     });
 
-    auto parens_open = new CPP::Rules::Char('(');
-    auto parens_close = new CPP::Rules::Char(')');
+    auto parens_open = rules.make<CPP::Rules::Char>('(');
+    auto parens_close = rules.make<CPP::Rules::Char>(')');
 
-    auto function = new CPP::Rules::Sequence({
+    auto function = rules.make<CPP::Rules::Sequence>({
         identifier, parens_open, identifier, parens_close
     });
 
@@ -1369,42 +1464,42 @@ TEST(Macro_Tests, C) {
         in.replace("9 x(x) 9");
     };
 
-    auto grammar = new CPP::Rules::Sequence({
-        new CPP::Rules::String("1 "),
+    auto grammar = rules.make<CPP::Rules::Sequence>({
+        rules.make<CPP::Rules::String>("1 "),
         function,
-        new CPP::Rules::String(" 2 "),
+        rules.make<CPP::Rules::String>(" 2 "),
         function,
-        new CPP::Rules::String(" 3")
+        rules.make<CPP::Rules::String>(" 3")
     });
 
     EXPECT_TRUE(grammar->match(a));
 
     XOut << "a: " << a << std::endl;
 
-    delete grammar;
 }
 
 TEST(Macro_Tests, D) {
+    CPP::Rules::Grammar rules;
     std::string a = "1 foo(foo) 2 foo(bar) 3";
 
     XOut << "a: " << a << std::endl;
 
-    auto identifier = new CPP::Rules::Sequence({
-        new CPP::Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new CPP::Rules::ZeroOrMore(
-            new CPP::Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = rules.make<CPP::Rules::Sequence>({
+        rules.make<CPP::Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<CPP::Rules::ZeroOrMore>(
+            rules.make<CPP::Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
         )
     });
 
-    auto parens_open = new CPP::Rules::Char('(');
-    auto parens_close = new CPP::Rules::Char(')');
+    auto parens_open = rules.make<CPP::Rules::Char>('(');
+    auto parens_close = rules.make<CPP::Rules::Char>(')');
 
-    auto function_tmp = new CPP::Rules::Sequence({
+    auto function_tmp = rules.make<CPP::Rules::Sequence>({
         identifier, parens_open, identifier, parens_close
     });
 
-    auto function = new CPP::Rules::Sequence({
-        new CPP::Rules::At(function_tmp), function_tmp
+    auto function = rules.make<CPP::Rules::Sequence>({
+        rules.make<CPP::Rules::At>(function_tmp), function_tmp
     });
 
     function->action = [] (CPP::Rules::Input in) {
@@ -1412,10 +1507,10 @@ TEST(Macro_Tests, D) {
         in.replace("9 x(x) 9");
     };
 
-    auto grammar = new CPP::Rules::OneOrMore(
-        new CPP::Rules::Or({
+    auto grammar = rules.make<CPP::Rules::OneOrMore>(
+        rules.make<CPP::Rules::Or>({
            function,
-           new CPP::Rules::Any()
+           rules.make<CPP::Rules::Any>()
        })
     );
 
@@ -1423,7 +1518,6 @@ TEST(Macro_Tests, D) {
 
     XOut << "a: " << a << std::endl;
 
-    delete grammar;
 }
 
 // #define x x y
@@ -1437,6 +1531,7 @@ a: 1 x x y 2 x x y
 [       OK ] Macro_Tests.E (0 ms)
 */
 TEST(Macro_Tests, E) {
+    CPP::Rules::Grammar rules;
     std::string a = "1 x 2 x";
 
     XOut << "a: " << a << std::endl;
@@ -1451,38 +1546,35 @@ TEST(Macro_Tests, E) {
      */
 
 
-    auto x_0 = new CPP::Rules::RuleHolder(new CPP::Rules::Char('x'));
+    auto x_0 = rules.make<CPP::Rules::RuleHolder>(rules.make<CPP::Rules::Char>('x'));
 
     CPP::Rules::Action base_0;
     CPP::Rules::Action base_1;
     CPP::Rules::Action base_2;
     base_0 = [&](CPP::Rules::Input in) {
-        delete x_0->rule;
         // #define x x y
-        x_0->rule = new CPP::Rules::String("x y");
+        x_0->rule = rules.make<CPP::Rules::String>("x y");
         x_0->action = base_1;
         in.replaceAndRescan("x y");
     };
     base_1 = [&](CPP::Rules::Input in) {
-        delete x_0->rule;
         // #define y x y
-        x_0->rule = new CPP::Rules::String("x x y");
+        x_0->rule = rules.make<CPP::Rules::String>("x x y");
         x_0->action = base_2;
         in.replaceAndRescan("x x y");
     };
     base_2 = [&](CPP::Rules::Input in) {
-        delete x_0->rule;
-        x_0->rule = new CPP::Rules::Char('x');
+        x_0->rule = rules.make<CPP::Rules::Char>('x');
         x_0->action = base_0;
         // no more replacements
     };
 
     x_0->action = base_0;
 
-    auto grammar = new CPP::Rules::OneOrMore(
-        new CPP::Rules::Or({
+    auto grammar = rules.make<CPP::Rules::OneOrMore>(
+        rules.make<CPP::Rules::Or>({
            x_0,
-           new CPP::Rules::Any()
+           rules.make<CPP::Rules::Any>()
        })
     );
 
@@ -1490,7 +1582,6 @@ TEST(Macro_Tests, E) {
 
     XOut << "a: " << a << std::endl;
 
-    delete grammar;
 }
 
 /*
@@ -1508,6 +1599,7 @@ a: 1 x x y 2 x x y
 [       OK ] Macro_Tests.F (0 ms)
 */
 TEST(Macro_Tests, F) {
+    CPP::Rules::Grammar rules;
     std::string a = "1 x 2 x";
 
     XOut << "a: " << a << std::endl;
@@ -1521,15 +1613,15 @@ TEST(Macro_Tests, F) {
 14:50:56 smallville7123: so "x" -> "x y" -> "x x y" -> no more expansions, pop to initial rule
      */
 
-    auto x_stack = new CPP::Rules::Stack();
+    auto x_stack = rules.make<CPP::Rules::Stack>();
 
-    x_stack->setBase(new CPP::Rules::Char('x'), [&](CPP::Rules::Input in) {
+    x_stack->setBase(rules.make<CPP::Rules::Char>('x'), [&](CPP::Rules::Input in) {
         // #define x x y
         XOut << "base" << std::endl;
-        x_stack->push(new CPP::Rules::String("x y"),[&](CPP::Rules::Input in) {
+        x_stack->push(rules.make<CPP::Rules::String>("x y"),[&](CPP::Rules::Input in) {
             // #define y x y
             XOut << "base + 1" << std::endl;
-            x_stack->push(new CPP::Rules::String("x x y"), [&](CPP::Rules::Input in) {
+            x_stack->push(rules.make<CPP::Rules::String>("x x y"), [&](CPP::Rules::Input in) {
                 // no more replacements
                 XOut << "base + 2" << std::endl;
                 XOut << "pop to base" << std::endl;
@@ -1543,10 +1635,10 @@ TEST(Macro_Tests, F) {
         in.replaceAndRescan("x y");
     });
 
-    auto grammar = new CPP::Rules::OneOrMore(
-        new CPP::Rules::Or({
+    auto grammar = rules.make<CPP::Rules::OneOrMore>(
+        rules.make<CPP::Rules::Or>({
            x_stack,
-           new CPP::Rules::Any()
+           rules.make<CPP::Rules::Any>()
        })
     );
 
@@ -1554,25 +1646,25 @@ TEST(Macro_Tests, F) {
 
     XOut << "a: " << a << std::endl;
 
-    delete grammar;
 }
 
 TEST(Macro_Tests, G) {
+    CPP::Rules::Grammar rules;
     std::string a = "1 foo(foo) 2 foo(bar) 3";
 
     XOut << "a: " << a << std::endl;
 
-    auto identifier = new CPP::Rules::Sequence({
-        new CPP::Rules::Range({'a', 'z', 'A', 'Z', '_'}),
-        new CPP::Rules::ZeroOrMore(
-            new CPP::Rules::Range({'a', 'z', 'A', 'Z', '0', '9', '_'})
+    auto identifier = rules.make<CPP::Rules::Sequence>({
+        rules.make<CPP::Rules::Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<CPP::Rules::ZeroOrMore>(
+            rules.make<CPP::Rules::Range>({'a', 'z', 'A', 'Z', '0', '9', '_'})
         )
     });
 
-    auto parens_open = new CPP::Rules::Char('(');
-    auto parens_close = new CPP::Rules::Char(')');
+    auto parens_open = rules.make<CPP::Rules::Char>('(');
+    auto parens_close = rules.make<CPP::Rules::Char>(')');
 
-    auto function_tmp = new CPP::Rules::Sequence({
+    auto function_tmp = rules.make<CPP::Rules::Sequence>({
         identifier, parens_open, identifier, parens_close
     });
 
@@ -1584,22 +1676,22 @@ TEST(Macro_Tests, G) {
 
 
 
-    auto function_stack = new CPP::Rules::Stack();
+    auto function_stack = rules.make<CPP::Rules::Stack>();
 
     function_stack->setBase(
-        new CPP::Rules::Sequence({
-            new CPP::Rules::At(function_tmp), function_tmp
+        rules.make<CPP::Rules::Sequence>({
+            rules.make<CPP::Rules::At>(function_tmp), function_tmp
         }),
         [&] (CPP::Rules::Input in) {
             XOut << "capture: " << in.string() << std::endl;
             in.replace("9 x(x) 9");
             function_stack->push(
-                new CPP::Rules::OneOrMore(
-                    new CPP::Rules::Or({
-                        new CPP::Rules::Sequence({
-                            new CPP::Rules::At(function_tmp), function_tmp
+                rules.make<CPP::Rules::OneOrMore>(
+                    rules.make<CPP::Rules::Or>({
+                        rules.make<CPP::Rules::Sequence>({
+                            rules.make<CPP::Rules::At>(function_tmp), function_tmp
                         }),
-                        new CPP::Rules::Any()
+                        rules.make<CPP::Rules::Any>()
                     })
                 ),
                 [&](CPP::Rules::Input in) {
@@ -1609,10 +1701,10 @@ TEST(Macro_Tests, G) {
         }
     );
 
-    auto grammar = new CPP::Rules::OneOrMore(
-        new CPP::Rules::Or({
+    auto grammar = rules.make<CPP::Rules::OneOrMore>(
+        rules.make<CPP::Rules::Or>({
            function_stack,
-           new CPP::Rules::Any()
+           rules.make<CPP::Rules::Any>()
        })
     );
 
@@ -1620,5 +1712,1371 @@ TEST(Macro_Tests, G) {
 
     XOut << "a: " << a << std::endl;
 
-    delete grammar;
+}
+
+static CPP::Rules::Rule * compiler_test_grammar(CPP::Rules::Grammar & rules) {
+    using namespace CPP::Rules;
+    auto identifier = rules.make<Sequence>({
+        rules.make<Range>({'a', 'z', 'A', 'Z', '_'}),
+        rules.make<ZeroOrMore>(rules.make<Range>({'a', 'z', 'A', 'Z', '0', '9', '_'}))
+    });
+    auto balanced_parens = rules.make<Sequence>(std::initializer_list<Rule*>());
+    balanced_parens->rules = {
+        rules.make<Char>('('),
+        rules.make<MatchBUntilA>(
+            rules.make<Char>(')'),
+            rules.make<Or>({
+                balanced_parens,
+                rules.make<ErrorIfMatch>(rules.make<EndOfFile>(), "Unterminated parenthesis"),
+                rules.make<AdvanceInputBy>(1)
+            })
+        )
+    };
+    return rules.make<OneOrMore>(
+        rules.make<Or>({
+            rules.make<Sequence>({
+                rules.make<At>(rules.make<Sequence>({identifier, rules.make<Optional>(rules.make<OneOrMore>(rules.make<Char>(' '))), rules.make<Char>('(')})),
+                identifier,
+                balanced_parens
+            }),
+            rules.make<Sequence>({rules.make<String>("//"), rules.make<Until>(rules.make<NewlineOrEOF>())}),
+            identifier,
+            rules.make<Sequence>({rules.make<NotAt>(rules.make<Char>('#')), rules.make<Any>()}),
+            rules.make<Char>('#')
+        })
+    );
+}
+
+static void expect_same_match(CPP::Rules::Rule & grammar, CPP::Rules::Program & program, const std::string & input) {
+    std::string a = input;
+    std::string b = input;
+    CPP::Iterator<std::string> ia(a);
+    CPP::Iterator<std::string> ib(b);
+    auto ma = grammar.match(ia);
+    auto mb = program.match(ib);
+    EXPECT_EQ(ma.matched, mb.matched) << input;
+    EXPECT_EQ(ma.matches, mb.matches) << input;
+    EXPECT_EQ(ia.currentPosition(), ib.currentPosition()) << input;
+    ASSERT_EQ(ia.iteratorStack.size(), ib.iteratorStack.size()) << input;
+    for (size_t i = 0; i < ia.iteratorStack.size(); ++i) {
+        EXPECT_EQ(ia.iteratorStack[i] - a.cbegin(), ib.iteratorStack[i] - b.cbegin()) << input;
+    }
+}
+
+static const char * compiler_test_inputs[] = {"", "a", "foo(bar(baz), (x)) y", "a // b\nc(d)", "#x", "x #", "f (1)"};
+
+TEST(Rules_Compiler, matches_like_graph) {
+    CPP::Rules::Grammar rules;
+    auto grammar = CPP::Rules::RuleHolder(compiler_test_grammar(rules));
+    auto program = CPP::Rules::compile(grammar);
+    for (std::string input : compiler_test_inputs) {
+        expect_same_match(grammar, program, input);
+    }
+}
+
+TEST(Rules_Compiler, recursive_rules_share_a_slot) {
+    CPP::Rules::Grammar rules;
+    using namespace CPP::Rules;
+    auto balanced_parens = rules.make<Sequence>(std::initializer_list<Rule*>());
+    balanced_parens->rules = {
+        rules.make<Char>('('),
+        rules.make<MatchBUntilA>(rules.make<Char>(')'), rules.make<Or>({balanced_parens, rules.make<AdvanceInputBy>(1)}))
+    };
+    RuleHolder grammar(balanced_parens);
+    auto program = compile(grammar);
+    EXPECT_EQ(program.size(), 6);
+    std::string a = "((a)(b(c)))d";
+    CPP::Iterator<std::string> b(a);
+    EXPECT_TRUE(program.match(b));
+    EXPECT_EQ(b.currentPosition(), 11);
+    EXPECT_EQ(b.peekNext(), 'd');
+}
+
+TEST(Rules_Compiler, actions_modify_input) {
+    CPP::Rules::Grammar rules;
+    using namespace CPP::Rules;
+    std::string a = "a/* b */c// d\ne";
+    OneOrMore grammar(
+        rules.make<Or>({
+            rules.make<Sequence>({
+                rules.make<String>("//"),
+                rules.make<Until>(rules.make<NewlineOrEOF>())
+            }, [](Input in) {
+                in.eraseAndRescan();
+            }),
+            rules.make<Sequence>({
+                rules.make<String>("/*"),
+                rules.make<Until>(rules.make<String>("*/"))
+            }, [](Input in) {
+                in.eraseAndRescan();
+            }),
+            rules.make<Any>()
+        })
+    );
+    EXPECT_TRUE(compile(grammar).match(a));
+    EXPECT_EQ(a, "ace");
+}
+
+TEST(Rules_Compiler, actions_run_in_order) {
+    CPP::Rules::Grammar rules;
+    using namespace CPP::Rules;
+    std::string a = "ab";
+    std::string log;
+    Sequence grammar({
+        rules.make<Char>('a', [&](Input) { log += "a"; }),
+        rules.make<TemporaryAction>(rules.make<Char>('b', [&](Input) { log += "!"; }), [&](Input) { log += "b"; }),
+        rules.make<At>(rules.make<Char>('x', [&](Input) { log += "!"; })),
+    }, [&](Input) { log += "s"; });
+    std::string b = a;
+    EXPECT_FALSE(grammar.match(a));
+    std::string expected = log;
+    log.clear();
+    EXPECT_FALSE(compile(grammar).match(b));
+    EXPECT_EQ(log, expected);
+    EXPECT_EQ(log, "ab");
+}
+
+TEST(Rules_Compiler, memoized_matches_like_graph) {
+    CPP::Rules::Grammar rules;
+    auto grammar = CPP::Rules::RuleHolder(compiler_test_grammar(rules));
+    auto program = CPP::Rules::compile(grammar);
+    program.memoize();
+    for (std::string input : compiler_test_inputs) {
+        expect_same_match(grammar, program, input);
+    }
+    // the identifier matched by the function call lookahead is replayed
+    EXPECT_NE(program.memoHits, 0);
+}
+
+TEST(Rules_Compiler, memo_is_invalidated_by_input_changes) {
+    CPP::Rules::Grammar rules;
+    using namespace CPP::Rules;
+    auto ab = rules.make<Sequence>({rules.make<Char>('a'), rules.make<Char>('b')});
+    // "cd" is rewritten to "ab" and rescanned, the failed attempt to match
+    // "ab" at the same offset must not be replayed afterwards
+    OneOrMore grammar(
+        rules.make<Or>({
+            rules.make<Sequence>({
+                rules.make<NotAt>(ab),
+                rules.make<Sequence>({rules.make<Char>('c'), rules.make<Char>('d')}, [](Input in) {
+                    in.replaceAndRescan("ab");
+                })
+            }),
+            ab
+        })
+    );
+    auto program = compile(grammar);
+    program.memoize();
+    std::string a = "cd";
+    CPP::Iterator<std::string> b(a);
+    EXPECT_TRUE(program.match(b));
+    EXPECT_EQ(a, "ab");
+    EXPECT_EQ(b.currentPosition(), 2);
+}
+
+TEST(Rules_Compiler, memo_replays_a_failure_with_its_end) {
+    using namespace CPP::Rules;
+    Grammar rules;
+    Rule * abc = rules.make<Sequence>({rules.make<Char>('a'), rules.make<Char>('b'), rules.make<Char>('c')});
+    // abc fails after ab, then is tried again at the same offset
+    Or grammar({rules.make<Sequence>({abc, rules.make<Char>('z')}), abc});
+    auto program = compile(grammar);
+    program.memoize();
+    std::string a = "abx";
+    std::string b = "abx";
+    CPP::Iterator<std::string> ia(a);
+    CPP::Iterator<std::string> ib(b);
+    auto live = grammar.match(ia);
+    auto replayed = program.match(ib);
+    EXPECT_EQ(program.memoHits, 1u);
+    EXPECT_FALSE(replayed.matched);
+    EXPECT_EQ(ib.currentPosition(replayed.end), 2);
+    EXPECT_EQ(ia.currentPosition(live.end), ib.currentPosition(replayed.end));
+}
+
+TEST(Rules_Compiler, or_dispatches_on_first_character) {
+    CPP::Rules::Grammar rules;
+    using namespace CPP::Rules;
+    std::string log;
+    Or grammar({
+        rules.make<Char>('a'),
+        rules.make<Sequence>({rules.make<Char>('b'), rules.make<Char>('c')}),
+        rules.make<Range>({'0', '9'}),
+        rules.make<Sequence>({rules.make<Optional>(rules.make<Char>('x'), [&](Input) { log += "o"; }), rules.make<Char>('y')}),
+        rules.make<Any>()
+    });
+    auto program = compile(grammar);
+    auto candidates = [&](uint32_t key) {
+        return program.dispatch[program.code[0].table * program.dispatchKeys + key].count;
+    };
+    // the sequence starting with an Optional is tried for every key
+    EXPECT_EQ(candidates('a'), 3);
+    EXPECT_EQ(candidates('b'), 3);
+    EXPECT_EQ(candidates('5'), 3);
+    EXPECT_EQ(candidates('z'), 2);
+    EXPECT_EQ(candidates(program.endOfFileKey), 1);
+
+    // alternatives that fail with side effects are still tried
+    std::string a = "z";
+    std::string b = "z";
+    EXPECT_TRUE(grammar.match(a));
+    std::string expected = log;
+    log.clear();
+    EXPECT_TRUE(program.match(b));
+    EXPECT_EQ(log, expected);
+    EXPECT_EQ(log, "o");
+}
+
+TEST(Rules_Compiler, or_picks_again_after_an_alternative_rewrites_the_input) {
+    CPP::Rules::Grammar rules;
+    using namespace CPP::Rules;
+    // the first alternative turns the a into an x, then fails
+    Or grammar({
+        rules.make<Sequence>({rules.make<Char>('a', [](Input in) { in.replaceAndRescan('x'); }), rules.make<Char>('z')}),
+        rules.make<Char>('y'),
+        rules.make<Char>('x')
+    });
+    auto program = compile(grammar);
+    std::string a = "ab";
+    std::string b = "ab";
+    EXPECT_TRUE(grammar.match(a));
+    EXPECT_EQ(a, "xb");
+    CPP::Iterator<std::string> iterator(b);
+    EXPECT_TRUE(program.match(iterator));
+    EXPECT_EQ(b, "xb");
+    EXPECT_EQ(iterator.currentPosition(), 1);
+}
+
+TEST(Scan, span_matches_byte_loop) {
+    CPP::Scan::CharacterSet identifier;
+    identifier.add('a', 'z');
+    identifier.add('A', 'Z');
+    identifier.add('0', '9');
+    identifier.add('_');
+    EXPECT_EQ(identifier.intervals, 4);
+    CPP::Scan::CharacterSet scattered;
+    for (int character = 1; character < 256; character += 3) {
+        scattered.add(static_cast<unsigned char>(character));
+    }
+    EXPECT_EQ(scattered.intervals, -1);
+    CPP::Scan::CharacterSet high;
+    high.add(0x80, 0xFF);
+
+    std::string input;
+    for (int i = 0; i < 200; i++) {
+        input += static_cast<char>((i * 37 + 11) % 256);
+    }
+    for (const CPP::Scan::CharacterSet * set : {&identifier, &scattered, &high}) {
+        for (size_t begin = 0; begin < input.size(); begin++) {
+            // runs of every length up to the end of the input
+            std::string run(begin, 'a');
+            run += static_cast<char>(0x80);
+            run += input;
+            for (size_t length = 0; length <= run.size(); length += 7) {
+                const char * p = run.data();
+                size_t expected = 0;
+                while (expected < length && set->contains(p[expected])) expected++;
+                EXPECT_EQ(CPP::Scan::span(*set, p, p + length), expected);
+            }
+        }
+    }
+}
+
+TEST(Scan, find_matches_byte_loop) {
+    CPP::Scan::CharacterSet newline;
+    newline.add('\n');
+    CPP::Scan::CharacterSet parens;
+    parens.add('(');
+    parens.add(')');
+    parens.add(',');
+    CPP::Scan::CharacterSet scattered;
+    for (int character = 1; character < 256; character += 3) {
+        scattered.add(static_cast<unsigned char>(character));
+    }
+    for (const CPP::Scan::CharacterSet * set : {&newline, &parens, &scattered}) {
+        for (size_t at = 0; at < 80; at++) {
+            std::string input(80, ' ');
+            input[at] = "\n(),\x01"[at % 5];
+            const char * p = input.data();
+            const char * expected = p;
+            while (expected < p + input.size() && !set->contains(*expected)) expected++;
+            EXPECT_EQ(CPP::Scan::find(*set, p, p + input.size()), expected);
+        }
+    }
+}
+
+TEST(Rules_Compiler, range_runs_match_like_graph) {
+    CPP::Rules::Grammar rules;
+    using namespace CPP::Rules;
+    OneOrMore grammar(
+        rules.make<Or>({
+            rules.make<Sequence>({
+                rules.make<Range>({'a', 'z', 'A', 'Z', '_'}),
+                rules.make<ZeroOrMore>(rules.make<Range>({'a', 'z', 'A', 'Z', '0', '9', '_'}))
+            }),
+            rules.make<OneOrMore>(rules.make<Range>({' ', ' '})),
+            rules.make<Any>()
+        })
+    );
+    auto program = compile(grammar);
+    std::string long_identifier(100, 'x');
+    for (std::string input : std::vector<std::string>{"a", "a1 b2", "  x", "_abcdefghijklmnopqrstuvwxyz0123456789 " + long_identifier + "+" + long_identifier}) {
+        expect_same_match(grammar, program, input);
+    }
+}
+
+TEST(Rules_Compiler, until_skips_to_candidates) {
+    CPP::Rules::Grammar rules;
+    using namespace CPP::Rules;
+    auto balanced_parens = rules.make<Sequence>(std::initializer_list<Rule*>());
+    balanced_parens->rules = {
+        rules.make<Char>('('),
+        rules.make<MatchBUntilA>(rules.make<Char>(')'), rules.make<Or>({balanced_parens, rules.make<AdvanceInputBy>(1)}))
+    };
+    OneOrMore grammar(
+        rules.make<Or>({
+            rules.make<Sequence>({rules.make<String>("/*"), rules.make<Until>(rules.make<String>("*/"))}),
+            rules.make<Sequence>({rules.make<String>("//"), rules.make<Until>(rules.make<NewlineOrEOF>())}),
+            balanced_parens,
+            rules.make<Any>()
+        })
+    );
+    auto program = compile(grammar);
+    size_t skipping = 0;
+    for (auto & instruction : program.code) {
+        if (instruction.skip != program.noSkip) skipping++;
+    }
+    // both Until and the MatchBUntilA of balanced_parens
+    EXPECT_EQ(skipping, 3);
+    std::string long_comment(200, '*');
+    for (std::string input : std::vector<std::string>{"/* a */", "/* a * b **/c", "/*" + long_comment, "// x\ny", "// x", "(a(b)c)", "(" + long_comment + "(x)" + long_comment + ")"}) {
+        expect_same_match(grammar, program, input);
+    }
+}
+
+struct CountedChar : CPP::Rules::Char {
+    int & destroyed;
+
+    CountedChar(char character, int & destroyed) : Char(character), destroyed(destroyed) {}
+
+    ~CountedChar() {
+        destroyed++;
+    }
+};
+
+static CPP::Rules::Rule * grammar_test_identifier(CPP::Rules::Grammar & grammar) {
+    using namespace CPP::Rules;
+    return grammar.make<Sequence>({
+        grammar.make<Range>({'a', 'z', 'A', 'Z', '_'}),
+        grammar.make<ZeroOrMore>(grammar.make<Range>({'a', 'z', 'A', 'Z', '0', '9', '_'}))
+    });
+}
+
+TEST(Rules_Grammar, makes_rules) {
+    using namespace CPP::Rules;
+    Grammar grammar;
+    auto identifier = grammar_test_identifier(grammar);
+    auto statements = grammar.make<OneOrMore>(grammar.make<Or>({identifier, grammar.make<Char>(' ')}));
+    EXPECT_EQ(grammar.size(), 7);
+    std::string a = "abc d1 _e";
+    CPP::Iterator<std::string> b(a);
+    EXPECT_TRUE(statements->match(b));
+    EXPECT_EQ(b.currentPosition(), a.size());
+}
+
+TEST(Rules_Grammar, frees_rules_in_bulk) {
+    using namespace CPP::Rules;
+    int destroyed = 0;
+    // a rule made with new is not owned by the grammar or by its holders
+    auto b = new CountedChar('b', destroyed);
+    {
+        Grammar grammar;
+        auto a = grammar.make<CountedChar>('a', destroyed);
+        grammar.make<Sequence>({a, b, a});
+        for (int i = 0; i < 10000; i++) {
+            grammar.make<CountedChar>('c', destroyed);
+        }
+        EXPECT_GT(grammar.blocks.size(), 1);
+        EXPECT_EQ(destroyed, 0);
+    }
+    EXPECT_EQ(destroyed, 10001);
+    delete b;
+    EXPECT_EQ(destroyed, 10002);
+}
+
+TEST(Rules_Grammar, grammars_on_many_threads) {
+    std::vector<std::thread> threads;
+    std::vector<int> matched(4, 0);
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([t, &matched] {
+            for (int i = 0; i < 200; i++) {
+                CPP::Rules::Grammar grammar;
+                auto identifier = grammar_test_identifier(grammar);
+                std::string a = "thread_" + std::to_string(t);
+                if (identifier->match(a)) matched[t]++;
+            }
+        });
+    }
+    for (auto & thread : threads) {
+        thread.join();
+    }
+    for (int t = 0; t < 4; t++) {
+        EXPECT_EQ(matched[t], 200);
+    }
+}
+
+TEST(Preprocessor, reuses_its_grammar) {
+    CPP::Preprocessor preprocessor;
+    size_t rules = preprocessor.grammar.size();
+    for (int i = 0; i < 3; i++) {
+        CPP::Preprocessor::Context context;
+        std::string input = "#define X(a) a y\n#define Y(Z) Z\nY(X)(z)\n";
+        preprocessor.parse(input, context);
+        EXPECT_EQ(input, "z y\n");
+        EXPECT_EQ(preprocessor.grammar.size(), rules);
+    }
+}
+
+TEST(Preprocessor, keeps_definitions_in_the_context) {
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    std::string definitions = "#define A 1\n";
+    preprocessor.parse(definitions, context);
+    std::string input = "A";
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "1");
+    // a new context starts without definitions
+    CPP::Preprocessor::Context other;
+    input = "A";
+    preprocessor.parse(input, other);
+    EXPECT_EQ(input, "A");
+}
+
+TEST(Lexer, splits_tokens) {
+    CPP::Atoms atoms;
+    std::vector<CPP::Token> tokens;
+    CPP::Lexer::lex("#define f(x) x+=1.5e+3 \"a b\" L'c'\n  g ... ->*", atoms, tokens);
+    std::vector<std::string> spellings;
+    for (auto & token : tokens) {
+        if (token.kind != CPP::Token::EndOfFile) spellings.emplace_back(atoms.spelling(token.atom));
+    }
+    EXPECT_EQ(spellings, (std::vector<std::string>{"#", "define", "f", "(", "x", ")", "x", "+=", "1.5e+3", "\"a b\"", "L'c'", "g", "...", "->*"}));
+    EXPECT_EQ(tokens[0].flags, CPP::Token::StartOfLine);
+    EXPECT_EQ(tokens[1].atom, CPP::Atoms::Define);
+    EXPECT_EQ(tokens[3].flags, 0);
+    EXPECT_EQ(tokens[6].flags, CPP::Token::LeadingSpace);
+    EXPECT_EQ(tokens[6].atom, tokens[4].atom);
+    EXPECT_EQ(tokens[8].kind, CPP::Token::Number);
+    EXPECT_EQ(tokens[9].kind, CPP::Token::StringLiteral);
+    EXPECT_EQ(tokens[10].kind, CPP::Token::CharacterLiteral);
+    EXPECT_EQ(tokens[11].flags, CPP::Token::StartOfLine | CPP::Token::LeadingSpace);
+    EXPECT_EQ(tokens[11].offset, 36u);
+    EXPECT_EQ(tokens.back().kind, CPP::Token::EndOfFile);
+    std::string text;
+    CPP::Lexer::spell(tokens, atoms, text);
+    EXPECT_EQ(text, "#define f(x) x+=1.5e+3 \"a b\" L'c'\ng ... ->*");
+}
+
+TEST(Atoms, interns_spellings) {
+    CPP::Atoms atoms;
+    EXPECT_EQ(atoms.intern("("), CPP::Atoms::LeftParen);
+    EXPECT_EQ(atoms.intern("defined"), CPP::Atoms::Defined);
+    std::vector<uint32_t> interned;
+    for (int i = 0; i < 5000; i++) {
+        interned.push_back(atoms.intern("name_" + std::to_string(i)));
+    }
+    EXPECT_EQ(atoms.size(), CPP::Atoms::predefined + 5000);
+    for (int i = 0; i < 5000; i++) {
+        std::string spelling = "name_" + std::to_string(i);
+        EXPECT_EQ(atoms.intern(spelling), interned[i]);
+        EXPECT_EQ(atoms.spelling(interned[i]), spelling);
+    }
+    std::string large(100 * 1024, 'x');
+    EXPECT_EQ(atoms.spelling(atoms.intern(large)), large);
+}
+
+TEST(PersistentAtomMap, forks_share_what_they_do_not_change) {
+    CPP::PersistentAtomMap<int> map;
+    EXPECT_EQ(map.find(1), nullptr);
+    for (uint32_t atom = 0; atom < 5000; atom++) map.set(atom, static_cast<int>(atom));
+    EXPECT_EQ(map.size(), 5000u);
+    CPP::PersistentAtomMap<int> fork = map.fork();
+    EXPECT_EQ(fork.root, map.root);
+    fork.set(7, -7);
+    fork.set(100000, 1);
+    map.set(8, -8);
+    EXPECT_EQ(*map.find(7), 7);
+    EXPECT_EQ(map.find(100000), nullptr);
+    EXPECT_EQ(*fork.find(7), -7);
+    EXPECT_EQ(*fork.find(8), 8);
+    EXPECT_EQ(*fork.find(100000), 1);
+    EXPECT_EQ(map.size(), 5000u);
+    EXPECT_EQ(fork.size(), 5001u);
+    // the nodes off the paths to the atoms set are still shared
+    size_t shared = 0;
+    for (size_t i = 0; i < map.root->children.size(); i++) {
+        if (map.root->children[i].node == fork.root->children[i].node) shared++;
+    }
+    EXPECT_GE(shared, map.root->children.size() - 3);
+    uint64_t sum = 0;
+    fork.each([&](uint32_t atom, int value) {
+        sum += atom;
+        EXPECT_EQ(value, atom == 7 ? -7 : atom == 100000 ? 1 : static_cast<int>(atom));
+    });
+    EXPECT_EQ(sum, 4999u * 5000u / 2 + 100000u);
+}
+
+TEST(HideSets, interns_sets) {
+    CPP::HideSets hideSets;
+    uint32_t a = hideSets.add(0, 7);
+    uint32_t ab = hideSets.add(a, 3);
+    EXPECT_EQ(hideSets.add(a, 7), a);
+    EXPECT_EQ(hideSets.add(hideSets.add(0, 3), 7), ab);
+    EXPECT_TRUE(hideSets.contains(ab, 3));
+    EXPECT_TRUE(hideSets.contains(ab, 7));
+    EXPECT_FALSE(hideSets.contains(a, 3));
+    EXPECT_FALSE(hideSets.contains(0, 7));
+    uint32_t c = hideSets.add(0, 5);
+    EXPECT_EQ(hideSets.unite(a, c), hideSets.add(c, 7));
+    EXPECT_EQ(hideSets.unite(0, c), c);
+    EXPECT_EQ(hideSets.intersect(ab, hideSets.add(c, 7)), a);
+    EXPECT_EQ(hideSets.intersect(ab, c), 0u);
+    EXPECT_EQ(hideSets.size(), 6u);
+    hideSets.clear();
+    EXPECT_EQ(hideSets.size(), 1u);
+}
+
+TEST(Preprocessor, expands_macros) {
+    std::pair<const char *, const char *> cases[] = {
+        {"#define foo(x) 9 x(x) 9\n1 foo(foo) 2 foo(bar) 3\n", "1 9 foo(foo) 9 2 9 bar(bar) 9 3\n"},
+        {"#define X(z) z b\n#define foo foo X\nfoo(z)", "foo z b"},
+        {"#define a x\n#define c a\n#define foo(a) a c\n#define b Y\nfoo(b)", "Y x"},
+        {"#define f(a, b) b a\nf((1, 2), f(3,\n4))", "4 3 (1, 2)"},
+        {"#define g f\n#define f(x) g x\ng(1)(2)", "f 1(2)"},
+        {"#define E\nx\nE y", "x\ny"},
+        {"#define F() 1\n#define G(a) [a]\nF() G() F", "1 [] F"},
+        {"x\n#define A 1\nA", "x\n1"},
+        {"#define f(a) a*g\n#define g(a) f(a)\nf(2)(9)", "2*9*g"},
+        {"#define foo(x) bar x\nfoo(foo) (2)", "bar foo (2)"},
+        {"#define a a b\n#define b a\na b", "a a a b"},
+        {"#define f(x) x f\nf(f)(1)", "f f(1)"},
+        {"#define str(s) # s\n#define xstr(s) str(s)\n#define INCFILE(n) vers ## n\nxstr(INCFILE(2).h)", "\"vers2.h\""},
+        {"#define hash_hash # ## #\n#define mkstr(a) # a\n#define in_between(a) mkstr(a)\n#define join(c, d) in_between(c hash_hash d)\njoin(x, y)", "\"x ## y\""},
+        {"#define t(x,y,z) x ## y ## z\nt(1,2,3), t(,4,5), t(6,,7), t(8,9,), t(10,,), t(,11,), t(,,12), t(,,)", "123, 45, 67, 89, 10, 11, 12,"},
+        {"#define s(x) #x\ns(  \"a\\n\"   'b'  c(d) )", "\"\\\"a\\\\n\\\" 'b' c(d)\""},
+        {"#define cat(a, b) a ## b\n#define AB done\ncat(A, B) cat(+, =) cat(x, 1)", "done += x1"},
+        {"#define second(a, b) b\nsecond((((1, 2))), ((3), (4,\n5)))", "((3), (4, 5))"},
+    };
+    CPP::Preprocessor preprocessor;
+    for (auto & test : cases) {
+        CPP::Preprocessor::Context context;
+        std::string input = test.first;
+        preprocessor.parse(input, context);
+        EXPECT_EQ(input, test.second) << test.first;
+    }
+}
+
+TEST(Preprocessor, collects_deeply_nested_arguments) {
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    std::string nested = std::string(2000, '(') + "x, y" + std::string(2000, ')');
+    std::string input = "#define first(a, b) a\nfirst(" + nested + ", " + nested + ")";
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, nested);
+}
+
+TEST(Preprocessor, leaves_definitions_unchanged_by_expansion) {
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    std::string input = "#define f(x, y) [x y]\n";
+    preprocessor.parse(input, context);
+    uint32_t f = context.atoms.intern("f");
+    std::shared_ptr<const CPP::CPP_Preprocessor_Data::Macro> macro = *context.data.definitions.find(f);
+    std::string content = macro->content;
+    input = "f(f(f(1, 2), f(3, 4)), f(5,\n6))";
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "[[[1 2] [3 4]] [5 6]]");
+    EXPECT_EQ(*context.data.definitions.find(f), macro);
+    EXPECT_EQ(macro->content, content);
+    // frames are reused by later invocations at the same depth
+    EXPECT_EQ(context.data.depth, 0u);
+    EXPECT_EQ(context.data.frames.size(), 3u);
+}
+
+TEST(Preprocessor, streams_expansions_from_a_stack_of_sources) {
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    // a chain of expansions each ending in the next macro
+    std::string input;
+    for (int i = 0; i < 1000; i++) {
+        input += "#define m" + std::to_string(i) + " " + std::to_string(i) + " m" + std::to_string(i + 1) + "\n";
+    }
+    input += "#define f(x) [x]\n";
+    std::string expected;
+    for (int i = 0; i < 1000; i++) expected += std::to_string(i) + " ";
+    expected += "m1000";
+    std::string chain = input + "m0";
+    preprocessor.parse(chain, context);
+    EXPECT_EQ(chain, expected);
+    // exhausted sources are popped before the next one is pushed
+    EXPECT_LE(context.data.sources.size(), 2u);
+    EXPECT_EQ(context.data.reading, 0u);
+    std::string many;
+    expected.clear();
+    for (int i = 0; i < 20000; i++) {
+        many += "f(" + std::to_string(i) + ")\n";
+        expected += "[" + std::to_string(i) + "]\n";
+    }
+    preprocessor.parse(many, context);
+    EXPECT_EQ(many, expected);
+}
+
+TEST(Phases, splices_lines_and_removes_comments) {
+    std::pair<const char *, const char *> cases[] = {
+        {"a\\\nb", "ab"},
+        {"a // c\nb", "a  \nb"},
+        {"a/* x\n y */b", "a b"},
+        {"/\\\n* c *\\\n/x", " x"},
+        {"// c \\\n still a comment\nx", " \nx"},
+        {"\"// a\" '/*' \"\\\"/*\"", "\"// a\" '/*' \"\\\"/*\""},
+        {"s = \"a\\\nb\"", "s = \"ab\""},
+        {"'a // b\nc // d", "'a // b\nc  "},
+        {"a / b \\ c", "a / b \\ c"},
+    };
+    for (auto & test : cases) {
+        std::string output;
+        CPP::Phases::clean(test.first, output);
+        EXPECT_EQ(output, test.second) << test.first;
+    }
+    std::string input;
+    std::string expected;
+    for (int i = 0; i < 20000; i++) {
+        input += "x /* c */ // d\n";
+        expected += "x    \n";
+    }
+    std::string output;
+    CPP::Phases::clean(input, output);
+    EXPECT_EQ(output, expected);
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    input = "#define A 1 // one\nA/**/A";
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "1 1");
+}
+
+// phases 1 and 2 one after the other, a byte at a time, returns false for an
+// unterminated block comment
+static bool phases_reference(const std::string & input, std::string & output) {
+    std::string text;
+    for (size_t i = 0; i < input.size(); i++) {
+        if (input[i] == '\\' && i + 1 < input.size() && input[i + 1] == '\n') {
+            i++;
+            continue;
+        }
+        text += input[i];
+    }
+    output.clear();
+    size_t i = 0;
+    while (i < text.size()) {
+        char c = text[i];
+        if (c == '"' || c == '\'') {
+            output += text[i++];
+            while (i < text.size() && text[i] != '\n') {
+                char d = text[i++];
+                output += d;
+                if (d == '\\') {
+                    if (i < text.size() && text[i] != '\n') output += text[i++];
+                } else if (d == c) {
+                    break;
+                }
+            }
+        } else if (c == '/' && i + 1 < text.size() && text[i + 1] == '/') {
+            output += ' ';
+            while (i < text.size() && text[i] != '\n') i++;
+        } else if (c == '/' && i + 1 < text.size() && text[i + 1] == '*') {
+            size_t close = text.find("*/", i + 2);
+            if (close == std::string::npos) return false;
+            output += ' ';
+            i = close + 2;
+        } else {
+            output += text[i++];
+        }
+    }
+    return true;
+}
+
+TEST(Phases, matches_the_phases_run_one_after_the_other) {
+    const char alphabet[] = {'a', ' ', '\\', '\n', '/', '*', '"', '\''};
+    uint32_t state = 7;
+    int compared = 0;
+    for (int test = 0; test < 5000; test++) {
+        std::string input;
+        state = state * 1103515245u + 12345u;
+        size_t length = (state >> 8) % 160;
+        for (size_t i = 0; i < length; i++) {
+            state = state * 1103515245u + 12345u;
+            // mostly plain bytes so blocks of 32 are skipped whole
+            uint32_t pick = (state >> 8) % 32;
+            input += pick < sizeof(alphabet) ? alphabet[pick] : 'a';
+        }
+        std::string expected;
+        if (!phases_reference(input, expected)) continue;
+        std::string output;
+        CPP::Phases::clean(input, output);
+        EXPECT_EQ(output, expected) << CPP::Rules::Input::quote(input);
+        compared++;
+    }
+    EXPECT_GT(compared, 1000);
+}
+
+TEST(SourceMap, locates_text_in_the_input) {
+    std::string input = "a /* x\ny */ b\\\nc\nd";
+    std::string text;
+    CPP::SourceMap map;
+    CPP::Phases::clean(input, text, &map);
+    ASSERT_EQ(text, "a   bc\nd");
+    auto expect = [&](uint32_t offset, uint32_t line, uint32_t column) {
+        CPP::SourceMap::Location location = map.locate(offset);
+        EXPECT_EQ(location.line, line) << offset;
+        EXPECT_EQ(location.column, column) << offset;
+    };
+    expect(0, 1, 1);
+    // the space replacing the comment is at its /*
+    expect(2, 1, 3);
+    expect(4, 2, 6);
+    expect(5, 3, 1);
+    expect(7, 4, 1);
+    // many edits, each found in logarithmic time
+    input.clear();
+    for (int i = 0; i < 10000; i++) input += "x /* c */ y\\\n\n";
+    CPP::Phases::clean(input, text, &map);
+    // three edits of two bytes for each line
+    EXPECT_EQ(map.size(), 10000u * 3 * 2);
+    for (uint32_t i = 0; i < 10000; i++) {
+        // "x   y\n" is 6 bytes from the 14 bytes of 2 lines of the input
+        expect(i * 6 + 4, i * 2 + 1, 11);
+        EXPECT_EQ(map.original(i * 6 + 4), i * 14 + 10);
+    }
+}
+
+TEST(Preprocessor, marks_lines_and_locates_expansions) {
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    context.lineMarkers = true;
+    std::string input = "#define A 1 \\\n + 2\n\nA\n/* a\n comment */ b\nc\n";
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "#line 4\n1 + 2\n#line 6\nb\nc\n");
+    input = "#define F(x) x\nq F(\n1) F(2\n)\n";
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "#line 2\nq 1 2\n");
+    preprocessor.context = &context;
+    EXPECT_EQ(preprocessor.where(context.data.definitions.find(context.atoms.intern("F"))->get()->tokens[0]), "1:14: ");
+    preprocessor.context = nullptr;
+}
+
+TEST(Sink, receives_the_output_as_it_is_produced) {
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    // every invocation spans two lines, so some span two windows of lexed lines
+    std::string input = "#define f(x) [x]\n";
+    std::string expected;
+    for (int i = 0; i < 3000; i++) {
+        input += "a b c d f(\n" + std::to_string(i) + ")\n";
+        expected += "a b c d [" + std::to_string(i) + "]\n";
+    }
+    std::vector<std::string> spellings;
+    CPP::TokenSink tokens([&](const CPP::Token & token, std::string_view spelling) {
+        if (token.kind != CPP::Token::EndOfFile) spellings.emplace_back(spelling);
+    });
+    preprocessor.parse(std::string_view(input), context, tokens);
+    ASSERT_EQ(spellings.size(), 3000u * 7);
+    EXPECT_EQ(spellings[4], "[");
+    EXPECT_EQ(spellings[5], "0");
+    std::ostringstream stream;
+    CPP::StreamSink streamed(stream);
+    preprocessor.parse(std::string_view(input), context, streamed);
+    EXPECT_EQ(stream.str(), expected);
+    // from a file descriptor to a file descriptor
+    FILE * in = tmpfile();
+    FILE * out = tmpfile();
+    ASSERT_NE(in, nullptr);
+    ASSERT_NE(out, nullptr);
+    ASSERT_EQ(fwrite(input.data(), 1, input.size(), in), input.size());
+    fflush(in);
+    rewind(in);
+    CPP::FileSink file(fileno(out));
+    preprocessor.parse(fileno(in), context, file);
+    rewind(out);
+    std::string written(expected.size() + 1, '\0');
+    written.resize(fread(&written[0], 1, written.size(), out));
+    EXPECT_EQ(written, expected);
+    fclose(in);
+    fclose(out);
+}
+
+TEST(Preprocessor, maps_a_file_from_its_offset_and_reads_a_pipe) {
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    context.trace = false;
+    std::string skipped = "skipped\n";
+    std::string input = "#define A a\nA b /* c */\n";
+    FILE * in = tmpfile();
+    ASSERT_NE(in, nullptr);
+    ASSERT_EQ(fwrite(skipped.data(), 1, skipped.size(), in), skipped.size());
+    ASSERT_EQ(fwrite(input.data(), 1, input.size(), in), input.size());
+    fflush(in);
+    ASSERT_EQ(fseek(in, static_cast<long>(skipped.size()), SEEK_SET), 0);
+    std::string output;
+    CPP::StringSink file(output);
+    EXPECT_TRUE(preprocessor.parse(fileno(in), context, file));
+    EXPECT_EQ(output, "a b\n");
+    // it was read to its end
+    EXPECT_EQ(lseek(fileno(in), 0, SEEK_CUR), static_cast<off_t>(skipped.size() + input.size()));
+    fclose(in);
+    int ends[2];
+    ASSERT_EQ(pipe(ends), 0);
+    ASSERT_EQ(write(ends[1], input.data(), input.size()), static_cast<ssize_t>(input.size()));
+    close(ends[1]);
+    output.clear();
+    CPP::StringSink piped(output);
+    EXPECT_TRUE(preprocessor.parse(ends[0], context, piped));
+    EXPECT_EQ(output, "a b\n");
+    close(ends[0]);
+}
+
+TEST(Preprocessor, keeps_the_error_of_a_failed_write) {
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    context.trace = false;
+    std::string input;
+    // more than the chunks held before the first write
+    for (int i = 0; i < 300000; i++) input += "a b c\n";
+    // writes to a descriptor opened for reading fail
+    int fd = open("/dev/null", O_RDONLY);
+    ASSERT_GE(fd, 0);
+    CPP::FileSink file(fd);
+    EXPECT_TRUE(preprocessor.parse(std::string_view(input), context, file));
+    EXPECT_TRUE(file.failed());
+    EXPECT_EQ(file.error(), EBADF);
+    // the text after the failure is dropped
+    EXPECT_TRUE(file.held.empty());
+    close(fd);
+}
+
+TEST(Preprocessor, includes_files_from_the_search_paths_once) {
+    char directory[] = "/tmp/cpp_include_XXXXXX";
+    ASSERT_NE(mkdtemp(directory), nullptr);
+    std::string root = directory;
+    ASSERT_EQ(mkdir((root + "/sub").c_str(), 0700), 0);
+    ASSERT_EQ(mkdir((root + "/sys").c_str(), 0700), 0);
+    auto write = [](const std::string & path, const std::string & text, time_t mtime) {
+        std::ofstream(path) << text;
+        struct timeval times[2] = {{mtime, 0}, {mtime, 0}};
+        utimes(path.c_str(), times);
+    };
+    write(root + "/a.h", "#define A 1\nA a\n", 1000);
+    write(root + "/sub/b.h", "#include \"c.h\"\nb\n", 1000);
+    write(root + "/sub/c.h", "c /* in sub */\n", 1000);
+    write(root + "/sys/s.h", "s\n", 1000);
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    context.quotePaths = {root};
+    context.systemPaths = {root + "/sys"};
+    std::string text = "#include \"a.h\"\n#include <s.h>\n#define H \"sub/b.h\"\n#include H\nA end\n";
+    std::string input = text;
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "1 a\ns\nc\nb\n1 end\n");
+    ASSERT_EQ(context.included.size(), 4u);
+    // the files are cleaned once, the second run reads the same text
+    auto first = context.included[0];
+    input = text;
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "1 a\ns\nc\nb\n1 end\n");
+    EXPECT_EQ(context.included[0], first);
+    // a file that changed is read again
+    write(root + "/a.h", "#define A 2\nA\n", 2000);
+    input = text;
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "2\ns\nc\nb\n2 end\n");
+    EXPECT_NE(context.included[0], first);
+    EXPECT_EQ(first->text, "#define A 1\nA a\n");
+    preprocessor.context = &context;
+    CPP::Token token;
+    token.file = 3;
+    token.offset = 2;
+    EXPECT_EQ(preprocessor.where(token), context.included[2]->path + ":1:3: ");
+    preprocessor.context = nullptr;
+    for (const char * name : {"/a.h", "/sub/b.h", "/sub/c.h", "/sys/s.h"}) remove((root + name).c_str());
+    rmdir((root + "/sub").c_str());
+    rmdir((root + "/sys").c_str());
+    rmdir(directory);
+}
+
+TEST(Preprocessor, skips_files_included_again_behind_their_guard) {
+    char directory[] = "/tmp/cpp_guard_XXXXXX";
+    ASSERT_NE(mkdtemp(directory), nullptr);
+    std::string root = directory;
+    std::ofstream(root + "/g.h") << "\n#ifndef G_H\n#define G_H\ng\n#endif\n\n";
+    std::ofstream(root + "/o.h") << "#pragma once\no\n";
+    std::ofstream(root + "/n.h") << "#ifndef N_H\n#define N_H\n#endif\nn\n";
+    std::ofstream(root + "/e.h") << "#ifndef E_H\n#else\n#endif\n";
+    auto g = CPP::FileCache::shared().open(root + "/g.h");
+    ASSERT_NE(g, nullptr);
+    EXPECT_EQ(g->guard, "G_H");
+    EXPECT_EQ(g->text.substr(g->body, g->end - g->body), "#define G_H\ng\n");
+    EXPECT_EQ(CPP::FileCache::shared().open(root + "/o.h")->guard, "");
+    EXPECT_EQ(CPP::FileCache::shared().open(root + "/n.h")->guard, "");
+    EXPECT_EQ(CPP::FileCache::shared().open(root + "/e.h")->guard, "");
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    context.systemPaths = {root};
+    std::string input = "#include \"g.h\"\n#include \"o.h\"\n#include \"g.h\"\n#include <o.h>\n#include \"o.h\"\nx\n";
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "g\no\nx\n");
+    EXPECT_EQ(context.included.size(), 2u);
+    // the guard is defined and o.h ran #pragma once in the context
+    input = "#include \"g.h\"\n#include \"o.h\"\ny\n";
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "y\n");
+    EXPECT_TRUE(context.included.empty());
+    for (const char * name : {"/g.h", "/o.h", "/n.h", "/e.h"}) remove((root + name).c_str());
+    rmdir(directory);
+}
+
+TEST(Expression, evaluates_integer_constant_expressions) {
+    CPP::Atoms atoms;
+    auto evaluate = [&](const char * text, bool & result) {
+        std::vector<CPP::Token> tokens;
+        CPP::Lexer::lex(text, atoms, tokens);
+        CPP::Expression expression(atoms, tokens.data(), tokens.data() + tokens.size() - 1);
+        return expression.evaluate(result);
+    };
+    auto holds = [&](const char * text) {
+        bool result = false;
+        EXPECT_TRUE(evaluate(text, result)) << text;
+        return result;
+    };
+    EXPECT_TRUE(holds("1 + 2 * 3 == 7"));
+    EXPECT_TRUE(holds("(1 + 2) * 3 == 9"));
+    EXPECT_FALSE(holds("-1 < 0u"));
+    EXPECT_TRUE(holds("-1 < 0"));
+    EXPECT_TRUE(holds("0x10 >> 2 == 4 && 010 == 8 && 0b101 == 5"));
+    EXPECT_TRUE(holds("-1 >> 63 == -1"));
+    EXPECT_TRUE(holds("1 ? 2 : 1 / 0"));
+    EXPECT_TRUE(holds("0 && 1 / 0 || 1"));
+    EXPECT_TRUE(holds("'a' == 97 && '\\n' == 10"));
+    EXPECT_TRUE(holds("~0 == -1 && !0 && !!7"));
+    EXPECT_TRUE(holds("0xFFFFFFFFFFFFFFFF > 0 && 18446744073709551615u == -1"));
+    EXPECT_FALSE(holds("undefined_name || false"));
+    EXPECT_TRUE(holds("true"));
+    EXPECT_EQ(holds("7 % 4 - 3"), false);
+    bool result;
+    EXPECT_FALSE(evaluate("1 +", result));
+    EXPECT_FALSE(evaluate("(1", result));
+    EXPECT_FALSE(evaluate("1 / 0", result));
+    EXPECT_FALSE(evaluate("1 2", result));
+    EXPECT_FALSE(evaluate("", result));
+    EXPECT_FALSE(evaluate("\"s\"", result));
+}
+
+TEST(Preprocessor, compiles_conditionally_and_skips_dead_groups) {
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    std::string input =
+        "#define A 2\n"
+        "#define TWICE(x) ((x) * 2)\n"
+        "#if TWICE(A) > 3 && defined(A)\n"
+        "yes\n"
+        "#elif 1 / 0\n"
+        "#else\n"
+        "no\n"
+        "#endif\n"
+        "#ifdef B\n"
+        "b\n"
+        "#else\n"
+        "not b\n"
+        "#endif\n"
+        "#if 0\n"
+        "  # if garbage (\n"
+        "#else\n"
+        "#endif\n"
+        "x\n"
+        "#elif defined B || A == 2\n"
+        "second\n"
+        "#else\n"
+        "third\n"
+        "#endif\n"
+        "#ifndef A\n"
+        "#error\n"
+        "#endif\n"
+        "end\n";
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "yes\nnot b\nsecond\nend\n");
+    // a dead group is not lexed past the window it starts in
+    input = "#if defined NOTHING\n";
+    for (int i = 0; i < 20000; i++) input += "dead_" + std::to_string(i) + "\n";
+    input += "#endif\nlive\n";
+    size_t atoms = context.atoms.size();
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "live\n");
+    EXPECT_LT(context.atoms.size() - atoms, 5000u);
+}
+
+TEST(Expression, folds_constants_and_keeps_the_leaves_of_macros) {
+    CPP::Atoms atoms;
+    auto compile = [&](const char * text, CPP::Expression::Program & program, std::vector<CPP::Token> & tokens) {
+        tokens.clear();
+        CPP::Lexer::lex(text, atoms, tokens);
+        return CPP::Expression(atoms, tokens.data(), tokens.data() + tokens.size() - 1).compile(program);
+    };
+    using Op = CPP::Expression::Op;
+    auto ops = [](const CPP::Expression::Program & program) {
+        std::vector<Op> ops;
+        for (const auto & instruction : program.code) ops.push_back(instruction.op);
+        return ops;
+    };
+    std::vector<CPP::Token> tokens;
+    CPP::Expression::Program program;
+    ASSERT_TRUE(compile("defined(X) && (A_VERSION >= 0x0200 || B)", program, tokens));
+    EXPECT_EQ(ops(program), (std::vector<Op>{Op::Defined, Op::Identifier, Op::Constant, Op::GreaterEqual, Op::Identifier, Op::Or, Op::And}));
+    ASSERT_TRUE(compile("(1 + 2) * 3 == 9 && X", program, tokens));
+    EXPECT_EQ(ops(program), (std::vector<Op>{Op::Identifier, Op::Truth}));
+    ASSERT_TRUE(compile("0 && X || 4 - 4", program, tokens));
+    ASSERT_TRUE(program.constant());
+    EXPECT_EQ(program.code[0].value.bits, 0u);
+    ASSERT_TRUE(compile("1 ? 2 : 1 / 0", program, tokens));
+    ASSERT_TRUE(program.constant());
+    EXPECT_FALSE(program.code[0].value.poisoned);
+    // the line needs expanding first
+    EXPECT_FALSE(compile("F(1) > 0", program, tokens));
+    EXPECT_FALSE(compile("1 OP 2", program, tokens));
+    // the leaves are looked up each run
+    ASSERT_TRUE(compile("defined X ? Y * 2 : -1", program, tokens));
+    struct Leaves {
+        bool x;
+        uint64_t y;
+        bool defined(uint32_t) { return x; }
+        bool identifier(uint32_t, CPP::Expression::Value & value) { value.bits = y; return true; }
+    };
+    CPP::Expression::Value value;
+    Leaves first{true, 21};
+    ASSERT_TRUE(program.run(first, value));
+    EXPECT_EQ(value.bits, 42u);
+    Leaves second{false, 21};
+    ASSERT_TRUE(program.run(second, value));
+    EXPECT_EQ(static_cast<int64_t>(value.bits), -1);
+}
+
+TEST(Preprocessor, reuses_compiled_conditions_across_inclusions) {
+    char directory[] = "/tmp/cpp_condition_XXXXXX";
+    ASSERT_NE(mkdtemp(directory), nullptr);
+    std::string root = directory;
+    std::ofstream(root + "/v.h") << "#if defined(X) && (A_VERSION >= 0x0200 || B)\nnew\n#elif A_VERSION\nold\n#else\nnone\n#endif\n";
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    context.quotePaths = {root};
+    std::string input =
+        "#include \"v.h\"\n"
+        "#define X\n"
+        "#define A_VERSION 0x0100\n"
+        "#include \"v.h\"\n"
+        "#define B (A_VERSION - 0x100)\n"
+        "#include \"v.h\"\n"
+        "#define A_VERSION2 -A_VERSION\n"
+        "#define SUM 1 + 1\n"
+        "#if SUM * 2 == 3 && A_VERSION2 == -256\n"
+        "textual\n"
+        "#endif\n";
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "none\nold\nold\ntextual\n");
+    // one program for each expression, the last compiled as written but
+    // evaluated expanded as SUM is not a value
+    EXPECT_EQ(context.conditions.size(), 3u);
+    input = "#define B 1\n#include \"v.h\"\n";
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "new\n");
+    EXPECT_EQ(context.conditions.size(), 3u);
+    remove((root + "/v.h").c_str());
+    rmdir(directory);
+}
+
+TEST(Snapshot, starts_runs_from_saved_definitions) {
+    char directory[] = "/tmp/cpp_snapshot_XXXXXX";
+    ASSERT_NE(mkdtemp(directory), nullptr);
+    std::string root = directory;
+    std::ofstream(root + "/once.h") << "#pragma once\nonce\n";
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context prelude;
+    prelude.quotePaths = {root};
+    std::string input = "#include \"once.h\"\n#define CAT(a, b) a ## b\n#define STR(x) #x\n#define GUARD_H\n";
+    for (int i = 0; i < 1000; i++) input += "#define M" + std::to_string(i) + " (" + std::to_string(i) + " + M" + std::to_string(i + 1) + ")\n";
+    preprocessor.parse(input, prelude);
+    EXPECT_EQ(input, "once\n");
+    std::string path = root + "/prelude.snapshot";
+    ASSERT_TRUE(CPP::Preprocessor::save(prelude, path));
+    size_t atoms = prelude.atoms.size();
+    auto snapshot = CPP::Snapshot::open(path);
+    ASSERT_NE(snapshot, nullptr);
+    std::string text = "#include \"once.h\"\nCAT(M, 998) STR(a \"b\") GUARD_H\n#if M999 == 999 + M1000 && defined GUARD_H\nyes\n#endif\n";
+    std::string expected = "(998 + (999 + M1000)) \"a \\\"b\\\"\"\nyes\n";
+    input = text;
+    preprocessor.parse(input, prelude);
+    EXPECT_EQ(input, expected);
+    // two contexts share the snapshot, definitions made in one stay in it
+    CPP::Preprocessor::Context first;
+    CPP::Preprocessor::Context second;
+    first.quotePaths = second.quotePaths = {root};
+    ASSERT_TRUE(CPP::Preprocessor::use(first, snapshot));
+    ASSERT_TRUE(CPP::Preprocessor::use(second, snapshot));
+    EXPECT_EQ(first.atoms.size(), atoms);
+    EXPECT_EQ(first.atoms.intern("M500"), prelude.atoms.intern("M500"));
+    input = text;
+    preprocessor.parse(input, first);
+    EXPECT_EQ(input, expected);
+    // only the macros used were read out of the snapshot
+    EXPECT_LT(first.data.definitions.macros.size(), 10u);
+    input = "#define M999 redefined\nM998 new_atom\n";
+    preprocessor.parse(input, first);
+    EXPECT_EQ(input, "(998 + redefined) new_atom\n");
+    EXPECT_GE(first.atoms.intern("new_atom"), snapshot->atoms().count);
+    input = "M998\n";
+    preprocessor.parse(input, second);
+    EXPECT_EQ(input, "(998 + (999 + M1000))\n");
+    // a snapshot of a context based on a snapshot holds both
+    std::string again = root + "/again.snapshot";
+    ASSERT_TRUE(CPP::Preprocessor::save(first, again));
+    CPP::Preprocessor::Context third;
+    ASSERT_TRUE(CPP::Preprocessor::use(third, CPP::Snapshot::open(again)));
+    input = "M998 M0\n";
+    preprocessor.parse(input, third);
+    EXPECT_EQ(input.substr(0, 26), "(998 + redefined) (0 + (1 ");
+    // not a snapshot
+    std::ofstream(root + "/bad.snapshot") << "not a snapshot at all, too short for its header or of no version";
+    EXPECT_EQ(CPP::Snapshot::open(root + "/bad.snapshot"), nullptr);
+    for (const char * name : {"/once.h", "/prelude.snapshot", "/again.snapshot", "/bad.snapshot"}) remove((root + name).c_str());
+    rmdir(directory);
+}
+
+TEST(Snapshot, saves_the_same_bytes_for_the_same_definitions) {
+    char directory[] = "/tmp/cpp_snapshot_XXXXXX";
+    ASSERT_NE(mkdtemp(directory), nullptr);
+    std::string root = directory;
+    std::string saved[2];
+    for (int i = 0; i < 2; i++) {
+        CPP::Preprocessor preprocessor;
+        CPP::Preprocessor::Context context;
+        context.trace = false;
+        std::string input = "#define CAT(a, b) a ## b\n#define STR(x) #x x\n#define F(x, y) (x) + y\n";
+        preprocessor.parse(input, context);
+        std::string path = root + "/" + std::to_string(i) + ".snapshot";
+        ASSERT_TRUE(CPP::Preprocessor::save(context, path));
+        std::ifstream file(path, std::ios::binary);
+        saved[i].assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        remove(path.c_str());
+    }
+    EXPECT_FALSE(saved[0].empty());
+    EXPECT_EQ(saved[0], saved[1]);
+    rmdir(directory);
+}
+
+TEST(Snapshot, rejects_tables_that_point_out_of_the_file) {
+    char directory[] = "/tmp/cpp_snapshot_XXXXXX";
+    ASSERT_NE(mkdtemp(directory), nullptr);
+    std::string root = directory;
+    std::ofstream(root + "/once.h") << "#pragma once\n";
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context prelude;
+    prelude.trace = false;
+    prelude.quotePaths = {root};
+    std::string input = "#include \"once.h\"\n#define M(a, b) a ## b + #a\n";
+    preprocessor.parse(input, prelude);
+    std::string path = root + "/prelude.snapshot";
+    ASSERT_TRUE(CPP::Preprocessor::save(prelude, path));
+    std::ifstream file(path, std::ios::binary);
+    const std::string saved((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    CPP::Snapshot::Header header;
+    memcpy(&header, saved.data(), sizeof(header));
+    uint32_t m = prelude.atoms.intern("M");
+    uint32_t record;
+    memcpy(&record, saved.data() + header.index + m * 4, 4);
+    ASSERT_NE(record, 0u);
+    // the snapshot with value written at offset
+    auto patched = [&](uint64_t offset, uint32_t value) {
+        std::string bytes = saved;
+        memcpy(&bytes[offset], &value, 4);
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << bytes;
+        return CPP::Snapshot::open(path);
+    };
+    EXPECT_NE(patched(header.offsets, 0), nullptr);
+    EXPECT_EQ(patched(header.offsets + 4 * header.atoms, 0xFFFFFFF0u), nullptr);
+    EXPECT_EQ(patched(header.offsets + 4 * m, 0xFFFFu), nullptr);
+    EXPECT_EQ(patched(header.slots, header.atoms + 1), nullptr);
+    EXPECT_EQ(patched(header.index + m * 4, 0xFFFFFFF0u), nullptr);
+    EXPECT_EQ(patched(header.paths, 0xFFFFu), nullptr);
+    // a record that does not fit, or names no atom, reads as no macro
+    for (uint64_t field : {uint64_t(8), uint64_t(0)}) {
+        auto snapshot = patched(header.records + record - 1 + field, 0xFFFFFFF0u);
+        ASSERT_NE(snapshot, nullptr);
+        CPP::Preprocessor::Context context;
+        context.trace = false;
+        ASSERT_TRUE(CPP::Preprocessor::use(context, snapshot));
+        input = "M(x, y)\n";
+        preprocessor.parse(input, context);
+        EXPECT_EQ(input, "M(x, y)\n");
+    }
+    CPP::Preprocessor::Context context;
+    context.trace = false;
+    ASSERT_TRUE(CPP::Preprocessor::use(context, patched(header.offsets, 0)));
+    input = "M(x, y)\n";
+    preprocessor.parse(input, context);
+    EXPECT_EQ(input, "xy + \"x\"\n");
+    for (const char * name : {"/once.h", "/prelude.snapshot"}) remove((root + name).c_str());
+    rmdir(directory);
+}
+
+TEST(Preprocessor, forks_contexts_for_runs_on_other_threads) {
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context prelude;
+    prelude.trace = false;
+    std::string input = "#define GONE gone\n#define KEPT kept\n#undef GONE\n#undef NEVER\nGONE KEPT\n";
+    preprocessor.parse(input, prelude);
+    EXPECT_EQ(input, "GONE kept\n");
+    input.clear();
+    for (int i = 0; i < 1000; i++) input += "#define M" + std::to_string(i) + " " + std::to_string(i) + "\n";
+    preprocessor.parse(input, prelude);
+    size_t defined = prelude.data.definitions.macros.size();
+    std::vector<CPP::Preprocessor::Context> forks(8);
+    for (auto & fork : forks) CPP::Preprocessor::fork(prelude, fork);
+    EXPECT_EQ(forks[0].data.definitions.macros.root, prelude.data.definitions.macros.root);
+    EXPECT_EQ(forks[0].atoms.intern("M500"), prelude.atoms.intern("M500"));
+    std::vector<std::string> outputs(forks.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < forks.size(); i++) {
+        threads.emplace_back([&, i] {
+            CPP::Preprocessor worker;
+            std::string n = std::to_string(i);
+            std::string text = "#undef M" + n + "\n#define M999 own" + n + "\n#define NEW" + n + " M900\nM" + n + " M999 NEW" + n + " KEPT\n";
+            worker.parse(text, forks[i]);
+            outputs[i] = text;
+        });
+    }
+    for (auto & thread : threads) thread.join();
+    for (size_t i = 0; i < forks.size(); i++) {
+        std::string n = std::to_string(i);
+        EXPECT_EQ(outputs[i], "M" + n + " own" + n + " 900 kept\n");
+        EXPECT_EQ(forks[i].data.definitions.macros.size(), defined + 1);
+    }
+    // the prelude saw none of it
+    input = "M0 M999 NEW0\n";
+    preprocessor.parse(input, prelude);
+    EXPECT_EQ(input, "0 999 NEW0\n");
+    EXPECT_EQ(prelude.data.definitions.macros.size(), defined);
+}
+
+TEST(Batch, preprocesses_inputs_on_workers_from_one_base) {
+    char directory[] = "/tmp/cpp_batch_XXXXXX";
+    ASSERT_NE(mkdtemp(directory), nullptr);
+    std::string root = directory;
+    std::ofstream(root + "/common.h") << "#ifndef COMMON_H\n#define COMMON_H\n#define TWICE(x) x x\n#endif\n";
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context base;
+    base.trace = false;
+    base.systemPaths = {root};
+    std::string prelude = "#define VERSION 3\n";
+    preprocessor.parse(prelude, base);
+    std::vector<CPP::Batch::Unit> units;
+    for (int i = 0; i < 40; i++) {
+        std::string n = std::to_string(i);
+        std::string input = root + "/unit" + n + ".c";
+        std::ofstream file(input);
+        file << "#include <common.h>\n#include \"common.h\"\n#define OWN" << n << " own" << n << "\n";
+        // inputs of different sizes
+        for (int line = 0; line < i * 10; line++) file << "#define LOCAL" << line << " " << line << "\n";
+        file << "TWICE(OWN" << n << ") VERSION OWN" << (i + 1) << "\n";
+        units.push_back({input, input + ".i"});
+    }
+    units.push_back({root + "/missing.c", root + "/missing.i"});
+    std::vector<size_t> failed = CPP::Batch::run(base, units, 4);
+    ASSERT_EQ(failed.size(), 1u);
+    EXPECT_EQ(failed[0], 40u);
+    for (int i = 0; i < 40; i++) {
+        std::string n = std::to_string(i);
+        std::ifstream file(units[i].output);
+        std::stringstream output;
+        output << file.rdbuf();
+        // the definitions of one input are not seen by another
+        EXPECT_EQ(output.str(), "own" + n + " own" + n + " 3 OWN" + std::to_string(i + 1) + "\n");
+        remove(units[i].input.c_str());
+        remove(units[i].output.c_str());
+    }
+    // the base saw none of it
+    EXPECT_EQ(base.data.definitions.find(base.atoms.intern("OWN0")), nullptr);
+    remove((root + "/common.h").c_str());
+    rmdir(directory);
+}
+
+TEST(Batch, reports_errors_of_an_input_and_runs_the_others) {
+    char directory[] = "/tmp/cpp_batch_XXXXXX";
+    ASSERT_NE(mkdtemp(directory), nullptr);
+    std::string root = directory;
+    CPP::Preprocessor::Context base;
+    base.trace = false;
+    base.systemPaths = {root};
+    std::vector<std::pair<std::string, std::string>> inputs = {
+        {"good", "#define A a\nA\n"},
+        {"unbalanced", "#if 1\nx\n"},
+        {"paste", "#define P(a, b) a ## b\nP(+, /)\n"},
+        {"missing", "#include <missing.h>\n"},
+        {"comment", "x /* y\n"},
+        {"other", "#define B b\nB A\n"},
+        {"full", "#define C c\nC\n"},
+    };
+    std::vector<CPP::Batch::Unit> units;
+    for (auto & input : inputs) {
+        std::string path = root + "/" + input.first + ".c";
+        std::ofstream(path) << input.second;
+        units.push_back({path, path + ".i"});
+    }
+    // a device every write to fails with ENOSPC
+    bool full = access("/dev/full", W_OK) == 0;
+    if (full) units.back().output = "/dev/full";
+    std::vector<std::string> errors;
+    std::vector<size_t> failed = CPP::Batch::run(base, units, 3, &errors);
+    std::vector<size_t> expected = {1, 2, 3, 4};
+    if (full) expected.push_back(6);
+    ASSERT_EQ(failed, expected);
+    ASSERT_EQ(errors.size(), expected.size());
+    EXPECT_NE(errors[0].find("#if"), std::string::npos) << errors[0];
+    EXPECT_NE(errors[1].find("pasting"), std::string::npos) << errors[1];
+    EXPECT_NE(errors[2].find("missing.h"), std::string::npos) << errors[2];
+    EXPECT_NE(errors[3].find("comment"), std::string::npos) << errors[3];
+    if (full) {
+        EXPECT_EQ(errors[4], std::string("cannot write the output: ") + strerror(ENOSPC));
+    }
+    std::vector<std::string> outputs = {"a\n", "", "", "", "", "b A\n"};
+    for (size_t unit : {0, 5}) {
+        std::ifstream file(units[unit].output);
+        std::stringstream output;
+        output << file.rdbuf();
+        EXPECT_EQ(output.str(), outputs[unit]);
+    }
+    for (auto & unit : units) {
+        remove(unit.input.c_str());
+        if (unit.output != "/dev/full") remove(unit.output.c_str());
+    }
+    rmdir(directory);
+}
+
+TEST(Preprocessor, reports_an_error_and_runs_again) {
+    CPP::Preprocessor preprocessor;
+    CPP::Preprocessor::Context context;
+    context.trace = false;
+    std::string input = "#define A a\n#endif\n";
+    EXPECT_FALSE(preprocessor.parse(input, context));
+    EXPECT_NE(context.error.find("#endif"), std::string::npos) << context.error;
+    // the definitions made before the error are kept
+    input = "A\n";
+    EXPECT_TRUE(preprocessor.parse(input, context));
+    EXPECT_TRUE(context.error.empty());
+    EXPECT_EQ(input, "a\n");
 }
@@ -0,0 +1,252 @@
+#ifndef CPP_ATOMS_H
+#define CPP_ATOMS_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace CPP {
+
+    // interns token spellings
+    //
+    // every distinct spelling gets a 32 bit atom the first time it is seen,
+    // tokens with the same spelling have the same atom, so tokens are
+    // compared by atom and spelled by looking their atom up
+    //
+    // spellings are copied once into an arena and found through an open
+    // addressing table of atoms probed linearly, the hash of each spelling is
+    // kept so probes and growth compare and rehash no strings
+    //
+    // the spellings the preprocessor looks for have fixed atoms
+    //
+    // the atoms may be based on a shared table, of a Snapshot, its atoms
+    // come first and are found in it where it lies, the spellings interned
+    // since follow them
+    //
+    // atoms are forked by freezing those interned so far into a base both
+    // the atoms and the fork read, each interns the spellings it meets after
+    // on its own, so forks may be used on different threads
+    class Atoms {
+    public:
+        // a table of atoms held elsewhere, read only
+        struct Shared {
+            // the spelling of atom is [offsets[atom], offsets[atom + 1]) in spellings
+            const uint32_t * offsets = nullptr;
+            const char * spellings = nullptr;
+            const uint32_t * hashes = nullptr;
+            // atom + 1 of the spelling hashed to each slot, 0 if the slot is empty
+            const uint32_t * slots = nullptr;
+            uint32_t count = 0;
+            uint32_t mask = 0;
+            // keeps the table alive
+            std::shared_ptr<const void> owner;
+        };
+
+        static uint32_t hash(std::string_view spelling) {
+            // fnv-1a
+            uint32_t hash = 2166136261u;
+            for (unsigned char character : spelling) {
+                hash = (hash ^ character) * 16777619u;
+            }
+            return hash;
+        }
+
+#ifdef GTEST_API_
+    public:
+#else
+    private:
+#endif
+        static constexpr size_t blockSize = 64 * 1024;
+
+        Shared shared;
+        // the frozen atoms these are based on, the shared table is theirs if
+        // there are any
+        std::shared_ptr<const Atoms> base;
+        // the atoms of the shared table or the base, those interned here
+        // follow them
+        uint32_t first = 0;
+
+        std::vector<std::unique_ptr<char[]>> blocks;
+        char * next = nullptr;
+        size_t remaining = 0;
+
+        // of the atoms after the first ones
+        std::vector<std::string_view> spellings;
+        std::vector<uint32_t> hashes;
+        // index + 1 in spellings of the spelling hashed to each slot, 0 if
+        // the slot is empty
+        std::vector<uint32_t> slots;
+        size_t mask = 0;
+
+        std::string_view sharedSpelling(uint32_t atom) const {
+            return std::string_view(shared.spellings + shared.offsets[atom], shared.offsets[atom + 1] - shared.offsets[atom]);
+        }
+
+        const char * store(std::string_view spelling) {
+            if (spelling.size() > remaining) {
+                // a spelling larger than a block gets a block of its own
+                size_t length = spelling.size() > blockSize ? spelling.size() : blockSize;
+                blocks.emplace_back(new char[length]);
+                next = blocks.back().get();
+                remaining = length;
+            }
+            char * copy = next;
+            if (!spelling.empty()) memcpy(copy, spelling.data(), spelling.size());
+            next += spelling.size();
+            remaining -= spelling.size();
+            return copy;
+        }
+
+        // the atom of spelling, noAtom if it was not interned
+        uint32_t lookup(std::string_view spelling, uint32_t hash) const {
+            if (base != nullptr) {
+                uint32_t atom = base->lookup(spelling, hash);
+                if (atom != noAtom) return atom;
+            } else if (shared.count != 0) {
+                for (size_t slot = hash & shared.mask; shared.slots[slot] != 0; slot = (slot + 1) & shared.mask) {
+                    uint32_t atom = shared.slots[slot] - 1;
+                    if (shared.hashes[atom] == hash && sharedSpelling(atom) == spelling) return atom;
+                }
+            }
+            for (size_t slot = hash & mask; slots[slot] != 0; slot = (slot + 1) & mask) {
+                uint32_t index = slots[slot] - 1;
+                if (hashes[index] == hash && spellings[index] == spelling) return first + index;
+            }
+            return noAtom;
+        }
+
+        // forgets the atoms interned here
+        void reset() {
+            spellings.clear();
+            hashes.clear();
+            blocks.clear();
+            next = nullptr;
+            remaining = 0;
+            slots.clear();
+            grow();
+        }
+
+        void grow() {
+            size_t capacity = slots.empty() ? 1024 : slots.size() * 2;
+            slots.assign(capacity, 0);
+            mask = capacity - 1;
+            for (uint32_t index = 0; index < spellings.size(); index++) {
+                size_t slot = hashes[index] & mask;
+                while (slots[slot] != 0) slot = (slot + 1) & mask;
+                slots[slot] = index + 1;
+            }
+        }
+
+    public:
+        enum : uint32_t {
+            Empty,
+            LeftParen,
+            RightParen,
+            Comma,
+            Hash,
+            HashHash,
+            Define,
+            Defined,
+            Include,
+            Pragma,
+            Once,
+            If,
+            Ifdef,
+            Ifndef,
+            Elif,
+            Else,
+            Endif,
+            Undef,
+            predefined
+        };
+
+        static constexpr uint32_t noAtom = UINT32_MAX;
+
+        Atoms() {
+            grow();
+            for (const char * spelling : {"", "(", ")", ",", "#", "##", "define", "defined", "include", "pragma", "once", "if", "ifdef", "ifndef", "elif", "else", "endif", "undef"}) {
+                intern(spelling);
+            }
+        }
+
+        // spellings are viewed by their atoms, an Atoms is not copied
+        Atoms(const Atoms &) = delete;
+        Atoms & operator=(const Atoms &) = delete;
+
+        // the spellings stay where they are, views of them stay valid
+        Atoms(Atoms &&) = default;
+
+        uint32_t intern(std::string_view spelling) {
+            uint32_t hash = Atoms::hash(spelling);
+            if (base != nullptr || shared.count != 0) {
+                uint32_t atom = lookup(spelling, hash);
+                if (atom != noAtom) return atom;
+            }
+            size_t slot = hash & mask;
+            while (slots[slot] != 0) {
+                uint32_t index = slots[slot] - 1;
+                if (hashes[index] == hash && spellings[index] == spelling) return first + index;
+                slot = (slot + 1) & mask;
+            }
+            uint32_t index = static_cast<uint32_t>(spellings.size());
+            spellings.emplace_back(store(spelling), spelling.size());
+            hashes.push_back(hash);
+            slots[slot] = index + 1;
+            // at most half full
+            if (spellings.size() * 2 > slots.size()) grow();
+            return first + index;
+        }
+
+        std::string_view spelling(uint32_t atom) const {
+            if (atom >= first) return spellings[atom - first];
+            return base != nullptr ? base->spelling(atom) : sharedSpelling(atom);
+        }
+
+        // the number of atoms, including the predefined ones
+        size_t size() const {
+            return first + spellings.size();
+        }
+
+        // bases other on the atoms interned so far, in constant time, the
+        // atoms of other are forgotten
+        //
+        // the atoms interned here so far are frozen into a base these and
+        // other share, read only, an atom interned by one after is not known
+        // to the other
+        void fork(Atoms & other) {
+            if (!spellings.empty()) {
+                auto frozen = std::make_shared<Atoms>(std::move(*this));
+                shared = Shared();
+                first = static_cast<uint32_t>(frozen->size());
+                base = std::move(frozen);
+                reset();
+            }
+            other.shared = shared;
+            other.base = base;
+            other.first = first;
+            other.reset();
+        }
+
+        // bases the atoms on table, whose first atoms are the predefined ones,
+        // the atoms interned so far are forgotten
+        //
+        // returns false, leaving the atoms as they were, if the predefined
+        // atoms of table differ
+        bool share(Shared table) {
+            if (table.count < predefined) return false;
+            for (uint32_t atom = 0; atom < predefined; atom++) {
+                std::string_view spelling(table.spellings + table.offsets[atom], table.offsets[atom + 1] - table.offsets[atom]);
+                if (spelling != this->spelling(atom)) return false;
+            }
+            shared = std::move(table);
+            base.reset();
+            first = shared.count;
+            reset();
+            return true;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef CPP_BATCH_H
+#define CPP_BATCH_H
+
+#include "Preprocessor.h"
+#include "Sink.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace CPP {
+
+    // preprocesses many inputs on worker threads, each into a file of its own
+    //
+    // every input is run in a context forked from one base context, see
+    // Preprocessor::fork, so it starts from the definitions of the base, or
+    // of the Snapshot the base uses, and pays only for what it defines, the
+    // files it includes come from the FileCache every worker shares
+    //
+    // the inputs are dealt out to the workers largest first, a worker runs
+    // its own from the front and, once it has none left, steals from the
+    // back of the others, an input is a run of its own so a worker takes the
+    // lock of a queue once an input
+    //
+    // an error in an input ends its run only, the input fails with the
+    // diagnostic of the error and the workers go on with the others
+    class Batch {
+    public:
+        struct Unit {
+            std::string input;
+            std::string output;
+        };
+
+#ifdef GTEST_API_
+    public:
+#else
+    private:
+#endif
+        // the inputs dealt to a worker, on a cache line of its own
+        struct alignas(64) Queue {
+            std::mutex mutex;
+            std::deque<size_t> units;
+        };
+
+        struct State {
+            Preprocessor::Context * base;
+            const std::vector<Unit> * units;
+            std::vector<Queue> queues;
+            // the diagnostic of each unit that failed, empty for the others
+            std::vector<std::string> errors;
+            explicit State(size_t workers) : queues(workers) {}
+        };
+
+        // the next input of worker, its own or one stolen from another,
+        // false once none are left anywhere
+        static bool take(State & state, size_t worker, size_t & unit) {
+            {
+                Queue & queue = state.queues[worker];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (!queue.units.empty()) {
+                    unit = queue.units.front();
+                    queue.units.pop_front();
+                    return true;
+                }
+            }
+            // inputs are never added, a worker that finds every queue empty is done
+            for (size_t offset = 1; offset < state.queues.size(); offset++) {
+                Queue & queue = state.queues[(worker + offset) % state.queues.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (!queue.units.empty()) {
+                    unit = queue.units.back();
+                    queue.units.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // runs unit in context, returns the diagnostic of the error that
+        // ended it, or why its input could not be read or its output could
+        // not be written, empty if it ran
+        static std::string run(Preprocessor & preprocessor, Preprocessor::Context & context, const Unit & unit) {
+            int input = ::open(unit.input.c_str(), O_RDONLY);
+            if (input < 0) return std::string("cannot read the input: ") + strerror(errno);
+            int output = ::open(unit.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (output < 0) {
+                std::string error = std::string("cannot write the output: ") + strerror(errno);
+                close(input);
+                return error;
+            }
+            context.name = unit.input;
+            FileSink sink(output);
+            bool ran = preprocessor.parse(input, context, sink);
+            close(input);
+            if (!ran) {
+                close(output);
+                return context.error;
+            }
+            if (sink.failed()) {
+                close(output);
+                return std::string("cannot write the output: ") + strerror(sink.error());
+            }
+            if (close(output) != 0) return std::string("cannot write the output: ") + strerror(errno);
+            return std::string();
+        }
+
+        static void work(State & state, size_t worker) {
+            Preprocessor preprocessor;
+            // reused by every input, its buffers keep their storage
+            Preprocessor::Context context;
+            size_t unit;
+            while (take(state, worker, unit)) {
+                Preprocessor::fork(*state.base, context);
+                context.trace = false;
+                state.errors[unit] = run(preprocessor, context, (*state.units)[unit]);
+            }
+        }
+
+    public:
+        // preprocesses every unit on workers threads, one for each core if
+        // workers is 0, in a context forked from base, returns the indices of
+        // the units that failed, an error in the input ended their run or
+        // their input could not be read or their output could not be
+        // written, errors, if given, is set to the diagnostic of each
+        //
+        // base is only read while the batch runs, its definitions, search
+        // paths and line markers apply to every unit, runs do not trace
+        static std::vector<size_t> run(Preprocessor::Context & base, const std::vector<Unit> & units, unsigned workers = 0, std::vector<std::string> * errors = nullptr) {
+            if (workers == 0) workers = std::max(1u, std::thread::hardware_concurrency());
+            if (workers > units.size()) workers = static_cast<unsigned>(std::max<size_t>(1, units.size()));
+            State state(workers);
+            state.base = &base;
+            state.units = &units;
+            state.errors.resize(units.size());
+            // the first fork freezes the atoms of base, the forks after only read it
+            Preprocessor::Context frozen;
+            Preprocessor::fork(base, frozen);
+            std::vector<std::pair<int64_t, size_t>> sizes;
+            sizes.reserve(units.size());
+            for (size_t unit = 0; unit < units.size(); unit++) {
+                struct stat status;
+                int64_t size = stat(units[unit].input.c_str(), &status) == 0 ? static_cast<int64_t>(status.st_size) : 0;
+                sizes.emplace_back(-size, unit);
+            }
+            std::sort(sizes.begin(), sizes.end());
+            for (size_t index = 0; index < sizes.size(); index++) {
+                state.queues[index % workers].units.push_back(sizes[index].second);
+            }
+            std::vector<std::thread> threads;
+            for (size_t worker = 1; worker < workers; worker++) {
+                threads.emplace_back(work, std::ref(state), worker);
+            }
+            work(state, 0);
+            for (std::thread & thread : threads) thread.join();
+            std::vector<size_t> failed;
+            if (errors != nullptr) errors->clear();
+            for (size_t unit = 0; unit < units.size(); unit++) {
+                if (state.errors[unit].empty()) continue;
+                failed.push_back(unit);
+                if (errors != nullptr) errors->push_back(std::move(state.errors[unit]));
+            }
+            return failed;
+        }
+    };
+}
+
+#endif
@@ -1,10 +1,17 @@
 #ifndef CPP_CPP_PREPROCESSOR_DATA_H
 #define CPP_CPP_PREPROCESSOR_DATA_H
 
+#include <cstring>
 #include <deque>
+#include <memory>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
+#include "PersistentAtomMap.h"
+#include "Lexer.h"
+
 #include <XLog/XLog.h>
 
 namespace CPP {
@@ -77,24 +84,288 @@ namespace CPP {
                 Function
             };
 
+            // an element of a compiled replacement list
+            struct Element {
+                enum Kind : uint8_t {
+                    // the token tokens[index]
+                    Text,
+                    // the macro expanded argument of parameter index
+                    Argument,
+                    // the argument of parameter index as written, an operand of ##
+                    UnexpandedArgument,
+                    // the argument of parameter index as written, spelled as a string literal by #
+                    Stringized
+                };
+
+                Kind kind = Text;
+                // the element is pasted to the one before it by ##
+                bool paste = false;
+                // the LeadingSpace and StartOfLine flags of the element
+                uint8_t flags = 0;
+                // always 0, fills what would be padding so a record written
+                // by write holds no uninitialised byte
+                uint8_t reserved = 0;
+                uint32_t index = 0;
+            };
+
+            enum Use : uint8_t {
+                Expanded = 1,
+                Unexpanded = 2
+            };
+
             Type type = Object;
-            std::string id;
+            uint32_t id = Atoms::Empty;
             std::string content;
-            std::vector<std::string> args;
-            std::vector<std::string> args_content;
+            // the replacement list as written
+            std::vector<Token> tokens;
+            // the replacement list with its parameters resolved and its # and
+            // ## operators marked, built once by #define
+            std::vector<Element> replacement;
+            std::vector<uint32_t> args;
+            // the Use flags of each parameter, an argument is only expanded if
+            // its expansion is used
+            std::vector<uint8_t> uses;
+
+            // appends the macro as a record of a Snapshot to output, tokens
+            // and elements are kept as they lie in memory
+            void write(std::string & output) const {
+                static_assert(std::is_trivially_copyable<Token>::value && std::is_trivially_copyable<Element>::value, "tokens and elements are copied as bytes");
+                static_assert(sizeof(Token) == 20 && sizeof(Element) == 8, "tokens and elements have no padding to copy");
+                auto put = [&](const void * data, size_t size) {
+                    output.append(static_cast<const char*>(data), size);
+                };
+                auto count = [&](size_t size) {
+                    uint32_t value = static_cast<uint32_t>(size);
+                    put(&value, sizeof(value));
+                };
+                count(id);
+                count(type);
+                count(args.size());
+                put(args.data(), args.size() * sizeof(uint32_t));
+                count(tokens.size());
+                put(tokens.data(), tokens.size() * sizeof(Token));
+                count(replacement.size());
+                put(replacement.data(), replacement.size() * sizeof(Element));
+                count(uses.size());
+                put(uses.data(), uses.size());
+                count(content.size());
+                put(content.data(), content.size());
+                // records stay aligned for their counts
+                output.resize((output.size() + 3) & ~size_t(3));
+            }
+
+            // the macro of a record written by write, the record ends by end
+            // at the latest and names atoms below atoms
+            //
+            // returns nullptr if the record does not fit or does not hold a
+            // macro, a record is not trusted to be one written by write
+            static std::shared_ptr<const Macro> read(const uint8_t * record, const uint8_t * end, uint32_t atoms) {
+                auto macro = std::make_shared<Macro>();
+                bool fits = true;
+                auto get = [&](void * data, size_t size) {
+                    if (!fits || size > static_cast<size_t>(end - record)) {
+                        fits = false;
+                        return;
+                    }
+                    if (size != 0) memcpy(data, record, size);
+                    record += size;
+                };
+                auto count = [&]() {
+                    uint32_t value = 0;
+                    get(&value, sizeof(value));
+                    return value;
+                };
+                // a count of values of size bytes, checked to fit before they are allocated
+                auto values = [&](size_t size) -> size_t {
+                    uint32_t value = count();
+                    if (!fits || value > static_cast<size_t>(end - record) / size) {
+                        fits = false;
+                        return 0;
+                    }
+                    return value;
+                };
+                macro->id = count();
+                uint32_t type = count();
+                macro->type = static_cast<Type>(type);
+                macro->args.resize(values(sizeof(uint32_t)));
+                get(macro->args.data(), macro->args.size() * sizeof(uint32_t));
+                macro->tokens.resize(values(sizeof(Token)));
+                get(macro->tokens.data(), macro->tokens.size() * sizeof(Token));
+                macro->replacement.resize(values(sizeof(Element)));
+                get(macro->replacement.data(), macro->replacement.size() * sizeof(Element));
+                macro->uses.resize(values(1));
+                get(macro->uses.data(), macro->uses.size());
+                macro->content.resize(values(1));
+                get(&macro->content[0], macro->content.size());
+                if (!fits || macro->id >= atoms || type > Function || macro->uses.size() != macro->args.size()) return nullptr;
+                for (uint32_t arg : macro->args) {
+                    if (arg >= atoms) return nullptr;
+                }
+                // tokens of a replacement list are in no hide set yet
+                for (const Token & token : macro->tokens) {
+                    if (token.atom >= atoms || token.kind > Token::Other || token.hideSet != 0) return nullptr;
+                }
+                for (const Element & element : macro->replacement) {
+                    if (element.kind > Element::Stringized || element.reserved != 0) return nullptr;
+                    if (element.index >= (element.kind == Element::Text ? macro->tokens.size() : macro->args.size())) return nullptr;
+                }
+                return macro;
+            }
+        };
+
+        // the macros defined, keyed by the atom of the macro name
+        //
+        // a macro does not change once defined, definitions are shared
+        //
+        // the definitions may be based on the records of a Snapshot, the
+        // macro of a record is read out of it the first time it is looked up,
+        // the snapshot is never written to, a macro defined since hides the
+        // one of the snapshot
+        //
+        // the macros are kept in a PersistentAtomMap, definitions are forked
+        // in constant time and each fork pays for the macros it defines,
+        // undefines or reads out of the snapshot after, an undefined macro is
+        // kept as nullptr so it hides the one of the snapshot or the fork
+        class Definitions {
+        public:
+            // the records of a snapshot, read only
+            struct Shared {
+                // the offset in records + 1 of the macro named by each atom
+                // of the snapshot, 0 if it names none
+                const uint32_t * index = nullptr;
+                uint32_t count = 0;
+                const uint8_t * records = nullptr;
+                // the bytes of records
+                size_t size = 0;
+                // keeps the records alive
+                std::shared_ptr<const void> owner;
+            };
+
+#ifdef GTEST_API_
+        public:
+#else
+        private:
+#endif
+            Shared shared;
+            // the macros defined or undefined since, and those read out of
+            // the snapshot
+            PersistentAtomMap<std::shared_ptr<const Macro>> macros;
+
+            bool recorded(uint32_t atom) const {
+                return atom < shared.count && shared.index[atom] != 0;
+            }
+
+        public:
+            // the macro named by atom, nullptr if it is not defined
+            //
+            // the pointer is invalidated by define, undefine and find
+            const std::shared_ptr<const Macro> * find(uint32_t atom) {
+                const std::shared_ptr<const Macro> * found = macros.find(atom);
+                if (found != nullptr) return *found != nullptr ? found : nullptr;
+                if (!recorded(atom)) return nullptr;
+                // a record that holds no macro reads as none
+                macros.set(atom, Macro::read(shared.records + shared.index[atom] - 1, shared.records + shared.size, shared.count));
+                found = macros.find(atom);
+                return *found != nullptr ? found : nullptr;
+            }
+
+            void define(uint32_t atom, std::shared_ptr<const Macro> macro) {
+                macros.set(atom, std::move(macro));
+            }
+
+            void undefine(uint32_t atom) {
+                if (macros.contains(atom) || recorded(atom)) macros.set(atom, nullptr);
+            }
+
+            // definitions with the macros of these, in constant time
+            Definitions fork() const {
+                return *this;
+            }
+
+            // bases the definitions on records, the macros defined so far are forgotten
+            void share(Shared records) {
+                macros.clear();
+                shared = std::move(records);
+            }
+
+            // calls visit(atom, macro) for every macro defined, reading
+            // those of the snapshot out of it
+            template <typename Visit>
+            void each(Visit visit) {
+                for (uint32_t atom = 0; atom < shared.count; atom++) {
+                    if (shared.index[atom] == 0) continue;
+                    const std::shared_ptr<const Macro> * macro = find(atom);
+                    if (macro != nullptr) visit(atom, *macro);
+                }
+                macros.each([&](uint32_t atom, const std::shared_ptr<const Macro> & macro) {
+                    if (macro != nullptr && !recorded(atom)) visit(atom, macro);
+                });
+            }
+        };
+
+        // the state of one macro invocation
+        //
+        // frames are kept on a stack that only grows, a frame is reused by
+        // every invocation at its depth so its vectors keep their storage
+        struct Frame {
+            const Macro * macro = nullptr;
+            // the tokens of the invocation from its ( to its ), as read
+            std::vector<Token> tokens;
+            // the index of the ( and of the , or ) after each argument in tokens
+            std::vector<size_t> bounds;
             size_t count = 0;
+            // the macro expanded arguments, those whose expansion is used
+            std::vector<std::vector<Token>> arguments;
         };
 
-        std::unordered_map<std::string, Macro> function_definitions;
-        std::unordered_map<std::string, Macro> definitions;
+        Definitions definitions;
+
+        // a list of tokens being read, the input or the expansion of a macro
+        //
+        // sources are kept on a stack that only grows, like frames, the input
+        // and the arguments of an invocation are read where they lie, an
+        // expansion is read from the tokens of its source
+        struct Source {
+            const Token * next = nullptr;
+            const Token * end = nullptr;
+            std::vector<Token> tokens;
+            // the source of a file reads its text, lexed into tokens a window
+            // of lines at a time as they are read, lexing ends with the
+            // EndOfFile token of the file
+            bool file = false;
+            uint16_t index = 0;
+            std::string_view text;
+            size_t lexed = 0;
+            bool lexing = false;
+            // the conditionals open when the file began, those the file
+            // opens are above them
+            size_t conditionals = 0;
+        };
+
+        // an #if, #ifdef or #ifndef whose #endif is not reached yet
+        struct Conditional {
+            // the directive that opened it, or its last #elif or #else
+            Token directive;
+            // a group of it was taken, the groups after it are skipped
+            bool taken = false;
+            // its #else was reached, no #elif or #else may follow
+            bool sawElse = false;
+        };
 
-        bool expanding_function = false;
+        // deque elements do not move, a frame stays put while deeper frames are pushed
+        std::deque<Frame> frames;
+        size_t depth = 0;
 
-//        std::stack<std::string> function_being_expanded;
+        // tokens are read from the innermost source that has any left
+        std::deque<Source> sources;
+        size_t reading = 0;
 
-        std::string current_id;
+        // the number of files being read, the input of the run and the files
+        // it includes
+        size_t including = 0;
 
-        std::deque<std::string> do_not_expand;
+        // the conditionals open in the files being read, innermost last
+        std::vector<Conditional> conditionals;
     };
 }
 
@@ -0,0 +1,623 @@
+#ifndef CPP_EXPRESSION_H
+#define CPP_EXPRESSION_H
+
+#include "Lexer.h"
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace CPP {
+
+    // the controlling expressions of #if and #elif, compiled to postfix
+    //
+    // an expression is compiled once into a Program, a list of instructions
+    // run on a stack, subexpressions of constants are folded while it is
+    // compiled so a program keeps only the leaves that depend on macros,
+    // defined X and identifiers, and the operators above them
+    //
+    // a program is run with Leaves giving the value of those, so evaluating
+    // it again only looks up its leaves
+    //
+    // values are intmax_t or uintmax_t as in C, an operand that is unsigned
+    // makes the operation unsigned, a division by zero gives a poisoned
+    // value that is only an error if the result depends on it, so the
+    // operands of && || and ?: that are not evaluated may divide by zero
+    class Expression {
+    public:
+        struct Value {
+            uint64_t bits = 0;
+            bool isUnsigned = false;
+            bool poisoned = false;
+
+            bool truth() const {
+                return bits != 0;
+            }
+        };
+
+        enum Op : uint8_t {
+            // leaves
+            Constant,
+            Defined,
+            Identifier,
+            // unary
+            Negate,
+            Complement,
+            Not,
+            Truth,
+            // binary
+            Multiply,
+            Divide,
+            Remainder,
+            Add,
+            Subtract,
+            ShiftLeft,
+            ShiftRight,
+            Less,
+            Greater,
+            LessEqual,
+            GreaterEqual,
+            Equal,
+            NotEqual,
+            BitAnd,
+            BitXor,
+            BitOr,
+            And,
+            Or,
+            // ternary
+            Select
+        };
+
+        struct Instruction {
+            Op op = Constant;
+            // of a Constant
+            Value value;
+            // of Defined and Identifier
+            uint32_t atom = 0;
+        };
+
+        // a compiled expression
+        struct Program {
+            std::vector<Instruction> code;
+            // the most values on the stack while it runs
+            size_t depth = 0;
+            // false if the expression could not be compiled as written
+            bool compiled = false;
+
+            // sets result to the value of the program, leaves has
+            //
+            //     bool defined(uint32_t atom)
+            //     bool identifier(uint32_t atom, Value & value)
+            //
+            // returns false if identifier did, the value of the expression
+            // then cannot be found from the values of its leaves
+            template <typename Leaves>
+            bool run(Leaves & leaves, Value & result) const {
+                Value small[16];
+                std::vector<Value> large;
+                Value * stack = small;
+                if (depth > 16) {
+                    large.resize(depth);
+                    stack = large.data();
+                }
+                size_t top = 0;
+                for (const Instruction & instruction : code) {
+                    switch (instruction.op) {
+                        case Constant:
+                            stack[top++] = instruction.value;
+                            break;
+                        case Defined:
+                            stack[top] = Value();
+                            stack[top++].bits = leaves.defined(instruction.atom);
+                            break;
+                        case Identifier:
+                            stack[top] = Value();
+                            if (!leaves.identifier(instruction.atom, stack[top++])) return false;
+                            break;
+                        case Negate:
+                        case Complement:
+                        case Not:
+                        case Truth:
+                            unary(instruction.op, stack[top - 1]);
+                            break;
+                        case Select:
+                            select(stack[top - 3], stack[top - 2], stack[top - 1]);
+                            top -= 2;
+                            break;
+                        default:
+                            binary(instruction.op, stack[top - 2], stack[top - 1]);
+                            top--;
+                    }
+                }
+                result = stack[0];
+                return true;
+            }
+
+            // true if the program is a single constant
+            bool constant() const {
+                return code.size() == 1 && code[0].op == Constant;
+            }
+        };
+
+        // leaves for an expression whose macros are already expanded, an
+        // identifier left is 0, true is 1
+        struct Constants {
+            const Atoms & atoms;
+
+            bool defined(uint32_t) {
+                return false;
+            }
+
+            bool identifier(uint32_t atom, Value & value) {
+                value.bits = atoms.spelling(atom) == "true";
+                return true;
+            }
+        };
+
+        static void unary(Op op, Value & value) {
+            switch (op) {
+                case Negate:
+                    value.bits = 0 - value.bits;
+                    break;
+                case Complement:
+                    value.bits = ~value.bits;
+                    break;
+                case Not:
+                    value.bits = !value.truth();
+                    value.isUnsigned = false;
+                    break;
+                case Truth:
+                    value.bits = value.truth();
+                    value.isUnsigned = false;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        static void select(Value & condition, const Value & taken, const Value & other) {
+            bool isUnsigned = taken.isUnsigned || other.isUnsigned;
+            bool poisoned = condition.poisoned;
+            condition = condition.truth() ? taken : other;
+            condition.isUnsigned = isUnsigned;
+            condition.poisoned |= poisoned;
+        }
+
+        static void binary(Op op, Value & left, const Value & right) {
+            bool isUnsigned = left.isUnsigned || right.isUnsigned;
+            bool poisoned = left.poisoned || right.poisoned;
+            int64_t a = static_cast<int64_t>(left.bits);
+            int64_t b = static_cast<int64_t>(right.bits);
+            uint64_t x = left.bits;
+            uint64_t y = right.bits;
+            uint64_t bits = 0;
+            switch (op) {
+                case Multiply:
+                    bits = x * y;
+                    break;
+                case Divide:
+                case Remainder:
+                    if (y == 0) {
+                        poisoned = true;
+                    } else if (isUnsigned) {
+                        bits = op == Divide ? x / y : x % y;
+                    } else if (a == INT64_MIN && b == -1) {
+                        bits = op == Divide ? x : 0;
+                    } else {
+                        bits = static_cast<uint64_t>(op == Divide ? a / b : a % b);
+                    }
+                    break;
+                case Add:
+                    bits = x + y;
+                    break;
+                case Subtract:
+                    bits = x - y;
+                    break;
+                case ShiftLeft:
+                case ShiftRight: {
+                    // the type is that of the left operand, a negative shift
+                    // shifts the other way
+                    isUnsigned = left.isUnsigned;
+                    bool leftShift = op == ShiftLeft;
+                    uint64_t count = y;
+                    if (!right.isUnsigned && b < 0) {
+                        leftShift = !leftShift;
+                        count = 0 - y;
+                    }
+                    if (count >= 64) {
+                        bits = leftShift || isUnsigned || a >= 0 ? 0 : ~uint64_t(0);
+                    } else if (leftShift) {
+                        bits = x << count;
+                    } else {
+                        bits = isUnsigned ? x >> count : static_cast<uint64_t>(a >> count);
+                    }
+                    break;
+                }
+                case Less:
+                    bits = isUnsigned ? x < y : a < b;
+                    isUnsigned = false;
+                    break;
+                case Greater:
+                    bits = isUnsigned ? x > y : a > b;
+                    isUnsigned = false;
+                    break;
+                case LessEqual:
+                    bits = isUnsigned ? x <= y : a <= b;
+                    isUnsigned = false;
+                    break;
+                case GreaterEqual:
+                    bits = isUnsigned ? x >= y : a >= b;
+                    isUnsigned = false;
+                    break;
+                case Equal:
+                    bits = x == y;
+                    isUnsigned = false;
+                    break;
+                case NotEqual:
+                    bits = x != y;
+                    isUnsigned = false;
+                    break;
+                case BitAnd:
+                    bits = x & y;
+                    break;
+                case BitXor:
+                    bits = x ^ y;
+                    break;
+                case BitOr:
+                    bits = x | y;
+                    break;
+                case And:
+                    // the right operand only counts if the left does not decide
+                    bits = left.truth() && right.truth();
+                    poisoned = left.poisoned || (left.truth() && right.poisoned);
+                    isUnsigned = false;
+                    break;
+                case Or:
+                    bits = left.truth() || right.truth();
+                    poisoned = left.poisoned || (!left.truth() && right.poisoned);
+                    isUnsigned = false;
+                    break;
+                default:
+                    break;
+            }
+            left.bits = bits;
+            left.isUnsigned = isUnsigned;
+            left.poisoned = poisoned;
+        }
+
+#ifdef GTEST_API_
+    public:
+#else
+    private:
+#endif
+        const Atoms & atoms;
+        const Token * token;
+        const Token * end;
+        Program * program = nullptr;
+        // the values on the stack of the program compiled so far
+        size_t height = 0;
+
+        std::string_view spelling() const {
+            return token == end ? std::string_view() : atoms.spelling(token->atom);
+        }
+
+        bool fail(const char * message) {
+            if (error.empty()) {
+                error = message;
+                at = token == end ? nullptr : token;
+            }
+            return false;
+        }
+
+        void emit(const Instruction & instruction, size_t pops) {
+            program->code.push_back(instruction);
+            height = height - pops + 1;
+            if (height > program->depth) program->depth = height;
+        }
+
+        void constant(const Value & value) {
+            Instruction instruction;
+            instruction.value = value;
+            emit(instruction, 0);
+        }
+
+        // the code from start on is a single constant
+        bool folds(size_t start) const {
+            return program->code.size() == start + 1 && program->code[start].op == Constant;
+        }
+
+        // the value of a number token, an integer constant with its suffixes
+        bool number(std::string_view text, Value & value) {
+            size_t index = 0;
+            unsigned base = 10;
+            if (text.size() > 1 && text[0] == '0') {
+                if (text[1] == 'x' || text[1] == 'X') {
+                    base = 16;
+                    index = 2;
+                } else if (text[1] == 'b' || text[1] == 'B') {
+                    base = 2;
+                    index = 2;
+                } else {
+                    base = 8;
+                    index = 1;
+                }
+            }
+            uint64_t bits = 0;
+            bool overflow = false;
+            size_t digits = 0;
+            for (; index < text.size(); index++) {
+                char c = text[index];
+                // digit separators
+                if (c == '\'') continue;
+                unsigned digit;
+                if (c >= '0' && c <= '9') {
+                    digit = c - '0';
+                } else if (base == 16 && c >= 'a' && c <= 'f') {
+                    digit = c - 'a' + 10;
+                } else if (base == 16 && c >= 'A' && c <= 'F') {
+                    digit = c - 'A' + 10;
+                } else {
+                    break;
+                }
+                if (digit >= base) return fail("invalid digit in integer constant");
+                if (bits > (UINT64_MAX - digit) / base) overflow = true;
+                bits = bits * base + digit;
+                digits++;
+            }
+            if (digits == 0 && base != 8) return fail("invalid integer constant");
+            bool isUnsigned = false;
+            for (; index < text.size(); index++) {
+                char c = text[index];
+                if (c == 'u' || c == 'U') {
+                    isUnsigned = true;
+                } else if (c != 'l' && c != 'L' && c != 'z' && c != 'Z') {
+                    return fail("invalid integer constant in preprocessor expression");
+                }
+            }
+            if (overflow) return fail("integer constant is too large");
+            // a decimal constant too large for intmax_t has no type, others are unsigned
+            if (bits > INT64_MAX && !isUnsigned) {
+                if (base == 10) return fail("integer constant is too large for its type");
+                isUnsigned = true;
+            }
+            value.bits = bits;
+            value.isUnsigned = isUnsigned;
+            return true;
+        }
+
+        // the value of a character literal, the value of its first character
+        bool character(std::string_view text, Value & value) {
+            size_t quote = text.find('\'');
+            std::string_view body = text.substr(quote + 1);
+            if (body.empty() || body.back() != '\'' || body.size() < 2) return fail("invalid character constant");
+            body.remove_suffix(1);
+            uint64_t bits = static_cast<unsigned char>(body[0]);
+            if (body[0] == '\\' && body.size() > 1) {
+                char c = body[1];
+                switch (c) {
+                    case 'n': bits = '\n'; break;
+                    case 't': bits = '\t'; break;
+                    case 'r': bits = '\r'; break;
+                    case 'a': bits = '\a'; break;
+                    case 'b': bits = '\b'; break;
+                    case 'f': bits = '\f'; break;
+                    case 'v': bits = '\v'; break;
+                    case 'x': bits = strtoull(std::string(body.substr(2)).c_str(), nullptr, 16); break;
+                    default:
+                        if (c >= '0' && c <= '7') {
+                            bits = strtoull(std::string(body.substr(1, 3)).c_str(), nullptr, 8);
+                        } else {
+                            bits = static_cast<unsigned char>(c);
+                        }
+                }
+            }
+            // a plain char is signed
+            if (quote == 0) bits = static_cast<uint64_t>(static_cast<int64_t>(static_cast<signed char>(bits)));
+            value.bits = bits;
+            value.isUnsigned = false;
+            return true;
+        }
+
+        // defined X or defined ( X ), token is after defined
+        bool defined() {
+            bool parenthesis = spelling() == "(";
+            if (parenthesis) token++;
+            if (token == end || token->kind != Token::Identifier) return fail("operator \"defined\" requires an identifier");
+            Instruction instruction;
+            instruction.op = Defined;
+            instruction.atom = token->atom;
+            token++;
+            if (parenthesis) {
+                if (spelling() != ")") return fail("missing ')' after \"defined\"");
+                token++;
+            }
+            emit(instruction, 0);
+            return true;
+        }
+
+        bool primary() {
+            if (token == end) return fail("expected a value in preprocessor expression");
+            std::string_view text = spelling();
+            if (text == "(") {
+                token++;
+                if (!conditional()) return false;
+                if (spelling() != ")") return fail("expected ')' in preprocessor expression");
+                token++;
+                return true;
+            }
+            if (text == "+" || text == "-" || text == "~" || text == "!") {
+                token++;
+                size_t start = program->code.size();
+                if (!primary()) return false;
+                if (text == "+") return true;
+                Op op = text == "-" ? Negate : text == "~" ? Complement : Not;
+                if (folds(start)) {
+                    unary(op, program->code[start].value);
+                } else {
+                    Instruction instruction;
+                    instruction.op = op;
+                    emit(instruction, 1);
+                }
+                return true;
+            }
+            Value value;
+            switch (token->kind) {
+                case Token::Number:
+                    if (!number(text, value)) return false;
+                    break;
+                case Token::CharacterLiteral:
+                    if (!character(text, value)) return false;
+                    break;
+                case Token::Identifier: {
+                    if (token->atom == Atoms::Defined) {
+                        token++;
+                        return defined();
+                    }
+                    // an invocation of a function-like macro, the line must be expanded
+                    if (token + 1 != end && token[1].atom == Atoms::LeftParen) {
+                        token++;
+                        return fail("missing binary operator before '('");
+                    }
+                    Instruction instruction;
+                    instruction.op = Identifier;
+                    instruction.atom = token->atom;
+                    token++;
+                    emit(instruction, 0);
+                    return true;
+                }
+                default:
+                    return fail("token is not valid in preprocessor expressions");
+            }
+            token++;
+            constant(value);
+            return true;
+        }
+
+        // the binary operator text and its precedence, 0 if it is none
+        static int precedence(std::string_view text, Op & op) {
+            static const struct {
+                const char * text;
+                Op op;
+                int precedence;
+            } operators[] = {
+                {"*", Multiply, 10}, {"/", Divide, 10}, {"%", Remainder, 10},
+                {"+", Add, 9}, {"-", Subtract, 9},
+                {"<<", ShiftLeft, 8}, {">>", ShiftRight, 8},
+                {"<", Less, 7}, {">", Greater, 7}, {"<=", LessEqual, 7}, {">=", GreaterEqual, 7},
+                {"==", Equal, 6}, {"!=", NotEqual, 6},
+                {"&", BitAnd, 5}, {"^", BitXor, 4}, {"|", BitOr, 3},
+                {"&&", And, 2}, {"||", Or, 1}
+            };
+            for (const auto & entry : operators) {
+                if (text == entry.text) {
+                    op = entry.op;
+                    return entry.precedence;
+                }
+            }
+            return 0;
+        }
+
+        // the operators binding tighter than minimum, by precedence climbing
+        bool binary(int minimum) {
+            size_t start = program->code.size();
+            if (!primary()) return false;
+            while (true) {
+                Op op;
+                int level = precedence(spelling(), op);
+                if (level == 0 || level < minimum) return true;
+                token++;
+                bool left = folds(start);
+                size_t right = program->code.size();
+                if (!binary(level + 1)) return false;
+                std::vector<Instruction> & code = program->code;
+                if (left && folds(right)) {
+                    binary(op, code[start].value, code[right].value);
+                    code.pop_back();
+                    height--;
+                } else if (left && (op == And || op == Or) && !code[start].value.poisoned && code[start].value.truth() == (op == Or)) {
+                    // the constant decides, 0 && x and 1 || x
+                    code.resize(start + 1);
+                    code[start].value.bits = op == Or;
+                    code[start].value.isUnsigned = false;
+                    height = height - 1;
+                } else if (left && (op == And || op == Or) && !code[start].value.poisoned) {
+                    // the other operand decides, 1 && x and 0 || x
+                    code.erase(code.begin() + start);
+                    height--;
+                    Instruction instruction;
+                    instruction.op = Truth;
+                    emit(instruction, 1);
+                } else {
+                    Instruction instruction;
+                    instruction.op = op;
+                    emit(instruction, 2);
+                }
+            }
+        }
+
+        bool conditional() {
+            size_t start = program->code.size();
+            if (!binary(1)) return false;
+            if (spelling() != "?") return true;
+            token++;
+            size_t taken = program->code.size();
+            if (!conditional()) return false;
+            if (spelling() != ":") return fail("expected ':' in preprocessor expression");
+            token++;
+            size_t other = program->code.size();
+            if (!conditional()) return false;
+            std::vector<Instruction> & code = program->code;
+            if (folds(other) && other == taken + 1 && taken == start + 1 && code[start].op == Constant && code[taken].op == Constant) {
+                select(code[start].value, code[taken].value, code[other].value);
+                code.resize(start + 1);
+                height -= 2;
+            } else {
+                Instruction instruction;
+                instruction.op = Select;
+                emit(instruction, 3);
+            }
+            return true;
+        }
+
+    public:
+        // the message of the error compile or evaluate found, and the token
+        // it is at, nullptr at the end of the expression
+        std::string error;
+        const Token * at = nullptr;
+
+        Expression(const Atoms & atoms, const Token * begin, const Token * end) : atoms(atoms), token(begin), end(end) {}
+
+        // compiles the tokens into program, an operand is a unary expression,
+        // as a macro standing for a value in an expression must be to keep
+        // its meaning once replaced by that value
+        //
+        // returns false if the tokens are not an expression, they may be one
+        // once their macros are expanded
+        bool compile(Program & program, bool operand = false) {
+            this->program = &program;
+            program = Program();
+            height = 0;
+            if (token == end) return fail("#if with no expression");
+            if (!(operand ? primary() : conditional())) return false;
+            if (token != end) return fail("missing binary operator in preprocessor expression");
+            program.compiled = true;
+            return true;
+        }
+
+        // sets result to whether the expression, whose macros are expanded,
+        // is nonzero, returns false if it is not a valid expression
+        bool evaluate(bool & result) {
+            Program program;
+            if (!compile(program)) return false;
+            Constants constants{atoms};
+            Value value;
+            program.run(constants, value);
+            if (value.poisoned) return fail("division by zero in preprocessor expression");
+            result = value.truth();
+            return true;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef CPP_FILE_CACHE_H
+#define CPP_FILE_CACHE_H
+
+#include "Phases.h"
+#include "Skip.h"
+#include "SourceMap.h"
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace CPP {
+
+    // the files read by #include, shared by every run in the process
+    //
+    // a file is mapped, cleaned by phases 1 and 2 into a buffer of its own
+    // and unmapped, the cleaned text is kept under the canonical path of the
+    // file together with its modification time, a file included again, by
+    // any run on any thread, is only cleaned again once it changed
+    //
+    // files are handed out as shared pointers to immutable File, a run keeps
+    // the files it read alive while a newer version replaces them
+    //
+    // a file whose text is wholly inside #ifndef X ... #endif is found to be
+    // guarded by X as it is loaded, an #include of it is skipped while X is
+    // defined
+    class FileCache {
+    public:
+        struct File {
+            // canonical
+            std::string path;
+            int64_t mtime = 0;
+            // phases 1 and 2 applied
+            std::string text;
+            SourceMap locations;
+            // the macro of the include guard, empty if the file has none, the
+            // text between the #ifndef and #endif lines is [body, end)
+            std::string guard;
+            uint32_t body = 0;
+            uint32_t end = 0;
+            // a block comment does not end, the file is not included
+            bool unterminated = false;
+        };
+
+#ifdef GTEST_API_
+    public:
+#else
+    private:
+#endif
+        // the File of a path, loaded once by whichever run asks first
+        struct Entry {
+            int64_t mtime = 0;
+            std::once_flag loaded;
+            std::shared_ptr<const File> file;
+        };
+
+        std::mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<Entry>> entries;
+
+        static int64_t mtime(const struct stat & status) {
+#if defined(__linux__)
+            return static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+#else
+            return static_cast<int64_t>(status.st_mtime) * 1000000000;
+#endif
+        }
+
+        // finds the include guard of file, see Skip
+        //
+        // the first line that is not blank must be #ifndef X, the #endif
+        // closing it must be followed by blank lines only and no #else or
+        // #elif may belong to it
+        static void guard(File & file) {
+            const char * begin = file.text.data();
+            const char * end = begin + file.text.size();
+            const char * p = begin;
+            std::string_view guard;
+            size_t depth = 0;
+            while (p != end) {
+                // the start of the line the first byte that is not blank is on
+                const char * line = p;
+                while (p != end && (Skip::blank(*p) || *p == '\n')) {
+                    if (*p == '\n') line = p + 1;
+                    p++;
+                }
+                if (p == end) break;
+                if (depth == 0 && !guard.empty()) return;
+                std::string_view directive;
+                if (*p == '#') {
+                    p++;
+                    directive = Skip::word(p, end);
+                }
+                if (guard.empty()) {
+                    if (directive != "ifndef") return;
+                    guard = Skip::word(p, end);
+                    while (p != end && Skip::blank(*p)) p++;
+                    if (guard.empty() || (p != end && *p != '\n')) return;
+                    file.body = static_cast<uint32_t>(Skip::line(p, end) - begin);
+                    depth = 1;
+                } else if (directive == "if" || directive == "ifdef" || directive == "ifndef") {
+                    depth++;
+                } else if ((directive == "else" || directive == "elif") && depth == 1) {
+                    return;
+                } else if (directive == "endif" && --depth == 0) {
+                    file.end = static_cast<uint32_t>(line - begin);
+                }
+                p = Skip::line(p, end);
+            }
+            if (guard.empty() || depth != 0) return;
+            file.guard = guard;
+        }
+
+        static std::shared_ptr<const File> load(const std::string & path, int64_t mtime) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return nullptr;
+            struct stat status;
+            if (fstat(fd, &status) != 0) {
+                close(fd);
+                return nullptr;
+            }
+            auto file = std::make_shared<File>();
+            file->path = path;
+            file->mtime = mtime;
+            size_t size = static_cast<size_t>(status.st_size);
+            if (size == 0) {
+                Phases::clean(std::string_view(), file->text, &file->locations);
+                close(fd);
+                return file;
+            }
+            void * mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED) return nullptr;
+            file->unterminated = !Phases::clean(std::string_view(static_cast<const char*>(mapped), size), file->text, &file->locations);
+            munmap(mapped, size);
+            if (!file->unterminated) guard(*file);
+            return file;
+        }
+
+    public:
+        // the cache of the process
+        static FileCache & shared() {
+            static FileCache cache;
+            return cache;
+        }
+
+        // the cleaned file at path, nullptr if it is not a readable file
+        std::shared_ptr<const File> open(const std::string & path) {
+            struct stat status;
+            if (stat(path.c_str(), &status) != 0 || !S_ISREG(status.st_mode)) return nullptr;
+            char * resolved = realpath(path.c_str(), nullptr);
+            if (resolved == nullptr) return nullptr;
+            std::string canonical = resolved;
+            free(resolved);
+            int64_t modified = mtime(status);
+            std::shared_ptr<Entry> entry;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::shared_ptr<Entry> & cached = entries[canonical];
+                if (cached == nullptr || cached->mtime != modified) {
+                    cached = std::make_shared<Entry>();
+                    cached->mtime = modified;
+                }
+                entry = cached;
+            }
+            // loaded outside the lock, runs asking for other files are not held up
+            std::call_once(entry->loaded, [&] {
+                entry->file = load(canonical, modified);
+            });
+            return entry->file;
+        }
+
+        // the number of files cached
+        size_t size() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return entries.size();
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            entries.clear();
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef CPP_GRAMMAR_H
+#define CPP_GRAMMAR_H
+
+#include "Rules.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace CPP {
+    namespace Rules {
+
+        // owns the rules of one grammar
+        //
+        // make() places rules in a monotonic arena, they are never freed one by
+        // one, every rule is destroyed and the arena freed in one go when the
+        // grammar is destroyed or cleared
+        //
+        // rules made with new can still be mixed in, they stay owned by whoever
+        // made them
+        //
+        // a grammar shares no state with any other, grammars can be built and
+        // destroyed on any number of threads at once
+        class Grammar {
+#ifdef GTEST_API_
+        public:
+#endif
+            static constexpr size_t blockSize = 16 * 1024;
+
+            std::vector<std::unique_ptr<char[]>> blocks;
+            char * next = nullptr;
+            size_t remaining = 0;
+            std::vector<Rule*> rules;
+
+            void * allocate(size_t size, size_t alignment) {
+                size_t padding = (alignment - reinterpret_cast<uintptr_t>(next) % alignment) % alignment;
+                if (next == nullptr || padding + size > remaining) {
+                    // a rule larger than a block gets a block of its own
+                    size_t length = size > blockSize ? size : blockSize;
+                    blocks.emplace_back(new char[length]);
+                    next = blocks.back().get();
+                    remaining = length;
+                    padding = 0;
+                }
+                void * memory = next + padding;
+                next += padding + size;
+                remaining -= padding + size;
+                return memory;
+            }
+
+        public:
+            Grammar() = default;
+
+            Grammar(const Grammar &) = delete;
+            Grammar & operator=(const Grammar &) = delete;
+
+            Grammar(Grammar && other) noexcept {
+                *this = std::move(other);
+            }
+
+            Grammar & operator=(Grammar && other) noexcept {
+                if (this != &other) {
+                    clear();
+                    blocks = std::move(other.blocks);
+                    rules = std::move(other.rules);
+                    next = other.next;
+                    remaining = other.remaining;
+                    other.blocks.clear();
+                    other.rules.clear();
+                    other.next = nullptr;
+                    other.remaining = 0;
+                }
+                return *this;
+            }
+
+            ~Grammar() {
+                clear();
+            }
+
+            template <typename T, typename ... Args>
+            T * make(Args && ... args) {
+                static_assert(std::is_base_of<Rule, T>::value, "a grammar only makes rules");
+                static_assert(alignof(T) <= alignof(std::max_align_t), "rules must not be over aligned");
+                T * rule = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+                rules.push_back(rule);
+                return rule;
+            }
+
+            // braced lists cannot be forwarded, these take the rules of an Or
+            // or a Sequence and the letters of a Range
+
+            template <typename T>
+            T * make(std::initializer_list<Rule*> rules, Action action = NO_ACTION) {
+                return make<T, std::initializer_list<Rule*>&, Action&>(rules, action);
+            }
+
+            template <typename T>
+            T * make(std::initializer_list<char> letters, Action action = NO_ACTION) {
+                return make<T, std::initializer_list<char>&, Action&>(letters, action);
+            }
+
+            // the number of rules made by this grammar
+            size_t size() const {
+                return rules.size();
+            }
+
+            // destroys every rule made by this grammar, the grammar can make new rules afterwards
+            void clear() {
+                for (auto rule = rules.rbegin(); rule != rules.rend(); rule++) {
+                    (*rule)->~Rule();
+                }
+                rules.clear();
+                blocks.clear();
+                next = nullptr;
+                remaining = 0;
+            }
+        };
+    }
+}
+
+#endif
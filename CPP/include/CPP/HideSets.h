@@ -0,0 +1,118 @@
+#ifndef CPP_HIDE_SETS_H
+#define CPP_HIDE_SETS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <unordered_map>
+#include <vector>
+
+namespace CPP {
+
+    // the hide sets of tokens, the macro names a token must not expand
+    //
+    // a hide set is immutable and interned, a token refers to it by a 32 bit
+    // id and tokens with the same hide set share it, 0 is the empty set
+    //
+    // every set is a sorted list of atoms, the results of add, unite and
+    // intersect are cached so the same expansion applied to many tokens
+    // builds its set once
+    class HideSets {
+#ifdef GTEST_API_
+    public:
+#endif
+        struct Hash {
+            size_t operator()(const std::vector<uint32_t> & atoms) const {
+                size_t hash = atoms.size();
+                for (uint32_t atom : atoms) {
+                    hash = (hash ^ atom) * 0x100000001B3ull;
+                }
+                return hash;
+            }
+        };
+
+        std::vector<std::vector<uint32_t>> sets;
+        std::unordered_map<std::vector<uint32_t>, uint32_t, Hash> ids;
+        std::unordered_map<uint64_t, uint32_t> added;
+        std::unordered_map<uint64_t, uint32_t> united;
+        std::unordered_map<uint64_t, uint32_t> intersected;
+
+        uint32_t intern(std::vector<uint32_t> && atoms) {
+            auto found = ids.find(atoms);
+            if (found != ids.end()) return found->second;
+            uint32_t set = static_cast<uint32_t>(sets.size());
+            ids.emplace(atoms, set);
+            sets.push_back(std::move(atoms));
+            return set;
+        }
+
+        static uint64_t key(uint32_t a, uint32_t b) {
+            return (static_cast<uint64_t>(a) << 32) | b;
+        }
+
+    public:
+        HideSets() {
+            clear();
+        }
+
+        bool contains(uint32_t set, uint32_t atom) const {
+            const std::vector<uint32_t> & atoms = sets[set];
+            return std::binary_search(atoms.begin(), atoms.end(), atom);
+        }
+
+        // set with atom added
+        uint32_t add(uint32_t set, uint32_t atom) {
+            if (contains(set, atom)) return set;
+            uint32_t & result = added.emplace(key(set, atom), 0).first->second;
+            if (result == 0) {
+                std::vector<uint32_t> atoms = sets[set];
+                atoms.insert(std::lower_bound(atoms.begin(), atoms.end(), atom), atom);
+                result = intern(std::move(atoms));
+            }
+            return result;
+        }
+
+        uint32_t unite(uint32_t a, uint32_t b) {
+            if (a == b || b == 0) return a;
+            if (a == 0) return b;
+            if (a > b) std::swap(a, b);
+            uint32_t & result = united.emplace(key(a, b), 0).first->second;
+            if (result == 0) {
+                std::vector<uint32_t> atoms;
+                std::set_union(sets[a].begin(), sets[a].end(), sets[b].begin(), sets[b].end(), std::back_inserter(atoms));
+                result = intern(std::move(atoms));
+            }
+            return result;
+        }
+
+        uint32_t intersect(uint32_t a, uint32_t b) {
+            if (a == b) return a;
+            if (a == 0 || b == 0) return 0;
+            if (a > b) std::swap(a, b);
+            auto found = intersected.find(key(a, b));
+            if (found != intersected.end()) return found->second;
+            std::vector<uint32_t> atoms;
+            std::set_intersection(sets[a].begin(), sets[a].end(), sets[b].begin(), sets[b].end(), std::back_inserter(atoms));
+            uint32_t result = intern(std::move(atoms));
+            intersected.emplace(key(a, b), result);
+            return result;
+        }
+
+        // the number of distinct sets, including the empty set
+        size_t size() const {
+            return sets.size();
+        }
+
+        // forgets every set but the empty set, ids handed out before are invalid
+        void clear() {
+            sets.clear();
+            ids.clear();
+            added.clear();
+            united.clear();
+            intersected.clear();
+            intern({});
+        }
+    };
+}
+
+#endif
@@ -39,6 +39,10 @@ namespace CPP {
     public:
         T &input;
 
+        // incremented every time input is modified through Rules::Input,
+        // anything cached against offsets into input is stale once it changes
+        uint64_t generation = 0;
+
         Iterator(T &input) : iteratorCurrent(input.cbegin()), input(input){}
 
         Iterator copy() {
@@ -135,6 +139,14 @@ namespace CPP {
             iteratorStack.push_back(iterator);
         }
 
+        size_t iteratorStackSize() const {
+            return iteratorStack.size();
+        }
+
+        std::string::const_iterator iteratorStackAt(size_t index) const {
+            return iteratorStack[index];
+        }
+
         void popIterator() {
             if (!iteratorStack.empty()) {
                 iteratorCurrent = iteratorStack.back();
@@ -0,0 +1,270 @@
+#ifndef CPP_LEXER_H
+#define CPP_LEXER_H
+
+#include "Atoms.h"
+#include "Scan.h"
+#include "SourceMap.h"
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace CPP {
+
+    // a preprocessing token
+    //
+    // offset and length locate the token in the text it was lexed from, the
+    // spelling is found through the atom so tokens can be copied out of that
+    // text, into macro definitions and expansions, without their spelling,
+    // the tokens of an expansion are located at its invocation
+    struct Token {
+        enum Kind : uint8_t {
+            EndOfFile,
+            Identifier,
+            Number,
+            CharacterLiteral,
+            StringLiteral,
+            Punctuator,
+            Other
+        };
+
+        enum Flags : uint8_t {
+            // whitespace came before the token
+            LeadingSpace = 1,
+            // the token is the first on its line
+            StartOfLine = 2
+        };
+
+        Kind kind = EndOfFile;
+        uint8_t flags = 0;
+        // the file of the run the token was read from, see SourceFiles
+        uint16_t file = 0;
+        uint32_t atom = Atoms::Empty;
+        uint32_t offset = 0;
+        uint32_t length = 0;
+        // the macros the token came out of, see HideSets
+        uint32_t hideSet = 0;
+    };
+
+    // splits phase 2 output into preprocessing tokens
+    //
+    // whitespace and newlines are not tokens, they become the LeadingSpace and
+    // StartOfLine flags of the token after them
+    class Lexer {
+#ifdef GTEST_API_
+    public:
+#endif
+        struct Sets {
+            Scan::CharacterSet whitespace;
+            Scan::CharacterSet identifierStart;
+            Scan::CharacterSet identifier;
+            Scan::CharacterSet number;
+
+            Sets() {
+                whitespace.add(' ');
+                whitespace.add('\t');
+                whitespace.add('\v');
+                whitespace.add('\f');
+                whitespace.add('\r');
+                identifierStart.add('a', 'z');
+                identifierStart.add('A', 'Z');
+                identifierStart.add('_');
+                // utf-8 sequences are taken as identifier characters
+                identifierStart.add(0x80, 0xFF);
+                identifier.add(identifierStart);
+                identifier.add('0', '9');
+                number.add(identifier);
+                number.add('.');
+            }
+        };
+
+        static const Sets & sets() {
+            static const Sets sets;
+            return sets;
+        }
+
+        // longest first so the first match is the longest
+        static size_t punctuator(const char * p, const char * end) {
+            static const char * const punctuators[] = {
+                "%:%:", "...", "<<=", ">>=", "->*",
+                "->", "++", "--", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||",
+                "*=", "/=", "%=", "+=", "-=", "&=", "^=", "|=", "##", "::", ".*",
+                "<:", ":>", "<%", "%>", "%:"
+            };
+            for (const char * punctuator : punctuators) {
+                size_t length = strlen(punctuator);
+                if (static_cast<size_t>(end - p) >= length && memcmp(p, punctuator, length) == 0) {
+                    return length;
+                }
+            }
+            return *p != '\0' && strchr("[](){}.&*+-~!/%<>^|?:;=,#", *p) != nullptr ? 1 : 0;
+        }
+
+        // the end of a character or string literal starting at its opening quote
+        //
+        // an unterminated literal ends at the end of its line
+        static const char * literal(const char * p, const char * end) {
+            char quote = *p++;
+            while (p != end && *p != '\n') {
+                if (*p == '\\' && p + 1 != end) {
+                    p += 2;
+                    continue;
+                }
+                if (*p++ == quote) break;
+            }
+            return p;
+        }
+
+        // L, u, U and u8 prefix a literal when a quote follows them directly
+        static bool literalPrefix(const char * begin, const char * p, const char * end) {
+            if (p == end || (*p != '"' && *p != '\'')) return false;
+            std::string_view prefix(begin, p - begin);
+            return prefix == "L" || prefix == "u" || prefix == "U" || prefix == "u8";
+        }
+
+    public:
+        // appends the tokens of the lines of input from offset on to tokens,
+        // until at least count tokens are appended and a line ends, offset
+        // is the start of a line
+        //
+        // returns the offset lexing stopped at, at the end of input an
+        // EndOfFile token is appended, flagged StartOfLine if the input ends
+        // in a newline
+        static size_t lex(std::string_view input, size_t offset, size_t count, Atoms & atoms, std::vector<Token> & tokens) {
+            const Sets & sets = Lexer::sets();
+            const char * begin = input.data();
+            const char * end = begin + input.size();
+            const char * p = begin + offset;
+            size_t limit = tokens.size() + count;
+            uint8_t flags = Token::StartOfLine;
+            while (true) {
+                size_t spaces = Scan::span(sets.whitespace, p, end);
+                if (spaces != 0) {
+                    flags |= Token::LeadingSpace;
+                    p += spaces;
+                }
+                if (p == end) break;
+                if (*p == '\n') {
+                    flags = Token::StartOfLine;
+                    p++;
+                    if (tokens.size() >= limit) return p - begin;
+                    continue;
+                }
+                const char * start = p;
+                Token::Kind kind;
+                unsigned char c = static_cast<unsigned char>(*p);
+                if (sets.identifierStart.contains(c)) {
+                    p += Scan::span(sets.identifier, p, end);
+                    if (literalPrefix(start, p, end)) {
+                        kind = *p == '"' ? Token::StringLiteral : Token::CharacterLiteral;
+                        p = literal(p, end);
+                    } else {
+                        kind = Token::Identifier;
+                    }
+                } else if ((c >= '0' && c <= '9') || (c == '.' && p + 1 != end && p[1] >= '0' && p[1] <= '9')) {
+                    kind = Token::Number;
+                    p++;
+                    while (p != end) {
+                        if ((*p == '+' || *p == '-') && (p[-1] == 'e' || p[-1] == 'E' || p[-1] == 'p' || p[-1] == 'P')) {
+                            p++;
+                        } else if (sets.number.contains(*p)) {
+                            p++;
+                        } else {
+                            break;
+                        }
+                    }
+                } else if (c == '"' || c == '\'') {
+                    kind = c == '"' ? Token::StringLiteral : Token::CharacterLiteral;
+                    p = literal(p, end);
+                } else {
+                    size_t length = punctuator(p, end);
+                    kind = length != 0 ? Token::Punctuator : Token::Other;
+                    p += length != 0 ? length : 1;
+                }
+                Token token;
+                token.kind = kind;
+                token.flags = flags;
+                token.atom = atoms.intern(std::string_view(start, p - start));
+                token.offset = static_cast<uint32_t>(start - begin);
+                token.length = static_cast<uint32_t>(p - start);
+                tokens.push_back(token);
+                flags = 0;
+            }
+            Token token;
+            token.flags = flags & Token::StartOfLine;
+            token.offset = static_cast<uint32_t>(input.size());
+            tokens.push_back(token);
+            return input.size();
+        }
+
+        // appends the tokens of input to tokens followed by an EndOfFile token
+        static void lex(std::string_view input, Atoms & atoms, std::vector<Token> & tokens) {
+            lex(input, 0, ~size_t(0) - tokens.size(), atoms, tokens);
+        }
+
+        // spells tokens back into text one at a time
+        //
+        // a token flagged StartOfLine begins a new line and a token flagged
+        // LeadingSpace is preceded by one space, nothing is spelled before
+        // the first token
+        //
+        // given the files locating the tokens, a line that does not come from
+        // the line after the one before it is preceded by a #line directive,
+        // naming the file if it is not the file of the line before
+        class Speller {
+            const SourceFiles * files;
+            // the file and line the next output line comes from if no #line is spelled
+            uint16_t file = 0;
+            uint32_t line = 1;
+            bool started = false;
+
+        public:
+            explicit Speller(const SourceFiles * files = nullptr) : files(files) {}
+
+            // appends token to output, of an EndOfFile token only the newline
+            // ending the last line
+            void spell(const Token & token, const Atoms & atoms, std::string & output) {
+                bool marker = false;
+                bool named = false;
+                if (files != nullptr && token.kind != Token::EndOfFile && (!started || (token.flags & Token::StartOfLine))) {
+                    uint32_t source = files->locate(token.file, token.offset).line;
+                    named = token.file != file;
+                    marker = named || source != line;
+                    file = token.file;
+                    line = source + 1;
+                }
+                if (started) {
+                    if (token.flags & Token::StartOfLine) {
+                        output += '\n';
+                    } else if ((token.flags & Token::LeadingSpace) && token.kind != Token::EndOfFile) {
+                        output += ' ';
+                    }
+                }
+                if (marker) {
+                    output += "#line ";
+                    output += std::to_string(line - 1);
+                    if (named) {
+                        output += " \"";
+                        output += files->names[file];
+                        output += '"';
+                    }
+                    output += '\n';
+                }
+                if (token.kind == Token::EndOfFile) return;
+                output += atoms.spelling(token.atom);
+                started = true;
+            }
+        };
+
+        // spells tokens back into text, see Speller
+        static void spell(const std::vector<Token> & tokens, const Atoms & atoms, std::string & output, const SourceFiles * files = nullptr) {
+            Speller speller(files);
+            for (const Token & token : tokens) {
+                speller.spell(token, atoms, output);
+                if (token.kind == Token::EndOfFile) break;
+            }
+        }
+    };
+}
+
+#endif
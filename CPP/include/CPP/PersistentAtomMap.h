@@ -0,0 +1,167 @@
+#ifndef CPP_PERSISTENT_ATOM_MAP_H
+#define CPP_PERSISTENT_ATOM_MAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace CPP {
+
+    // a map keyed by atom whose copies share structure, a hash array mapped
+    // trie
+    //
+    // a node branches on 5 bits of the key of an atom and keeps only the
+    // children it has, found by counting the bits of its bitmap below theirs,
+    // the key is the atom multiplied by an odd constant, distinct atoms have
+    // distinct keys so a trie is at most 7 nodes deep
+    //
+    // copying a map, fork, copies its root pointer, a set copies the nodes on
+    // the path to the atom that are shared with another map and writes to
+    // those only this map holds, so a map pays for what it changes since it
+    // was forked, and maps forked from one another may be used on different
+    // threads
+    //
+    // pointers to values are invalidated by set
+    template <typename T>
+    class PersistentAtomMap {
+#ifdef GTEST_API_
+    public:
+#endif
+        static constexpr unsigned bits = 5;
+
+        struct Node;
+
+        // a value, or a node holding the atoms whose keys share the bits so far
+        struct Child {
+            uint32_t key = 0;
+            uint32_t atom = 0;
+            T value{};
+            std::shared_ptr<Node> node;
+        };
+
+        struct Node {
+            uint32_t bitmap = 0;
+            std::vector<Child> children;
+        };
+
+        std::shared_ptr<Node> root;
+        size_t count = 0;
+
+        static uint32_t key(uint32_t atom) {
+            return atom * 0x9E3779B1u;
+        }
+
+        static unsigned population(uint32_t bitmap) {
+#if defined(__GNUC__) || defined(__clang__)
+            return static_cast<unsigned>(__builtin_popcount(bitmap));
+#else
+            unsigned count = 0;
+            for (; bitmap != 0; bitmap &= bitmap - 1) count++;
+            return count;
+#endif
+        }
+
+        // the node pointer holds, copied first if another map shares it
+        static Node & own(std::shared_ptr<Node> & pointer) {
+            if (pointer.use_count() != 1) {
+                pointer = std::make_shared<Node>(*pointer);
+            } else {
+                // the other holders are gone, what they read happened before
+                std::atomic_thread_fence(std::memory_order_acquire);
+            }
+            return *pointer;
+        }
+
+        // sets atom to value in the trie below pointer, whose node branches
+        // on the bits of key from shift on, returns true if atom was not in it
+        static bool set(std::shared_ptr<Node> & pointer, uint32_t key, uint32_t atom, T && value, unsigned shift) {
+            Node & node = own(pointer);
+            uint32_t bit = uint32_t(1) << ((key >> shift) & 31);
+            size_t index = population(node.bitmap & (bit - 1));
+            if (!(node.bitmap & bit)) {
+                node.bitmap |= bit;
+                Child child;
+                child.key = key;
+                child.atom = atom;
+                child.value = std::move(value);
+                node.children.insert(node.children.begin() + index, std::move(child));
+                return true;
+            }
+            Child & child = node.children[index];
+            if (child.node != nullptr) return set(child.node, key, atom, std::move(value), shift + bits);
+            if (child.atom == atom) {
+                child.value = std::move(value);
+                return false;
+            }
+            // two atoms with these bits, both go down into a node of their own
+            Child moved = std::move(child);
+            child = Child();
+            child.node = std::make_shared<Node>();
+            set(child.node, moved.key, moved.atom, std::move(moved.value), shift + bits);
+            return set(child.node, key, atom, std::move(value), shift + bits);
+        }
+
+        template <typename Visit>
+        static void each(const Node & node, Visit & visit) {
+            for (const Child & child : node.children) {
+                if (child.node != nullptr) {
+                    each(*child.node, visit);
+                } else {
+                    visit(child.atom, child.value);
+                }
+            }
+        }
+
+    public:
+        const T * find(uint32_t atom) const {
+            uint32_t key = PersistentAtomMap::key(atom);
+            const Node * node = root.get();
+            for (unsigned shift = 0; node != nullptr; shift += bits) {
+                uint32_t bit = uint32_t(1) << ((key >> shift) & 31);
+                if (!(node->bitmap & bit)) return nullptr;
+                const Child & child = node->children[population(node->bitmap & (bit - 1))];
+                if (child.node == nullptr) return child.atom == atom ? &child.value : nullptr;
+                node = child.node.get();
+            }
+            return nullptr;
+        }
+
+        bool contains(uint32_t atom) const {
+            return find(atom) != nullptr;
+        }
+
+        void set(uint32_t atom, T value) {
+            if (root == nullptr) root = std::make_shared<Node>();
+            if (set(root, key(atom), atom, std::move(value), 0)) count++;
+        }
+
+        // a map with the values of this one, in constant time
+        PersistentAtomMap fork() const {
+            return *this;
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+        bool empty() const {
+            return count == 0;
+        }
+
+        void clear() {
+            root.reset();
+            count = 0;
+        }
+
+        // calls visit(atom, value) for every atom, in no particular order
+        template <typename Visit>
+        void each(Visit visit) const {
+            if (root != nullptr) each(*root, visit);
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef CPP_PHASES_H
+#define CPP_PHASES_H
+
+#include "Scan.h"
+#include "SourceMap.h"
+#include <string>
+#include <string_view>
+
+namespace CPP {
+
+    // translation phases 1 and 2, in one forward pass
+    //
+    // line continuations are spliced and comments replaced by a space while
+    // the input is copied into a fresh buffer, the input is never erased
+    // from or rescanned, runs of bytes that need neither are copied whole
+    //
+    // a line continuation may appear anywhere, inside a comment marker
+    // included, comment markers inside character and string literals are
+    // kept as text
+    //
+    // the pass only stops at the bytes that matter where it is, a \ / " or '
+    // in text, a \ newline or closing quote in a literal, a newline in a
+    // line comment and a / in a block comment, found 32 bytes at a time by
+    // Scan::mask
+    //
+    // given a SourceMap, the pass records an edit wherever the text stops
+    // being a copy of the input, so offsets in the text can be located in it
+    class Phases {
+#ifdef GTEST_API_
+    public:
+#endif
+        enum State {
+            Text,
+            String,
+            Character,
+            LineComment,
+            BlockComment
+        };
+
+        struct Sets {
+            // the bytes the pass stops at in each state
+            Scan::CharacterSet stops[5];
+
+            Sets() {
+                for (char c : {'\\', '/', '"', '\''}) stops[Text].add(c);
+                for (char c : {'\\', '"', '\n'}) stops[String].add(c);
+                for (char c : {'\\', '\'', '\n'}) stops[Character].add(c);
+                stops[LineComment].add('\n');
+                stops[BlockComment].add('/');
+            }
+        };
+
+        static const Sets & sets() {
+            static const Sets sets;
+            return sets;
+        }
+
+        // finds the bytes of a set in the input, a block of 32 bytes is
+        // classified once and the stops in it are taken in order
+        class Stops {
+            const char * end;
+            const Scan::CharacterSet * set = nullptr;
+            const char * block = nullptr;
+            uint32_t bits = 0;
+
+        public:
+            explicit Stops(const char * end) : end(end) {}
+
+            // the first byte of set at or after p, or end
+            const char * find(const Scan::CharacterSet & set, const char * p) {
+                while (true) {
+                    if (&set != this->set || p < block || p >= block + 32) {
+                        // fewer than 32 bytes are left
+                        if (end - p < 32) return Scan::find(set, p, end);
+                        this->set = &set;
+                        block = p;
+                        bits = Scan::mask(set, p);
+                    }
+                    uint32_t left = bits & (~uint32_t(0) << (p - block));
+                    if (left != 0) return block + Scan::lowest(left);
+                    p = block + 32;
+                }
+            }
+        };
+
+        // the first byte at or after p that does not begin a line continuation
+        static const char * splice(const char * p, const char * end) {
+            while (end - p >= 2 && p[0] == '\\' && p[1] == '\n') p += 2;
+            return p;
+        }
+
+        // the / at p closes a block comment whose text begins at body if a
+        // * comes before it, line continuations may come between them
+        static bool closes(const char * body, const char * p) {
+            while (p - body >= 2 && p[-1] == '\n' && p[-2] == '\\') p -= 2;
+            return p != body && p[-1] == '*';
+        }
+
+    public:
+        // sets output to input with its line continuations spliced and its
+        // comments replaced by a space, and map, if given, to the map from
+        // output to input
+        //
+        // returns false if a block comment does not end, output then stops
+        // before it
+        static bool clean(std::string_view input, std::string & output, SourceMap * map = nullptr) {
+            const Sets & sets = Phases::sets();
+            const char * begin = input.data();
+            const char * p = begin;
+            const char * end = p + input.size();
+            output.clear();
+            output.reserve(input.size());
+            if (map != nullptr) map->clear(input);
+            auto edit = [&](const char * original) {
+                if (map != nullptr) map->edit(static_cast<uint32_t>(output.size()), static_cast<uint32_t>(original - begin));
+            };
+            Stops stops(end);
+            State state = Text;
+            // the bytes from copied to p are copied once the pass stops
+            // somewhere they end, comments are not copied
+            const char * copied = p;
+            // the text of the comment in progress
+            const char * body = nullptr;
+            while (true) {
+                const char * stop = stops.find(sets.stops[state], p);
+                if (stop == end) break;
+                char c = *stop;
+                p = stop + 1;
+                if (c == '\\' && p != end && *p == '\n') {
+                    // a line continuation is dropped wherever it is
+                    p++;
+                    if (state != LineComment && state != BlockComment) {
+                        output.append(copied, stop - copied);
+                        edit(p);
+                    }
+                    copied = p;
+                    continue;
+                }
+                switch (state) {
+                    case Text:
+                        if (c == '"') {
+                            state = String;
+                        } else if (c == '\'') {
+                            state = Character;
+                        } else if (c == '/') {
+                            const char * second = splice(p, end);
+                            if (second != end && (*second == '/' || *second == '*')) {
+                                output.append(copied, stop - copied);
+                                edit(stop);
+                                output += ' ';
+                                state = *second == '/' ? LineComment : BlockComment;
+                                p = second + 1;
+                                body = p;
+                            }
+                        }
+                        break;
+                    case String:
+                    case Character:
+                        if (c == '\\') {
+                            // the escaped character, which may follow line continuations
+                            const char * escaped = splice(p, end);
+                            if (escaped != p) {
+                                output.append(copied, p - copied);
+                                edit(escaped);
+                                copied = escaped;
+                            }
+                            p = escaped;
+                            if (p != end && *p != '\n') p++;
+                        } else {
+                            // the closing quote, or the newline ending an
+                            // unterminated literal
+                            state = Text;
+                        }
+                        break;
+                    case LineComment:
+                        // a line continuation carries the comment on
+                        if (stop != body && stop[-1] == '\\') break;
+                        // the newline is kept
+                        state = Text;
+                        copied = stop;
+                        edit(copied);
+                        p = stop;
+                        break;
+                    case BlockComment:
+                        if (closes(body, stop)) {
+                            state = Text;
+                            copied = p;
+                            edit(copied);
+                        }
+                        break;
+                }
+            }
+            if (state == BlockComment) return false;
+            if (state != LineComment) output.append(copied, end - copied);
+            return true;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,1196 @@
+#ifndef CPP_PREPROCESSOR_H
+#define CPP_PREPROCESSOR_H
+
+#include "CPP_Preprocessor_Data.h"
+#include "Expression.h"
+#include "FileCache.h"
+#include "Grammar.h"
+#include "HideSets.h"
+#include "Lexer.h"
+#include "Phases.h"
+#include "Rules.h"
+#include "RulesCompiler.h"
+#include "Sink.h"
+#include "Skip.h"
+#include "Snapshot.h"
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace CPP {
+
+    // the preprocessor, its grammar is built and compiled once and reused for every input
+    //
+    // line continuations and comments are removed in one pass by Phases, the
+    // text left is lexed into tokens and directives and macro expansion run
+    // on the tokens, identifiers are never lexed again while expanding
+    //
+    // the rule grammars removing line continuations or comments on their own
+    // remain for callers running a single phase
+    //
+    // rule actions do not capture the state of a run, they reach it through the
+    // Context of the run in progress, so one Preprocessor processes any number
+    // of inputs without building or allocating rules again
+    //
+    // a Preprocessor runs one input at a time, use one per thread
+    class Preprocessor {
+    public:
+        // the state of one run, definitions made by a run stay in its context
+        // and are seen by later runs given the same context
+        struct Context {
+            Atoms atoms;
+            HideSets hideSets;
+            CPP_Preprocessor_Data data;
+            // locates the offsets of the text of the run in progress in its input
+            SourceMap locations;
+            // the name of the input, for #line and errors, files it includes
+            // by "name" are searched for from the current directory
+            std::string name = "<input>";
+            // the directories searched for a file included by "name", after
+            // the directory of the file including it, and then for a file
+            // included by <name>
+            std::vector<std::string> quotePaths;
+            std::vector<std::string> systemPaths;
+            // the input and the files included by the run in progress, kept
+            // alive by included while the run refers to them
+            SourceFiles files;
+            std::vector<std::shared_ptr<const FileCache::File>> included;
+            // the files an #include named in the run in progress resolved
+            // to, a name included again is not searched for again
+            std::unordered_map<std::string, std::shared_ptr<const FileCache::File>> resolved;
+            // the canonical paths of the files that ran #pragma once, they
+            // are not included again, like definitions this outlives the run
+            std::unordered_set<std::string> once;
+            // the compiled #if and #elif expressions keyed by their text, and
+            // the values of the object-like macros they use, compiled as
+            // they are first used, like definitions these outlive the run
+            std::unordered_map<std::string, Expression::Program> conditions;
+            std::unordered_map<const CPP_Preprocessor_Data::Macro *, std::pair<std::shared_ptr<const CPP_Preprocessor_Data::Macro>, Expression::Program>> values;
+            // output lines that do not come from the line after the one before
+            // them in the input are preceded by #line
+            bool lineMarkers = false;
+            // the run logs what it does to XOut, which is one stream for the
+            // whole process, runs on other threads turn this off
+            bool trace = true;
+            // the diagnostic of the error that ended the last run, empty if
+            // the run reached the end of its input
+            std::string error;
+        };
+
+#ifdef GTEST_API_
+    public:
+#else
+    private:
+#endif
+        constexpr static const char * TAG_NONE =                      "[       NONE       ]";
+        constexpr static const char * TAG_DEFINE =                    "[      DEFINE      ]";
+        constexpr static const char * TAG_FUNCTION_ARGUMENT_SCAN =    "[FUNCTION ARG CHECK]";
+        constexpr static const char * TAG_FUNCTION_EXPANSION =        "[FUNCTION EXPANSION]";
+        constexpr static const char * TAG_MACRO_EXPANSION =           "[  MACRO EXPANSION ]";
+
+        Rules::Grammar grammar;
+
+        // the programs only reference the grammar, they are declared after it
+        // so they are destroyed first
+        Rules::Program line_continuations;
+        Rules::Program comments;
+
+        // the run in progress
+        Context * context = nullptr;
+
+        // the number of tokens the input is lexed at least at a time
+        static constexpr size_t window = 4096;
+
+        // the files being read a run gives up past, an #include cycle ends here
+        static constexpr size_t includes = 200;
+
+        static const char * getTag(CPP_Preprocessor_Data & cpp_data, bool is_function_macro = false) {
+            switch (cpp_data.preprocessor_state) {
+                case CPP_Preprocessor_Data::no_preprocessor_state:
+                        switch(cpp_data.expansion_state) {
+                            case CPP_Preprocessor_Data::no_expansion_state:
+                                return TAG_NONE;
+                            case CPP_Preprocessor_Data::argument_count:
+                                return TAG_FUNCTION_ARGUMENT_SCAN;
+                            case CPP_Preprocessor_Data::expansion:
+                                return is_function_macro ? TAG_FUNCTION_EXPANSION : TAG_MACRO_EXPANSION;
+                        }
+                        return TAG_NONE;
+                case CPP_Preprocessor_Data::define:
+                    return TAG_DEFINE;
+                case CPP_Preprocessor_Data::undef:
+                    return TAG_NONE;
+            }
+            return TAG_NONE;
+        }
+
+        void build_line_continuations() {
+            line_continuations = Rules::compile(
+                grammar.make<Rules::OneOrMore>(
+                    grammar.make<Rules::Or>({
+                        grammar.make<Rules::String>("\\\n", [](Rules::Input in) {
+                            in.eraseAndRescan();
+                        }),
+                        grammar.make<Rules::Any>()
+                    })
+                )
+            );
+            line_continuations.memoize();
+        }
+
+        void build_comments() {
+            comments = Rules::compile(
+                grammar.make<Rules::OneOrMore>(
+                    grammar.make<Rules::Or>({
+                        grammar.make<Rules::Sequence>({
+                            grammar.make<Rules::String>("//"),
+                            grammar.make<Rules::Until>(grammar.make<Rules::NewlineOrEOF>())
+                        }, [](Rules::Input in) {
+                            in.eraseAndRescan();
+                        }),
+                        grammar.make<Rules::Sequence>({
+                            grammar.make<Rules::String>("/*"),
+                            grammar.make<Rules::ErrorIfNotMatch>(
+                                grammar.make<Rules::Until>(grammar.make<Rules::String>("*/")),
+                                "Unterminated block comment, expected '*/' to match '/*'"
+                            )
+                        }, [](Rules::Input in) {
+                            in.eraseAndRescan();
+                        }),
+                        grammar.make<Rules::Any>()
+                    })
+                )
+            );
+            comments.memoize();
+        }
+
+        // the line and column of token in the input, to begin an error with,
+        // after the name of the file it was included from if it was
+        std::string where(const Token & token) {
+            SourceMap::Location location = context->files.locate(token.file, token.offset);
+            std::string text = token.file != 0 ? context->files.names[token.file] + ':' : std::string();
+            return text + std::to_string(location.line) + ':' + std::to_string(location.column) + ": ";
+        }
+
+        std::string quote(uint32_t atom) {
+            return Rules::Input::quote(std::string(context->atoms.spelling(atom)));
+        }
+
+        // an error in the input, thrown up to run, which ends the run with it
+        struct Error {
+            std::string message;
+        };
+
+        // ends the run with the error parts spell, at token
+        template <typename... Parts>
+        [[noreturn]] void fail(const Token & token, const Parts &... parts) {
+            std::ostringstream message;
+            message << where(token);
+            (message << ... << parts);
+            throw Error{message.str()};
+        }
+
+        // the first token after the line of token, before end
+        static const Token * end_of_line(const Token * token, const Token * end) {
+            while (token != end && token->kind != Token::EndOfFile && !(token->flags & Token::StartOfLine)) {
+                token++;
+            }
+            return token;
+        }
+
+        std::string spell(const std::vector<Token> & tokens) {
+            std::string text;
+            Lexer::spell(tokens, context->atoms, text);
+            return text;
+        }
+
+        // resolves the parameters in the replacement list of macro and marks
+        // its # and ## operators
+        void compile(CPP_Preprocessor_Data::Macro & macro) {
+            using Element = CPP_Preprocessor_Data::Macro::Element;
+            const uint8_t position = Token::LeadingSpace | Token::StartOfLine;
+            bool function = macro.type == CPP_Preprocessor_Data::Macro::Function;
+            auto parameter = [&](const Token & token) {
+                uint32_t index = 0;
+                if (!function || token.kind != Token::Identifier) return static_cast<uint32_t>(macro.args.size());
+                while (index < macro.args.size() && macro.args[index] != token.atom) index++;
+                return index;
+            };
+            const std::vector<Token> & tokens = macro.tokens;
+            bool paste = false;
+            for (uint32_t index = 0; index < tokens.size(); index++) {
+                if (tokens[index].atom == Atoms::HashHash) {
+                    if (index == 0 || index + 1 == tokens.size()) {
+                        fail(tokens[index], "'##' cannot appear at either end of a macro expansion");
+                    }
+                    // the operands of ## are not expanded
+                    Element & left = macro.replacement.back();
+                    if (left.kind == Element::Argument) left.kind = Element::UnexpandedArgument;
+                    paste = true;
+                    continue;
+                }
+                Element element;
+                element.paste = paste;
+                element.flags = tokens[index].flags & position;
+                paste = false;
+                if (function && tokens[index].atom == Atoms::Hash) {
+                    element.kind = Element::Stringized;
+                    element.index = index + 1 == tokens.size() ? macro.args.size() : parameter(tokens[index + 1]);
+                    if (element.index == macro.args.size()) {
+                        fail(tokens[index], "'#' is not followed by a macro parameter");
+                    }
+                    index++;
+                } else if ((element.index = parameter(tokens[index])) != macro.args.size()) {
+                    element.kind = element.paste ? Element::UnexpandedArgument : Element::Argument;
+                } else {
+                    element.kind = Element::Text;
+                    element.index = index;
+                }
+                macro.replacement.push_back(element);
+            }
+            macro.uses.assign(macro.args.size(), 0);
+            for (const Element & element : macro.replacement) {
+                if (element.kind == Element::Argument) {
+                    macro.uses[element.index] |= CPP_Preprocessor_Data::Macro::Expanded;
+                } else if (element.kind != Element::Text) {
+                    macro.uses[element.index] |= CPP_Preprocessor_Data::Macro::Unexpanded;
+                }
+            }
+        }
+
+        // the file name included by the tokens [begin, end), "name" or
+        // <name>, empty if they are neither
+        std::string include_name(const Token * begin, const Token * end, bool & quoted) {
+            if (begin == end) return std::string();
+            std::string_view first = context->atoms.spelling(begin->atom);
+            if (end - begin == 1 && begin->kind == Token::StringLiteral && first.size() >= 2 && first.front() == '"') {
+                quoted = true;
+                return std::string(first.substr(1, first.size() - 2));
+            }
+            if (begin->atom != context->atoms.intern("<")) return std::string();
+            // the spellings of the tokens up to the >, spaced as written
+            std::string name;
+            for (const Token * token = begin + 1; token != end; token++) {
+                std::string_view spelling = context->atoms.spelling(token->atom);
+                if (spelling == ">") {
+                    if (token + 1 != end) return std::string();
+                    quoted = false;
+                    return name;
+                }
+                if (token != begin + 1 && (token->flags & Token::LeadingSpace)) name += ' ';
+                name += spelling;
+            }
+            return std::string();
+        }
+
+        // the file name included by "name" from the file of token is searched
+        // for in the directory of that file, the quote paths and the system
+        // paths, by <name> in the system paths only
+        //
+        // a name is searched for once a run, from the same directory
+        std::shared_ptr<const FileCache::File> find_include(const std::string & name, bool quoted, const Token & token) {
+            FileCache & cache = FileCache::shared();
+            std::string directory;
+            if (quoted) {
+                const std::string & includer = context->files.names[token.file];
+                size_t slash = includer.rfind('/');
+                if (slash != std::string::npos) directory = includer.substr(0, slash);
+            }
+            std::string key = (quoted ? '"' + directory + '/' : std::string("<")) + name;
+            std::shared_ptr<const FileCache::File> & file = context->resolved[key];
+            if (file != nullptr) return file;
+            auto search = [&](const std::string & directory) {
+                return file = cache.open(directory.empty() ? name : directory + '/' + name);
+            };
+            if (name.front() == '/') return search(std::string());
+            if (quoted) {
+                if (search(directory) != nullptr) return file;
+                for (const std::string & directory : context->quotePaths) {
+                    if (search(directory) != nullptr) return file;
+                }
+            }
+            for (const std::string & directory : context->systemPaths) {
+                if (search(directory) != nullptr) return file;
+            }
+            return nullptr;
+        }
+
+        // runs #include, the tokens [begin, end) follow the word include
+        //
+        // the file is pushed as a source and read before the line after the
+        // directive, its text comes from the FileCache
+        //
+        // a file that ran #pragma once, or whose include guard is defined, is
+        // skipped, an include guard whose macro is not defined is not read,
+        // only the text between its lines is
+        void include(const Token & directive, const Token * begin, const Token * end) {
+            auto & data = context->data;
+            bool quoted = false;
+            std::string name = include_name(begin, end, quoted);
+            std::vector<Token> expanded;
+            if (name.empty() && begin != end) {
+                // a line that is neither form is macro expanded first
+                CPP_Preprocessor_Data::Source & source = push_source(data.reading);
+                source.next = begin;
+                source.end = end;
+                expand(expanded, data.reading - 1, false);
+                name = include_name(expanded.data(), expanded.data() + expanded.size(), quoted);
+            }
+            if (name.empty()) {
+                fail(directive, "expected \"FILENAME\" or <FILENAME> after #include");
+            }
+            if (data.including >= includes) {
+                fail(directive, "#include nested more than ", includes, " deep");
+            }
+            std::shared_ptr<const FileCache::File> file = find_include(name, quoted, directive);
+            if (file == nullptr) {
+                fail(directive, "cannot find include file ", Rules::Input::quote(name));
+            }
+            if (file->unterminated) {
+                fail(directive, "unterminated block comment in ", Rules::Input::quote(file->path));
+            }
+            if (context->once.count(file->path) != 0 || (!file->guard.empty() && data.definitions.find(context->atoms.intern(file->guard)) != nullptr)) {
+                if (context->trace) XOut << getTag(data) << ' ' << "skipping included file: " << Rules::Input::quote(file->path) << std::endl;
+                return;
+            }
+            if (context->trace) XOut << getTag(data) << ' ' << "including: " << Rules::Input::quote(file->path) << std::endl;
+            SourceFiles & files = context->files;
+            if (files.maps.size() > UINT16_MAX) {
+                fail(directive, "too many files included");
+            }
+            CPP_Preprocessor_Data::Source & source = push_source(0);
+            source.file = true;
+            source.index = static_cast<uint16_t>(files.maps.size());
+            source.text = file->text;
+            source.lexed = 0;
+            source.lexing = true;
+            source.conditionals = data.conditionals.size();
+            if (!file->guard.empty()) {
+                source.text = source.text.substr(0, file->end);
+                source.lexed = file->body;
+            }
+            files.maps.push_back(&file->locations);
+            files.names.push_back(file->path);
+            context->included.push_back(std::move(file));
+            data.including++;
+            refill(source);
+        }
+
+        // the program of the value of an object-like macro, compiled once,
+        // not compiled if its replacement list is not a unary expression
+        const Expression::Program & value(const std::shared_ptr<const CPP_Preprocessor_Data::Macro> & macro) {
+            auto & entry = context->values[macro.get()];
+            if (entry.first != macro) {
+                entry.first = macro;
+                Expression(context->atoms, macro->tokens.data(), macro->tokens.data() + macro->tokens.size()).compile(entry.second, true);
+            }
+            return entry.second;
+        }
+
+        // the leaves of a compiled expression, from the definitions of the run
+        //
+        // an object-like macro is the value of its replacement list, where it
+        // stands for 0 itself, a function-like macro is not followed by ( in
+        // a compiled expression so it is not invoked and is 0
+        struct Leaves {
+            Preprocessor & preprocessor;
+            // the macros whose values are being found
+            std::vector<uint32_t> hidden;
+
+            bool defined(uint32_t atom) {
+                return preprocessor.context->data.definitions.find(atom) != nullptr;
+            }
+
+            bool identifier(uint32_t atom, Expression::Value & value) {
+                Context & context = *preprocessor.context;
+                const std::shared_ptr<const CPP_Preprocessor_Data::Macro> * definition = nullptr;
+                if (std::find(hidden.begin(), hidden.end(), atom) == hidden.end()) {
+                    definition = context.data.definitions.find(atom);
+                }
+                if (definition == nullptr) {
+                    value.bits = context.atoms.spelling(atom) == "true";
+                    return true;
+                }
+                if ((*definition)->type == CPP_Preprocessor_Data::Macro::Function) return true;
+                const Expression::Program & program = preprocessor.value(*definition);
+                if (!program.compiled) return false;
+                hidden.push_back(atom);
+                bool found = program.run(*this, value);
+                hidden.pop_back();
+                return found;
+            }
+        };
+
+        // whether the condition of the #if, #ifdef, #ifndef or #elif in
+        // [begin, last) holds
+        //
+        // the expression is compiled as written once and kept under its
+        // text, a later evaluation only looks up the macros it uses
+        //
+        // an expression that cannot be compiled as written, or whose macros
+        // do not stand for values, is macro expanded and evaluated, defined X
+        // and defined ( X ) are replaced by 1 or 0 before the macros of the
+        // line are expanded
+        bool condition(const Token * begin, const Token * last) {
+            auto & data = context->data;
+            const Token & directive = begin[0];
+            if (directive.atom == Atoms::Ifdef || directive.atom == Atoms::Ifndef) {
+                if (last - begin < 2 || begin[1].kind != Token::Identifier) {
+                    fail(directive, "expected a macro name after #", context->atoms.spelling(directive.atom));
+                }
+                bool defined = data.definitions.find(begin[1].atom) != nullptr;
+                return defined == (directive.atom == Atoms::Ifdef);
+            }
+            if (last - begin >= 2) {
+                std::string_view text = data.sources[data.reading - 1].text;
+                const Token & first = begin[1];
+                std::string key(text.substr(first.offset, last[-1].offset + last[-1].length - first.offset));
+                auto found = context->conditions.find(key);
+                if (found == context->conditions.end()) {
+                    found = context->conditions.emplace(std::move(key), Expression::Program()).first;
+                    Expression(context->atoms, begin + 1, last).compile(found->second);
+                }
+                const Expression::Program & program = found->second;
+                Leaves leaves{*this, {}};
+                Expression::Value value;
+                if (program.compiled && program.run(leaves, value)) {
+                    if (value.poisoned) {
+                        fail(directive, "division by zero in #", context->atoms.spelling(directive.atom));
+                    }
+                    return value.truth();
+                }
+            }
+            std::vector<Token> line;
+            for (const Token * token = begin + 1; token != last; token++) {
+                if (token->atom != Atoms::Defined) {
+                    line.push_back(*token);
+                    continue;
+                }
+                const Token * name = token + 1;
+                bool parenthesis = name != last && name->atom == Atoms::LeftParen;
+                if (parenthesis) name++;
+                if (name == last || name->kind != Token::Identifier) {
+                    fail(*token, "operator \"defined\" requires an identifier");
+                }
+                if (parenthesis && (name + 1 == last || name[1].atom != Atoms::RightParen)) {
+                    fail(*name, "missing ')' after \"defined\"");
+                }
+                Token value = *token;
+                value.kind = Token::Number;
+                value.atom = context->atoms.intern(data.definitions.find(name->atom) != nullptr ? "1" : "0");
+                value.length = 1;
+                line.push_back(value);
+                token = parenthesis ? name + 1 : name;
+            }
+            std::vector<Token> expanded;
+            CPP_Preprocessor_Data::Source & source = push_source(data.reading);
+            source.next = line.data();
+            source.end = line.data() + line.size();
+            expand(expanded, data.reading - 1, false);
+            Expression expression(context->atoms, expanded.data(), expanded.data() + expanded.size());
+            bool result = false;
+            if (!expression.evaluate(result)) {
+                fail(expression.at != nullptr ? *expression.at : directive, expression.error);
+            }
+            return result;
+        }
+
+        // skips the group after the directive whose line ends at last, up to
+        // the line of the #elif, #else or #endif ending it
+        //
+        // the group is found by Skip in the text of the file, its lines are
+        // not lexed unless they were lexed with the directive
+        void skip_group(const Token & directive, const Token * last) {
+            auto & data = context->data;
+            CPP_Preprocessor_Data::Source & source = data.sources[data.reading - 1];
+            const char * text = source.text.data();
+            const Token & end = last[-1];
+            size_t from = Skip::line(text + end.offset + end.length, text + source.text.size()) - text;
+            size_t stop = Skip::group(source.text, from);
+            if (stop == source.text.size()) {
+                fail(directive, "unterminated #", context->atoms.spelling(directive.atom));
+            }
+            if (context->trace) XOut << getTag(data) << ' ' << "skipped group of " << (stop - from) << " bytes" << std::endl;
+            if (stop < source.lexed) {
+                source.next = std::lower_bound(source.next, source.end, stop, [](const Token & token, size_t offset) {
+                    return token.offset < offset;
+                });
+            } else {
+                source.next = source.end;
+                source.lexed = stop;
+                source.lexing = true;
+            }
+        }
+
+        // runs #if, #ifdef, #ifndef, #elif, #else or #endif in [begin, last)
+        //
+        // a group that is not taken is skipped, a group after the one taken
+        // is skipped without its #elif being evaluated
+        void conditional(const Token * begin, const Token * last) {
+            auto & data = context->data;
+            const Token & directive = begin[0];
+            CPP_Preprocessor_Data::Source & source = data.sources[data.reading - 1];
+            if (directive.atom == Atoms::If || directive.atom == Atoms::Ifdef || directive.atom == Atoms::Ifndef) {
+                CPP_Preprocessor_Data::Conditional conditional;
+                conditional.directive = directive;
+                conditional.taken = condition(begin, last);
+                data.conditionals.push_back(conditional);
+                if (!conditional.taken) skip_group(directive, last);
+                return;
+            }
+            if (data.conditionals.size() == source.conditionals) {
+                fail(directive, '#', context->atoms.spelling(directive.atom), " without #if");
+            }
+            CPP_Preprocessor_Data::Conditional & conditional = data.conditionals.back();
+            if (directive.atom == Atoms::Endif) {
+                data.conditionals.pop_back();
+                return;
+            }
+            if (conditional.sawElse) {
+                fail(directive, '#', context->atoms.spelling(directive.atom), " after #else");
+            }
+            conditional.directive = directive;
+            conditional.sawElse = directive.atom == Atoms::Else;
+            if (conditional.taken) {
+                skip_group(directive, last);
+                return;
+            }
+            conditional.taken = directive.atom == Atoms::Else || condition(begin, last);
+            if (!conditional.taken) skip_group(directive, last);
+        }
+
+        // runs the directive in [begin, last), the tokens after its #
+        //
+        // returns false if the line is not a directive, it is then kept as text
+        bool directive(const Token * begin, const Token * last) {
+            auto & data = context->data;
+            const Token * tokens = begin;
+            size_t end = last - begin;
+            if (end != 0 && tokens[0].atom == Atoms::Include) {
+                include(tokens[0], tokens + 1, last);
+                return true;
+            }
+            if (end != 0 && tokens[0].atom >= Atoms::If && tokens[0].atom <= Atoms::Endif) {
+                conditional(begin, last);
+                return true;
+            }
+            if (end == 2 && tokens[0].atom == Atoms::Pragma && tokens[1].atom == Atoms::Once) {
+                context->once.insert(context->files.names[tokens[0].file]);
+                return true;
+            }
+            if (end != 0 && tokens[0].atom == Atoms::Undef) {
+                if (end != 2 || tokens[1].kind != Token::Identifier) {
+                    fail(tokens[0], "expected a macro name after #undef");
+                }
+                data.definitions.undefine(tokens[1].atom);
+                return true;
+            }
+            if (end == 0 || tokens[0].atom != Atoms::Define) return false;
+            data.preprocessor_state = CPP_Preprocessor_Data::define;
+            size_t index = 1;
+            if (index == end || tokens[index].kind != Token::Identifier) {
+                fail(tokens[0], "expected a macro name after #define");
+            }
+            auto definition = std::make_shared<CPP_Preprocessor_Data::Macro>();
+            auto & macro = *definition;
+            macro.id = tokens[index].atom;
+            if (context->trace) XOut << getTag(data) << ' ' << "definition id: " << quote(macro.id) << std::endl;
+            if (tokens[index].atom == Atoms::Defined) {
+                fail(tokens[index], "defined is a reserved preprocessor keyword");
+            }
+            index++;
+            // a function-like macro has its parenthesis right after its name
+            if (index != end && tokens[index].atom == Atoms::LeftParen && !(tokens[index].flags & Token::LeadingSpace)) {
+                macro.type = CPP_Preprocessor_Data::Macro::Function;
+                index++;
+                if (index != end && tokens[index].atom == Atoms::RightParen) {
+                    index++;
+                } else {
+                    while (true) {
+                        if (index == end || tokens[index].kind != Token::Identifier) {
+                            fail(tokens[index - 1], "expected a parameter name in the parameters of ", quote(macro.id));
+                        }
+                        macro.args.push_back(tokens[index].atom);
+                        if (context->trace) XOut << getTag(data) << ' ' << "definition function-macro argument: " << quote(macro.args.back()) << std::endl;
+                        index++;
+                        if (index != end && tokens[index].atom == Atoms::Comma) {
+                            index++;
+                            continue;
+                        }
+                        if (index != end && tokens[index].atom == Atoms::RightParen) {
+                            index++;
+                            break;
+                        }
+                        fail(tokens[index - 1], "expected ',' or ')' in the parameters of ", quote(macro.id));
+                    }
+                }
+            }
+            macro.tokens.assign(tokens + index, tokens + end);
+            if (!macro.tokens.empty()) {
+                macro.tokens.front().flags &= ~Token::LeadingSpace;
+            }
+            compile(macro);
+            macro.content = spell(macro.tokens);
+            if (context->trace) XOut << getTag(data) << ' ' << "definition content: " << Rules::Input::quote(macro.content) << std::endl;
+            data.definitions.define(macro.id, std::move(definition));
+            data.preprocessor_state = CPP_Preprocessor_Data::no_preprocessor_state;
+            return true;
+        }
+
+        // lexes the next lines of the text of a file source into it, once
+        // it is read, returns false at the end of the text
+        bool refill(CPP_Preprocessor_Data::Source & source) {
+            if (!source.lexing) return false;
+            source.tokens.clear();
+            source.lexed = Lexer::lex(source.text, source.lexed, window, context->atoms, source.tokens);
+            source.lexing = source.tokens.back().kind != Token::EndOfFile;
+            for (Token & token : source.tokens) {
+                token.file = source.index;
+            }
+            source.next = source.tokens.data();
+            source.end = source.tokens.data() + source.tokens.size();
+            return true;
+        }
+
+        // the next token of the innermost source above floor that has any
+        // left, without reading it, nullptr if none has
+        const Token * peek(size_t floor) {
+            auto & data = context->data;
+            for (size_t source = data.reading; source > floor; source--) {
+                CPP_Preprocessor_Data::Source & read = data.sources[source - 1];
+                if (read.next == read.end && !(read.file && refill(read))) continue;
+                return data.sources[source - 1].next;
+            }
+            return nullptr;
+        }
+
+        // reads the next token of the innermost source above floor that has
+        // any left, popping the sources it passes, nullptr if none has
+        //
+        // the token stays valid until another source is pushed
+        const Token * next(size_t floor) {
+            auto & data = context->data;
+            while (data.reading > floor) {
+                CPP_Preprocessor_Data::Source & source = data.sources[data.reading - 1];
+                if (source.next != source.end) return source.next++;
+                if (source.file && refill(source)) continue;
+                if (source.file) data.including--;
+                data.reading--;
+            }
+            return nullptr;
+        }
+
+        // pushes a source above floor, exhausted sources are popped first so
+        // an expansion ending in a macro does not deepen the stack, a file is
+        // not popped until it ends
+        CPP_Preprocessor_Data::Source & push_source(size_t floor) {
+            auto & data = context->data;
+            while (data.reading > floor && !data.sources[data.reading - 1].file && data.sources[data.reading - 1].next == data.sources[data.reading - 1].end) {
+                data.reading--;
+            }
+            if (data.reading == data.sources.size()) data.sources.emplace_back();
+            CPP_Preprocessor_Data::Source & source = data.sources[data.reading++];
+            source.next = nullptr;
+            source.end = nullptr;
+            source.file = false;
+            return source;
+        }
+
+        // reads the arguments of the invocation of the macro of frame, whose
+        // ( is the next token, from the sources above floor in one pass into
+        // the frame and checks their count
+        //
+        // argument i is the tokens between frame.bounds[i] and
+        // frame.bounds[i + 1] in frame.tokens, returns the )
+        const Token & find_arguments(CPP_Preprocessor_Data::Frame & frame, size_t floor) {
+            auto & data = context->data;
+            const CPP_Preprocessor_Data::Macro & macro = *frame.macro;
+            if (context->trace) XOut << getTag(data, true) << ' ' << "scanning arguments for function-like macro : " << quote(macro.id) << std::endl;
+            std::vector<Token> & tokens = frame.tokens;
+            std::vector<size_t> & bounds = frame.bounds;
+            tokens.clear();
+            bounds.clear();
+            tokens.push_back(*next(floor));
+            bounds.push_back(0);
+            size_t depth = 0;
+            while (true) {
+                const Token * read = next(floor);
+                if (read == nullptr || read->kind == Token::EndOfFile) {
+                    fail(tokens.front(), "Unterminated function parenthesis, expected ')' to match '('");
+                }
+                tokens.push_back(*read);
+                Token & token = tokens.back();
+                if (token.atom == Atoms::LeftParen) {
+                    depth++;
+                } else if (token.atom == Atoms::RightParen) {
+                    if (depth == 0) break;
+                    depth--;
+                } else if (token.atom == Atoms::Comma && depth == 0) {
+                    bounds.push_back(tokens.size() - 1);
+                }
+                // arguments spanning lines are spelled on one
+                if (token.flags & Token::StartOfLine) {
+                    token.flags = (token.flags & ~Token::StartOfLine) | Token::LeadingSpace;
+                }
+            }
+            bounds.push_back(tokens.size() - 1);
+            frame.count = bounds.size() - 1;
+            // () passes one empty argument, unless the macro takes none
+            if (tokens.size() == 2 && macro.args.empty()) {
+                frame.count = 0;
+                bounds.pop_back();
+            }
+            size_t argc = macro.args.size();
+            if (context->trace) XOut << getTag(data, true) << ' ' << "argument count: " << frame.count << '\n';
+            if (context->trace) XOut << getTag(data, true) << ' ' << "required argument count: " << argc << '\n';
+            if (frame.count > argc) {
+                fail(tokens.front(), "macro ", quote(macro.id), " passed ", frame.count, " arguments, but takes just ", argc);
+            } else if (frame.count < argc) {
+                fail(tokens.front(), "macro ", quote(macro.id), " requires ", argc, " arguments, but only ", frame.count, " given");
+            }
+            return tokens.back();
+        }
+
+        // macro expands, each on its own, the arguments in frame whose
+        // expansion its macro uses
+        //
+        // an argument is read where it lies in the frame, from a source of
+        // its own that the expansion does not read past
+        void expand_arguments(CPP_Preprocessor_Data::Frame & frame, size_t floor) {
+            auto & data = context->data;
+            const CPP_Preprocessor_Data::Macro & macro = *frame.macro;
+            if (context->trace) XOut << getTag(data, true) << ' ' << "expanding arguments for function-like macro : " << quote(macro.id) << std::endl;
+            frame.arguments.resize(macro.uses.size());
+            for (size_t argument = 0; argument < macro.uses.size(); argument++) {
+                if (!(macro.uses[argument] & CPP_Preprocessor_Data::Macro::Expanded)) continue;
+                CPP_Preprocessor_Data::Source & source = push_source(floor);
+                source.next = frame.tokens.data() + frame.bounds[argument] + 1;
+                source.end = frame.tokens.data() + frame.bounds[argument + 1];
+                frame.arguments[argument].clear();
+                expand(frame.arguments[argument], data.reading - 1, false);
+                if (context->trace) XOut << getTag(data, true) << ' ' << "function argument replacement: " << Rules::Input::quote(spell(frame.arguments[argument])) << " for function-like macro : " << quote(macro.id) << std::endl;
+            }
+        }
+
+        CPP_Preprocessor_Data::Frame & push_frame(const CPP_Preprocessor_Data::Macro & macro) {
+            auto & data = context->data;
+            if (data.depth == data.frames.size()) data.frames.emplace_back();
+            CPP_Preprocessor_Data::Frame & frame = data.frames[data.depth++];
+            frame.macro = &macro;
+            frame.bounds.clear();
+            frame.count = 0;
+            return frame;
+        }
+
+        void pop_frame() {
+            context->data.depth--;
+        }
+
+        // the string literal spelling the tokens [begin, end), for #
+        Token stringize(const Token * begin, const Token * end) {
+            std::string text = "\"";
+            for (const Token * argument = begin; argument != end; argument++) {
+                const Token & token = *argument;
+                if (argument != begin && (token.flags & (Token::LeadingSpace | Token::StartOfLine))) text += ' ';
+                std::string_view spelling = context->atoms.spelling(token.atom);
+                if (token.kind != Token::StringLiteral && token.kind != Token::CharacterLiteral) {
+                    text += spelling;
+                    continue;
+                }
+                for (char character : spelling) {
+                    if (character == '"' || character == '\\') text += '\\';
+                    text += character;
+                }
+            }
+            text += '"';
+            Token token;
+            token.kind = Token::StringLiteral;
+            token.atom = context->atoms.intern(text);
+            token.length = static_cast<uint32_t>(text.size());
+            return token;
+        }
+
+        // pastes tokens[index] onto tokens[index - 1], for ##
+        void paste(std::vector<Token> & tokens, size_t index) {
+            Token & left = tokens[index - 1];
+            std::string text(context->atoms.spelling(left.atom));
+            text += context->atoms.spelling(tokens[index].atom);
+            std::vector<Token> pasted;
+            Lexer::lex(text, context->atoms, pasted);
+            // a single token and the EndOfFile token
+            if (pasted.size() != 2 || pasted[0].length != text.size()) {
+                fail(left, "pasting ", quote(left.atom), " and ", quote(tokens[index].atom), " does not give a valid preprocessing token");
+            }
+            left.kind = pasted[0].kind;
+            left.atom = pasted[0].atom;
+            tokens.erase(tokens.begin() + index);
+        }
+
+        // sets replacement to the replacement list of the macro of frame with
+        // its arguments substituted, every token hidden from the macros in
+        // hideSet and located where the invocation at is
+        //
+        // arguments are used as written from the tokens of the frame, and
+        // expanded from its expanded arguments
+        void substitute(const CPP_Preprocessor_Data::Frame & frame, uint32_t hideSet, const Token & at, std::vector<Token> & replacement) {
+            using Element = CPP_Preprocessor_Data::Macro::Element;
+            const CPP_Preprocessor_Data::Macro & macro = *frame.macro;
+            const std::vector<Token> & tokens = frame.tokens;
+            const std::vector<size_t> & bounds = frame.bounds;
+            auto & hideSets = context->hideSets;
+            const uint8_t position = Token::LeadingSpace | Token::StartOfLine;
+            replacement.clear();
+            // the first token of the last element that gave any, an operand of
+            // ## that gives none leaves the other operand alone
+            size_t previous = std::string::npos;
+            for (const Element & element : macro.replacement) {
+                size_t first = replacement.size();
+                switch (element.kind) {
+                    case Element::Text:
+                        replacement.push_back(macro.tokens[element.index]);
+                        break;
+                    case Element::Argument:
+                        replacement.insert(replacement.end(), frame.arguments[element.index].begin(), frame.arguments[element.index].end());
+                        break;
+                    case Element::UnexpandedArgument:
+                        replacement.insert(replacement.end(), tokens.begin() + bounds[element.index] + 1, tokens.begin() + bounds[element.index + 1]);
+                        break;
+                    case Element::Stringized:
+                        replacement.push_back(stringize(tokens.data() + bounds[element.index] + 1, tokens.data() + bounds[element.index + 1]));
+                        break;
+                }
+                if (first == replacement.size()) {
+                    if (!element.paste) previous = first;
+                    continue;
+                }
+                for (size_t index = first; index < replacement.size(); index++) {
+                    replacement[index].offset = at.offset;
+                    replacement[index].file = at.file;
+                }
+                // the element takes the place it has in the definition
+                replacement[first].flags = (replacement[first].flags & ~position) | element.flags;
+                if (element.paste && previous < first) {
+                    paste(replacement, first);
+                    first--;
+                }
+                previous = first;
+            }
+            for (Token & token : replacement) {
+                token.hideSet = hideSets.unite(token.hideSet, hideSet);
+            }
+        }
+
+        // expands the macro named by the identifier token unless the
+        // identifier is hidden from it, the arguments of a function-like
+        // macro are read from the sources above floor
+        //
+        // returns true if the macro was invoked, its expansion is then pushed
+        // as a source and read before the tokens after the invocation, an
+        // empty expansion leaves the position of the invocation in pending
+        // for the token after it
+        bool invoke(const Token & token, size_t floor, uint8_t & pending) {
+            auto & data = context->data;
+            auto & hideSets = context->hideSets;
+            const uint8_t position = Token::LeadingSpace | Token::StartOfLine;
+            uint32_t name = token.atom;
+            if (hideSets.contains(token.hideSet, name)) {
+                if (context->trace) XOut << getTag(data) << ' ' << "not expanding macro: " << quote(name) << std::endl;
+                return false;
+            }
+            const std::shared_ptr<const CPP_Preprocessor_Data::Macro> * definition = data.definitions.find(name);
+            if (definition == nullptr) return false;
+            const CPP_Preprocessor_Data::Macro & macro = **definition;
+            bool function = macro.type == CPP_Preprocessor_Data::Macro::Function;
+            uint32_t hideSet;
+            if (!function) {
+                if (context->trace) XOut << getTag(data, false) << ' ' << "expanding object-like macro: " << quote(name) << std::endl;
+                hideSet = hideSets.add(token.hideSet, name);
+            } else {
+                const Token * open = peek(floor);
+                if (open == nullptr || open->atom != Atoms::LeftParen) {
+                    if (context->trace) XOut << getTag(data, true) << ' ' << "function-like macro not invoked: " << quote(name) << std::endl;
+                    return false;
+                }
+            }
+            CPP_Preprocessor_Data::Frame & frame = push_frame(macro);
+            if (function) {
+                data.expansion_state = CPP_Preprocessor_Data::argument_count;
+                const Token & close = find_arguments(frame, floor);
+                // hidden from the macros that hide both the name and the ) ending its arguments
+                hideSet = hideSets.add(hideSets.intersect(token.hideSet, close.hideSet), name);
+                data.expansion_state = CPP_Preprocessor_Data::expansion;
+                expand_arguments(frame, floor);
+                if (context->trace) XOut << getTag(data, true) << ' ' << "expanding function body with function parameters" << std::endl;
+            }
+            CPP_Preprocessor_Data::Source & source = push_source(floor);
+            substitute(frame, hideSet, token, source.tokens);
+            pop_frame();
+            data.expansion_state = CPP_Preprocessor_Data::no_expansion_state;
+            if (function) {
+                if (context->trace) XOut << getTag(data, true) << ' ' << "appending expanded function body: " << Rules::Input::quote(spell(source.tokens)) << std::endl;
+            }
+            // the expansion takes the place of its invocation on its line
+            if (source.tokens.empty()) {
+                pending |= token.flags & position;
+            } else {
+                source.tokens.front().flags = (source.tokens.front().flags & ~position) | (token.flags & position);
+            }
+            source.next = source.tokens.data();
+            source.end = source.tokens.data() + source.tokens.size();
+            return true;
+        }
+
+        // expands the tokens read from the sources above floor into output,
+        // or into sink if given
+        //
+        // an expansion is pushed as a source over the tokens after its
+        // invocation and read before them, so a function-like macro name at
+        // the end of an expansion takes its arguments from the tokens that
+        // follow, the hide sets of its tokens keep a macro from expanding
+        // within its own expansion, no source is ever written to
+        //
+        // with directives, a # starting a line of a file begins a directive,
+        // the directive is run and its line skipped, the file ends with the
+        // EndOfFile token of the input, those of included files are dropped
+        void expand(std::vector<Token> & output, size_t floor, bool directives, Sink * sink = nullptr) {
+            auto & data = context->data;
+            uint8_t pending = 0;
+            while (const Token * read = next(floor)) {
+                Token token = *read;
+                CPP_Preprocessor_Data::Source & input = data.sources[data.reading - 1];
+                if (directives && input.file && (token.flags & Token::StartOfLine) && token.atom == Atoms::Hash) {
+                    const Token * begin = input.next;
+                    const Token * end = end_of_line(begin, input.end);
+                    // the line is skipped before the directive runs, an
+                    // included file is read after it
+                    input.next = end;
+                    if (directive(begin, end)) {
+                        if (context->trace) XOut << getTag(data) << ' ' << "skipping preprocessor statement: " << Rules::Input::quote(spell(std::vector<Token>(begin - 1, end))) << std::endl;
+                        continue;
+                    }
+                    input.next = begin;
+                }
+                if (token.kind == Token::EndOfFile && input.file && data.conditionals.size() > input.conditionals) {
+                    const Token & directive = data.conditionals.back().directive;
+                    fail(directive, "unterminated #", context->atoms.spelling(directive.atom));
+                }
+                if (token.kind == Token::EndOfFile && token.file != 0) continue;
+                if (token.kind == Token::Identifier && invoke(token, floor, pending)) continue;
+                token.flags |= pending;
+                pending = 0;
+                if (sink != nullptr) {
+                    sink->write(token, context->atoms);
+                } else {
+                    output.push_back(token);
+                }
+            }
+        }
+
+        // phase 3, the preprocessed text is written to sink
+        //
+        // the text is lexed as it is read, text must outlive the run
+        //
+        // returns false if an error in the input ended the run, its
+        // diagnostic is left in the error of context and sink is not ended,
+        // the definitions made before it are kept
+        bool run(std::string_view text, Context & context, Sink & sink) {
+            Context * previous = this->context;
+            this->context = &context;
+            context.error.clear();
+            context.hideSets.clear();
+            context.data.depth = 0;
+            context.data.reading = 0;
+            context.data.including = 1;
+            context.data.conditionals.clear();
+            context.files.maps.assign(1, &context.locations);
+            context.files.names.assign(1, context.name);
+            context.included.clear();
+            context.resolved.clear();
+            // the text is the first source, expansions and included files are
+            // pushed over it
+            CPP_Preprocessor_Data::Source & source = push_source(0);
+            source.file = true;
+            source.index = 0;
+            source.text = text;
+            source.lexed = 0;
+            source.lexing = true;
+            source.conditionals = 0;
+            try {
+                refill(source);
+                sink.begin(context.lineMarkers ? &context.files : nullptr);
+                std::vector<Token> output;
+                expand(output, 0, true, &sink);
+                sink.end();
+            } catch (Error & error) {
+                context.error = std::move(error.message);
+            }
+            source.text = std::string_view();
+            this->context = previous;
+            return context.error.empty();
+        }
+
+        // phases 1 and 2 of input into text, false with the error of context
+        // set if a comment does not end
+        static bool clean(std::string_view input, std::string & text, Context & context) {
+            if (Phases::clean(input, text, &context.locations)) return true;
+            context.error = "unterminated block comment, expected '*/' to match '/*'";
+            return false;
+        }
+
+        // reads fd to its end into input, false with the error of context
+        // set if it cannot be read
+        static bool read(int fd, std::string & input, Context & context) {
+            char buffer[64 * 1024];
+            while (true) {
+                ssize_t count = ::read(fd, buffer, sizeof(buffer));
+                if (count == 0) return true;
+                if (count < 0) {
+                    if (errno == EINTR) continue;
+                    context.error = std::string("cannot read the input: ") + strerror(errno);
+                    return false;
+                }
+                input.append(buffer, static_cast<size_t>(count));
+            }
+        }
+
+    public:
+        Preprocessor() {
+            build_line_continuations();
+            build_comments();
+        }
+
+        // actions refer to this instance
+        Preprocessor(const Preprocessor &) = delete;
+        Preprocessor & operator=(const Preprocessor &) = delete;
+
+        // phase 2 on its own, the result is logged if context traces
+        void remove_line_continuations(std::string &input, const Context & context) {
+            line_continuations.match(input);
+            if (context.trace) XOut << "removed line continuations: " << Rules::Input::quote(input) << std::endl;
+        }
+
+        // comments removed on their own, the result is logged if context traces
+        void remove_comments(std::string &input, const Context & context) {
+            comments.match(input);
+            if (context.trace) XOut << "removed comments: " << Rules::Input::quote(input) << std::endl;
+        }
+
+        // runs phase 3 on input, replacing it with its preprocessed text,
+        // false if an error in it ended the run, see run
+        bool preprocess(std::string &input, Context & context) {
+            context.locations.clear(input);
+            std::string output;
+            StringSink sink(output);
+            bool ran = run(input, context, sink);
+            input.swap(output);
+            if (context.trace) XOut << "preprocessed: " << Rules::Input::quote(input) << std::endl;
+            return ran;
+        }
+
+        // preprocesses input into sink
+        //
+        // the input is copied once, into the text phases 1 and 2 leave, the
+        // output is written to sink as it is produced
+        //
+        // returns false if an error in the input ended the run, see run
+        bool parse(std::string_view input, Context & context, Sink & sink) {
+            // 1. and 2. remove line continuations and comments
+            std::string text;
+            if (!clean(input, text, context)) return false;
+            if (context.trace) XOut << "removed line continuations and comments: " << Rules::Input::quote(text) << std::endl;
+            // 3. preprocess
+            return run(text, context, sink);
+        }
+
+        // writes the definitions context holds to a Snapshot at path,
+        // returns false if it cannot be written
+        static bool save(Context & context, const std::string & path) {
+            return Snapshot::save(path, context.atoms, context.data.definitions, context.once);
+        }
+
+        // bases context on snapshot, the definitions of its runs so far are
+        // forgotten, definitions made since are kept in the context and the
+        // snapshot, which may be shared by any number of contexts, is never
+        // written to
+        //
+        // returns false, leaving context as it was, if the snapshot was
+        // written with other predefined atoms
+        static bool use(Context & context, const std::shared_ptr<const Snapshot> & snapshot) {
+            if (!context.atoms.share(snapshot->atoms())) return false;
+            context.data.definitions.share(snapshot->definitions());
+            context.once = snapshot->once();
+            // compiled with the atoms forgotten
+            context.conditions.clear();
+            context.values.clear();
+            return true;
+        }
+
+        // makes into a fork of from, with its atoms, definitions, search
+        // paths, the files that ran #pragma once and its settings, the state
+        // of into is forgotten
+        //
+        // the atoms and definitions are forked in constant time, see
+        // Atoms::fork and Definitions, from and into go on separately after
+        // and either may be run on another thread, as may other forks of from
+        static void fork(Context & from, Context & into) {
+            from.atoms.fork(into.atoms);
+            into.data.definitions = from.data.definitions.fork();
+            into.once = from.once;
+            into.quotePaths = from.quotePaths;
+            into.systemPaths = from.systemPaths;
+            into.lineMarkers = from.lineMarkers;
+            into.trace = from.trace;
+            into.conditions.clear();
+            into.values.clear();
+        }
+
+        // preprocesses what is read from fd into sink, false if fd cannot
+        // be read or an error in the input ended the run, see run
+        //
+        // a regular file is mapped and cleaned where it lies, from the offset
+        // of fd to its end, which fd is left at, only the cleaned text is
+        // held, anything else, a pipe or a terminal, is read to its end
+        // first, so it is held twice while it is cleaned
+        bool parse(int fd, Context & context, Sink & sink) {
+            std::string text;
+            struct stat status;
+            off_t offset = lseek(fd, 0, SEEK_CUR);
+            if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && offset >= 0 && status.st_size > offset) {
+                size_t size = static_cast<size_t>(status.st_size);
+                void * mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    std::string_view input(static_cast<const char*>(mapped) + offset, size - static_cast<size_t>(offset));
+                    bool cleaned = clean(input, text, context);
+                    munmap(mapped, size);
+                    lseek(fd, 0, SEEK_END);
+                    if (!cleaned) return false;
+                    return run(text, context, sink);
+                }
+            }
+            std::string input;
+            if (!read(fd, input, context)) return false;
+            if (!clean(input, text, context)) return false;
+            // the input is no longer needed once cleaned
+            input = std::string();
+            return run(text, context, sink);
+        }
+
+        // preprocesses input, replacing it with its preprocessed text, false
+        // if an error in it ended the run, see run
+        bool parse(std::string &input, Context & context) {
+            std::string output;
+            StringSink sink(output);
+            bool ran = parse(std::string_view(input), context, sink);
+            input.swap(output);
+            if (context.trace) XOut << "preprocessed: " << Rules::Input::quote(input) << std::endl;
+            return ran;
+        }
+    };
+}
+
+#endif
@@ -1,11 +1,13 @@
 #ifndef CPP_RULES_H
 #define CPP_RULES_H
 
+#include <climits>
 #include <functional>
 #include <stack>
 #include <string>
 #include <vector>
 #include "IteratorMatcher.h"
+#include "Scan.h"
 #include <XLog/XLog.h>
 
 #define CPP_Rules_LogCapture1(rule, custom_name) new CPP::Rules::LogCapture(rule, custom_name)
@@ -159,6 +161,7 @@ namespace CPP {
                     throw new std::runtime_error("cannot modify input more than once in the same rule");
                 }
                 executed = true;
+                iterator.generation++;
                 auto savePoint1 = iterator.save();
                 auto savePoint2 = iterator.save(match.begin);
                 iterator.input.erase(match.begin, match.end);
@@ -173,6 +176,7 @@ namespace CPP {
                     throw new std::runtime_error("cannot modify input more than once in the same rule");
                 }
                 executed = true;
+                iterator.generation++;
                 auto savePoint1 = iterator.save();
                 auto savePoint2 = iterator.save(match.begin);
                 auto savePoint3 = iterator.save(match.end);
@@ -191,6 +195,7 @@ namespace CPP {
                     throw new std::runtime_error("cannot modify input more than once in the same rule");
                 }
                 executed = true;
+                iterator.generation++;
                 auto savePoint1 = iterator.save();
                 auto savePoint2 = iterator.save(match.begin);
                 iterator.input.replace(match.begin, match.end, string);
@@ -220,6 +225,7 @@ namespace CPP {
                     throw new std::runtime_error("cannot modify input more than once in the same rule");
                 }
                 executed = true;
+                iterator.generation++;
                 auto savePoint1 = iterator.save();
                 auto savePoint2 = iterator.save(match.begin);
                 auto savePoint3 = iterator.save(match.end);
@@ -236,6 +242,7 @@ namespace CPP {
                     throw new std::runtime_error("cannot modify input more than once in the same rule");
                 }
                 executed = true;
+                iterator.generation++;
                 auto savePoint1 = iterator.save();
                 auto savePoint2 = iterator.save(match.begin);
                 auto savePoint3 = iterator.save(match.end);
@@ -265,12 +272,21 @@ namespace CPP {
 
         extern Action NO_ACTION;
 
+        // true if the action is a copy of NO_ACTION and calling it would do nothing
+        inline bool isNoAction(const Action & action) {
+            return action && action.target_type() == NO_ACTION.target_type();
+        }
+
+        struct Program;
+
         // an empty rule, this matches nothing
         struct Rule {
             Action action;
 
             Rule(Action action = NO_ACTION) : action(action) {}
 
+            virtual ~Rule() = default;
+
             IteratorMatcher::MatchData match(std::string & string, bool doAction = true) {
                 Iterator<std::string> iterator(string);
                 return match(iterator, doAction);
@@ -308,6 +324,7 @@ namespace CPP {
 #ifdef GTEST_API_
             public:
 #endif
+            friend struct Program;
             int n;
 
         public:
@@ -453,65 +470,24 @@ namespace CPP {
             }
         };
 
+        // refers to a rule without owning it, rules made with new belong to
+        // whoever made them and rules made by a Grammar to the grammar
         struct RuleHolder : Rule {
-            struct Reference {
-                Rule * rule = nullptr;
-                int reference = 0;
-            };
-            static std::vector<Reference*> rules;
-            Reference * ref = nullptr;
             Rule * rule = nullptr;
 
-            RuleHolder(Rule *rule, Action action = NO_ACTION) : Rule(action) {
-                if (rule == nullptr) return;
-                bool exists = false;
-                for (Reference * reference : rules) {
-                    if (reference->rule == rule) {
-                        ref = reference;
-                        exists = true;
-                        break;
-                    }
-                }
-                if (!exists) {
-                    ref = new Reference();
-                    rules.push_back(ref);
-                }
-                ref->rule = rule;
-                this->rule = ref->rule;
-                ref->reference++;
-            }
+            RuleHolder(Rule *rule, Action action = NO_ACTION) : Rule(action), rule(rule) {}
 
-            RuleHolder(const RuleHolder & other) {
-                ref = other.ref;
-                rule = other.rule;
-                if (ref != nullptr) {
-                    ref->reference++;
-                }
-            };
+            RuleHolder(const RuleHolder & other) : rule(other.rule) {};
 
             RuleHolder & operator=(const RuleHolder & other) {
-                ref = other.ref;
                 rule = other.rule;
-                if (ref != nullptr) {
-                    ref->reference++;
-                }
                 return *this;
             };
 
-            RuleHolder(RuleHolder && other) noexcept {
-                ref = other.ref;
-                rule = other.rule;
-                if (ref != nullptr) {
-                    ref->reference++;
-                }
-            }
+            RuleHolder(RuleHolder && other) noexcept : rule(other.rule) {}
 
             RuleHolder & operator=(RuleHolder && other)  noexcept {
-                ref = other.ref;
                 rule = other.rule;
-                if (ref != nullptr) {
-                    ref->reference++;
-                }
                 return *this;
             }
 
@@ -519,7 +495,7 @@ namespace CPP {
 
             virtual IteratorMatcher::MatchData match(Iterator<std::string> &iterator, bool doAction = true) override {
                 IteratorMatcher::MatchData match;
-                if (ref == nullptr) {
+                if (rule == nullptr) {
                     match.begin = iterator.current();
                     match.end = iterator.current();
                     match.matched = true;
@@ -534,27 +510,6 @@ namespace CPP {
                 }
                 return match;
             }
-
-            virtual ~RuleHolder() {
-                if (ref != nullptr) {
-                    if (ref->reference > 0) {
-                        ref->reference--;
-                        if (ref->reference == 0) {
-                            std::vector<Reference*>::iterator r = rules.begin();
-                            std::vector<Reference*>::const_iterator e = rules.cend();
-                            while (r != e) {
-                                if ((*r)->rule == ref->rule) {
-                                    break;
-                                }
-                                r++;
-                            }
-                            delete ref->rule;
-                            delete ref;
-                            rules.erase(r);
-                        }
-                    }
-                }
-            }
         };
 
         struct TemporaryAction : RuleHolder {
@@ -656,6 +611,7 @@ namespace CPP {
 #ifdef GTEST_API_
             public:
 #endif
+            friend struct Program;
             std::string message;
         public:
             ErrorIfMatch(Rule *rule, const std::string & message, Action action = NO_ACTION) : message(message), RuleHolder(rule, action) {}
@@ -677,6 +633,7 @@ namespace CPP {
 #ifdef GTEST_API_
             public:
 #endif
+            friend struct Program;
             std::string message;
         public:
             ErrorIfNotMatch(Rule *rule, const std::string & message, Action action = NO_ACTION) : message(message), RuleHolder(rule, action) {}
@@ -743,6 +700,16 @@ namespace CPP {
 
             ZeroOrMore(Rule * rule, Action action = NO_ACTION) : RuleHolder(new Optional(new OneOrMore(rule)), action) {}
 
+            // the Optional and OneOrMore made by the constructor belong to this rule
+            ZeroOrMore(const ZeroOrMore &) = delete;
+            ZeroOrMore & operator=(const ZeroOrMore &) = delete;
+
+            ~ZeroOrMore() {
+                auto optional = static_cast<Optional*>(rule);
+                delete optional->rule;
+                delete optional;
+            }
+
             using Rule::match;
 
             virtual IteratorMatcher::MatchData match(Iterator<std::string> &iterator, bool doAction = true) override {
@@ -944,10 +911,44 @@ namespace CPP {
         struct Range : Rule {
             std::vector<char> letters;
 
+            // letters are read as pairs of low and high bounds, a pair with equal
+            // bounds or a trailing letter without a high bound matches everything
+            // from its low bound upwards
+            Scan::CharacterSet characters;
+
             Range(std::initializer_list<char> letters, Action action = NO_ACTION) : Rule(action) {
                     for (char letter : letters) {
                         this->letters.push_back(letter);
                     }
+                    size_t i = 0;
+                    while (i < this->letters.size()) {
+                        int low = this->letters[i++];
+                        int high = CHAR_MAX;
+                        if (i < this->letters.size()) {
+                            char letter = this->letters[i++];
+                            if (letter != low) high = letter;
+                        }
+                        for (int letter = low; letter <= high; letter++) {
+                            characters.add(static_cast<unsigned char>(letter));
+                        }
+                    }
+            }
+
+            bool contains(char ch) const {
+                return characters.contains(ch);
+            }
+
+            // matches as many characters as possible, pushing the iterator before
+            // each one like repeated calls to match() without actions would,
+            // returns the number of characters matched
+            int matchRun(Iterator<std::string> &iterator) const {
+                const char * begin = iterator.input.data() + iterator.currentPosition();
+                size_t length = Scan::span(characters, begin, iterator.input.data() + iterator.input.size());
+                for (size_t i = 0; i < length; i++) {
+                    iterator.pushIterator();
+                    iterator.advance();
+                }
+                return length;
             }
 
             using Rule::match;
@@ -961,20 +962,7 @@ namespace CPP {
                 match.begin = iterator.current();
                 iterator.pushIterator();
                 char ch = iterator.next();
-                Iterator l(letters);
-                while (l.has_next()) {
-                    char low = l.next();
-                    if (ch >= low) {
-                        if (l.has_next()) {
-                            char high = l.next();
-                            if (low != high && ch > high) {
-                                continue;
-                            }
-                        }
-                    } else {
-                        l.advance();
-                        continue;
-                    }
+                if (contains(ch)) {
                     match.end = iterator.current();
                     match.matched = true;
                     match.matches++;
@@ -0,0 +1,1011 @@
+#ifndef CPP_RULES_COMPILER_H
+#define CPP_RULES_COMPILER_H
+
+#include "Rules.h"
+#include <cstdint>
+#include <map>
+#include <typeinfo>
+#include <unordered_map>
+
+namespace CPP {
+    namespace Rules {
+
+        // a rule graph lowered into a flat instruction array
+        //
+        // every rule reachable from the root gets one slot in `code`, composite
+        // rules refer to their children by slot, so a recursive rule such as
+        // balanced_parens becomes a cycle of slot indices instead of an endless tree
+        //
+        // match() runs the array in a loop with an explicit frame stack instead of
+        // recursing through virtual match() calls, each opcode pushes and pops the
+        // iterator exactly like the rule it was lowered from, so actions that
+        // rescan, erase or replace see the same iterator state as they would
+        // when matching the graph directly
+        //
+        // the program only references the graph, the graph must outlive it and it
+        // must be compiled again after rules are added, swapped or given actions
+        //
+        // Until and MatchBUntilA jump straight to the characters on which their
+        // inner rules can do anything, see buildSkips()
+        //
+        // every Or gets a dispatch table from the FIRST sets of its alternatives,
+        // see FirstSet, so only the alternatives that can match the next
+        // character are tried, once an alternative that failed modified the
+        // input the ones after it are picked again on the character then next
+        //
+        // memoize() turns on packrat memoization of Or and Sequence, see MemoEntry
+        struct Program : Rule {
+            enum class Opcode : uint8_t {
+                // a rule with no lowering, matched through its virtual match()
+                Call,
+                Empty,
+                Success,
+                AdvanceInputBy,
+                Fail,
+                Any,
+                Char,
+                EndOfFile,
+                NewlineOrEOF,
+                String,
+                Range,
+                // a OneOrMore of a Range without an action, see fuse()
+                RangeRun,
+                Holder,
+                TemporaryAction,
+                ErrorIfMatch,
+                ErrorIfNotMatch,
+                Optional,
+                OneOrMore,
+                ZeroOrMore,
+                MatchBUntilA,
+                Or,
+                Sequence,
+                Until,
+                At,
+                NotAt
+            };
+
+            static constexpr uint32_t noSkip = ~uint32_t(0);
+
+            struct Instruction {
+                Opcode opcode = Opcode::Empty;
+                bool hasAction = false;
+                char character = 0;
+                int n = 0;
+                // children of this instruction are children[first, first + count)
+                uint32_t first = 0;
+                uint32_t count = 0;
+                // Or only, its table is dispatch[table * dispatchKeys, (table + 1) * dispatchKeys)
+                uint32_t table = 0;
+                // Until and MatchBUntilA only, index into skips
+                uint32_t skip = noSkip;
+                Rule * rule = nullptr;
+            };
+
+#ifdef GTEST_API_
+        public:
+#else
+        private:
+#endif
+            // the next inputs on which entering a rule can do anything other than
+            // fail without side effects, the end of input is its own key
+            //
+            // a rule whose FIRST set cannot be computed has every key set, so
+            // it stays in every dispatch list in its original order
+            struct FirstSet {
+                Scan::CharacterSet characters;
+                bool endOfFile = false;
+
+                static FirstSet all() {
+                    FirstSet set;
+                    set.characters.add(0, 255);
+                    set.endOfFile = true;
+                    return set;
+                }
+
+                bool contains(uint32_t key) const {
+                    return key == endOfFileKey ? endOfFile : characters.contains(static_cast<unsigned char>(key));
+                }
+
+                // returns true if this set grew
+                bool merge(const FirstSet & other) {
+                    Scan::CharacterSet characters = this->characters;
+                    characters.add(other.characters);
+                    bool endOfFile = this->endOfFile || other.endOfFile;
+                    if (characters == this->characters && endOfFile == this->endOfFile) return false;
+                    this->characters = characters;
+                    this->endOfFile = endOfFile;
+                    return true;
+                }
+            };
+
+            static constexpr uint32_t endOfFileKey = 256;
+            static constexpr uint32_t dispatchKeys = 257;
+
+            // the alternatives of an Or to try for one key, as indices of its
+            // children in increasing order
+            struct Candidates {
+                uint32_t first = 0;
+                uint32_t count = 0;
+            };
+
+            struct Frame {
+                uint32_t slot;
+                uint32_t step;
+                bool doAction;
+                IteratorMatcher::MatchData match;
+                // Or only, the alternatives picked by the dispatch table
+                Candidates candidates;
+                // set when the result of this frame is stored in the memo table
+                bool memoize = false;
+                size_t stackBase = 0;
+                uint64_t generation = 0;
+                // Or only, the iterator generation its candidates were picked in
+                uint64_t picked = 0;
+            };
+
+            // the result of an Or or Sequence at an input offset
+            //
+            // only slots that cannot run an action or a Call are memoized, either
+            // because nothing below them has one or because they were entered
+            // with doAction false, so replaying the pushes of a result is
+            // indistinguishable from matching it again
+            //
+            // the table is direct mapped, a new result evicts whatever result
+            // hashed to the same entry, and results pushing more than
+            // memoPushLimit iterators are not stored, so memory is bounded by
+            // the table size
+            //
+            // entries are tagged with the match they were made in and with the
+            // iterator generation, any Input modification invalidates them all
+            struct MemoEntry {
+                uint64_t epoch = 0;
+                uint64_t generation = 0;
+                uint32_t slot = 0;
+                uint64_t offset = 0;
+                bool matched = false;
+                uint64_t end = 0;
+                uint64_t current = 0;
+                std::vector<uint64_t> pushes;
+            };
+
+            static constexpr size_t memoPushLimit = 64;
+
+            std::vector<Instruction> code;
+            std::vector<uint32_t> children;
+            std::unordered_map<Rule*, uint32_t> slots;
+
+            std::vector<FirstSet> first;
+            std::vector<Candidates> dispatch;
+            std::vector<uint32_t> candidates;
+            std::vector<Scan::CharacterSet> skips;
+
+            std::vector<MemoEntry> memo;
+            // per slot, whether entering it can call a Call instruction or run an action
+            std::vector<bool> calls;
+            std::vector<bool> actions;
+            uint64_t memoEpoch = 0;
+            size_t memoHits = 0;
+
+            uint32_t lower(Rule * rule) {
+                auto found = slots.find(rule);
+                if (found != slots.end()) return found->second;
+
+                if (typeid(*rule) == typeid(RuleHolder) && isNoAction(rule->action)) {
+                    // Or and Sequence keep their alternatives in plain holders,
+                    // a holder without an action matches exactly like its rule
+                    auto holder = static_cast<RuleHolder*>(rule);
+                    if (holder->rule != nullptr) {
+                        uint32_t slot = lower(holder->rule);
+                        slots[rule] = slot;
+                        return slot;
+                    }
+                }
+
+                uint32_t slot = code.size();
+                slots[rule] = slot;
+                code.emplace_back();
+
+                Instruction instruction;
+                instruction.rule = rule;
+                instruction.hasAction = !isNoAction(rule->action);
+
+                std::vector<Rule*> next;
+                const std::type_info & type = typeid(*rule);
+
+                if (type == typeid(Rule)) {
+                    instruction.opcode = Opcode::Empty;
+                } else if (type == typeid(Rules::Success)) {
+                    instruction.opcode = Opcode::Success;
+                } else if (type == typeid(Rules::AdvanceInputBy)) {
+                    instruction.opcode = Opcode::AdvanceInputBy;
+                    instruction.n = static_cast<Rules::AdvanceInputBy*>(rule)->n;
+                } else if (type == typeid(Rules::Fail)) {
+                    instruction.opcode = Opcode::Fail;
+                } else if (type == typeid(Rules::Any)) {
+                    instruction.opcode = Opcode::Any;
+                } else if (type == typeid(Rules::Char)) {
+                    instruction.opcode = Opcode::Char;
+                    instruction.character = static_cast<Rules::Char*>(rule)->character;
+                } else if (type == typeid(Rules::EndOfFile)) {
+                    instruction.opcode = Opcode::EndOfFile;
+                } else if (type == typeid(Rules::NewlineOrEOF)) {
+                    instruction.opcode = Opcode::NewlineOrEOF;
+                } else if (type == typeid(Rules::String)) {
+                    instruction.opcode = Opcode::String;
+                } else if (type == typeid(Rules::Range)) {
+                    instruction.opcode = Opcode::Range;
+                } else if (type == typeid(RuleHolder)) {
+                    instruction.opcode = Opcode::Holder;
+                    auto holder = static_cast<RuleHolder*>(rule);
+                    if (holder->rule != nullptr) next.push_back(holder->rule);
+                } else if (type == typeid(Rules::TemporaryAction)) {
+                    instruction.opcode = Opcode::TemporaryAction;
+                    next.push_back(static_cast<RuleHolder*>(rule)->rule);
+                } else if (type == typeid(Rules::ErrorIfMatch)) {
+                    instruction.opcode = Opcode::ErrorIfMatch;
+                    next.push_back(static_cast<RuleHolder*>(rule)->rule);
+                } else if (type == typeid(Rules::ErrorIfNotMatch)) {
+                    instruction.opcode = Opcode::ErrorIfNotMatch;
+                    next.push_back(static_cast<RuleHolder*>(rule)->rule);
+                } else if (type == typeid(Rules::Optional)) {
+                    instruction.opcode = Opcode::Optional;
+                    next.push_back(static_cast<RuleHolder*>(rule)->rule);
+                } else if (type == typeid(Rules::OneOrMore)) {
+                    instruction.opcode = Opcode::OneOrMore;
+                    next.push_back(static_cast<RuleHolder*>(rule)->rule);
+                } else if (type == typeid(Rules::ZeroOrMore)) {
+                    instruction.opcode = Opcode::ZeroOrMore;
+                    next.push_back(static_cast<RuleHolder*>(rule)->rule);
+                } else if (type == typeid(Rules::Until)) {
+                    instruction.opcode = Opcode::Until;
+                    next.push_back(static_cast<RuleHolder*>(rule)->rule);
+                } else if (type == typeid(Rules::At)) {
+                    instruction.opcode = Opcode::At;
+                    next.push_back(static_cast<RuleHolder*>(rule)->rule);
+                } else if (type == typeid(Rules::NotAt)) {
+                    instruction.opcode = Opcode::NotAt;
+                    next.push_back(static_cast<RuleHolder*>(rule)->rule);
+                } else if (type == typeid(Rules::MatchBUntilA)) {
+                    instruction.opcode = Opcode::MatchBUntilA;
+                    auto m = static_cast<Rules::MatchBUntilA*>(rule);
+                    next.push_back(&m->A);
+                    next.push_back(&m->B);
+                } else if (type == typeid(Rules::Or)) {
+                    instruction.opcode = Opcode::Or;
+                    for (RuleHolder & holder : static_cast<Rules::Or*>(rule)->rules) next.push_back(&holder);
+                } else if (type == typeid(Rules::Sequence)) {
+                    instruction.opcode = Opcode::Sequence;
+                    for (RuleHolder & holder : static_cast<Rules::Sequence*>(rule)->rules) next.push_back(&holder);
+                } else {
+                    instruction.opcode = Opcode::Call;
+                }
+
+                // children must be lowered before they are appended, lowering a
+                // child appends the children of that child
+                std::vector<uint32_t> lowered;
+                for (Rule * child : next) {
+                    if (child != nullptr) lowered.push_back(lower(child));
+                }
+                instruction.first = children.size();
+                instruction.count = lowered.size();
+                children.insert(children.end(), lowered.begin(), lowered.end());
+
+                code[slot] = instruction;
+                return slot;
+            }
+
+            uint32_t child(const Instruction & instruction, uint32_t index) const {
+                return children[instruction.first + index];
+            }
+
+            static void succeedEmpty(Iterator<std::string> &iterator, IteratorMatcher::MatchData & match) {
+                match.matched = true;
+                iterator.pushIterator();
+                match.matches++;
+            }
+
+            static void act(const Instruction & instruction, Iterator<std::string> &iterator, IteratorMatcher::MatchData & match, bool doAction) {
+                if (doAction && instruction.hasAction) {
+                    instruction.rule->action(Input(iterator, match, match.matches));
+                }
+            }
+
+            FirstSet firstOf(const Instruction & instruction) const {
+                FirstSet set;
+                switch (instruction.opcode) {
+                    case Opcode::Empty:
+                        break;
+                    case Opcode::Fail:
+                        // fails, but runs its action
+                        if (instruction.hasAction) set = FirstSet::all();
+                        break;
+                    case Opcode::Any:
+                        set.characters.add(0, 255);
+                        break;
+                    case Opcode::Char:
+                        set.characters.add(static_cast<unsigned char>(instruction.character));
+                        break;
+                    case Opcode::EndOfFile:
+                        set.endOfFile = true;
+                        break;
+                    case Opcode::NewlineOrEOF:
+                        set.characters.add('\n');
+                        set.endOfFile = true;
+                        break;
+                    case Opcode::String: {
+                        const std::string & string = static_cast<Rules::String*>(instruction.rule)->string;
+                        // an empty string matches the end of input
+                        if (string.empty()) set.endOfFile = true;
+                        else set.characters.add(static_cast<unsigned char>(string[0]));
+                        break;
+                    }
+                    case Opcode::Range: {
+                        set.characters = static_cast<Rules::Range*>(instruction.rule)->characters;
+                        break;
+                    }
+                    case Opcode::Holder:
+                    case Opcode::TemporaryAction:
+                    case Opcode::ErrorIfMatch:
+                    case Opcode::OneOrMore:
+                    case Opcode::RangeRun:
+                    case Opcode::At:
+                        // these succeed or abort only if their child matches
+                        if (instruction.count == 0) {
+                            set = FirstSet::all();
+                        } else {
+                            set = first[child(instruction, 0)];
+                        }
+                        break;
+                    case Opcode::Sequence:
+                        // a sequence that fails on its first rule fails without
+                        // side effects, every later rule sees the input after it
+                        if (instruction.count == 0) {
+                            set = FirstSet::all();
+                        } else {
+                            set = first[child(instruction, 0)];
+                        }
+                        break;
+                    case Opcode::Or:
+                    case Opcode::MatchBUntilA:
+                        if (instruction.count == 0) set = FirstSet::all();
+                        for (uint32_t i = 0; i < instruction.count; i++) {
+                            set.merge(first[child(instruction, i)]);
+                        }
+                        break;
+                    case Opcode::Until:
+                        // tries every offset, but fails at the end of input
+                        set.characters.add(0, 255);
+                        break;
+                    default:
+                        // Call, Success, AdvanceInputBy, ErrorIfNotMatch,
+                        // Optional, ZeroOrMore and NotAt can succeed on anything
+                        set = FirstSet::all();
+                        break;
+                }
+                return set;
+            }
+
+            // OneOrMore(Range) and so ZeroOrMore(Range) match a whole run of
+            // characters at once instead of entering the Range for each one
+            void fuse() {
+                for (Instruction & instruction : code) {
+                    if (instruction.opcode != Opcode::OneOrMore || instruction.count == 0) continue;
+                    const Instruction & next = code[child(instruction, 0)];
+                    if (next.opcode == Opcode::Range && !next.hasAction) {
+                        instruction.opcode = Opcode::RangeRun;
+                    }
+                }
+            }
+
+            void analyseFirst() {
+                first.assign(code.size(), FirstSet());
+                // sets only grow, recursive slots settle once nothing changes
+                bool changed = true;
+                while (changed) {
+                    changed = false;
+                    for (uint32_t slot = 0; slot < code.size(); slot++) {
+                        if (first[slot].merge(firstOf(code[slot]))) changed = true;
+                    }
+                }
+            }
+
+            void buildDispatch() {
+                // keys that try the same alternatives share one list
+                std::map<std::vector<uint32_t>, uint32_t> lists;
+                for (Instruction & instruction : code) {
+                    if (instruction.opcode != Opcode::Or) continue;
+                    instruction.table = dispatch.size() / dispatchKeys;
+                    lists.clear();
+                    std::vector<uint32_t> list;
+                    for (uint32_t key = 0; key < dispatchKeys; key++) {
+                        list.clear();
+                        for (uint32_t i = 0; i < instruction.count; i++) {
+                            if (first[child(instruction, i)].contains(key)) list.push_back(i);
+                        }
+                        auto found = lists.find(list);
+                        Candidates entry;
+                        entry.count = list.size();
+                        if (found == lists.end()) {
+                            entry.first = candidates.size();
+                            candidates.insert(candidates.end(), list.begin(), list.end());
+                            lists.emplace(list, entry.first);
+                        } else {
+                            entry.first = found->second;
+                        }
+                        dispatch.push_back(entry);
+                    }
+                }
+            }
+
+            // true if entering slot on a character outside stop always matches
+            // just that character without an action, stop gets every character
+            // on which anything else can happen
+            bool advancesByOne(uint32_t slot, Scan::CharacterSet & stop) const {
+                const Instruction & instruction = code[slot];
+                if (instruction.hasAction) return false;
+                switch (instruction.opcode) {
+                    case Opcode::Any:
+                        return true;
+                    case Opcode::AdvanceInputBy:
+                        return instruction.n == 1;
+                    case Opcode::Or: {
+                        // an Or falling back to advancing by one, like the
+                        // argument and balanced parens loops of the preprocessor
+                        if (instruction.count == 0) return false;
+                        Scan::CharacterSet fallbackStop;
+                        if (!advancesByOne(child(instruction, instruction.count - 1), fallbackStop)) return false;
+                        if (!fallbackStop.empty()) return false;
+                        for (uint32_t i = 0; i + 1 < instruction.count; i++) {
+                            stop.add(first[child(instruction, i)].characters);
+                        }
+                        return true;
+                    }
+                    default:
+                        return false;
+                }
+            }
+
+            // Until only tries its rule where its FIRST set says it could match,
+            // MatchBUntilA(A, B) advances over characters outside the FIRST set
+            // of A when B would only advance by one over them
+            void buildSkips() {
+                for (Instruction & instruction : code) {
+                    Scan::CharacterSet stop;
+                    if (instruction.opcode == Opcode::Until && instruction.count == 1) {
+                        stop = first[child(instruction, 0)].characters;
+                    } else if (instruction.opcode == Opcode::MatchBUntilA && instruction.count == 2) {
+                        if (!advancesByOne(child(instruction, 1), stop)) continue;
+                        stop.add(first[child(instruction, 0)].characters);
+                    } else {
+                        continue;
+                    }
+                    if (stop.full()) continue;
+                    instruction.skip = skips.size();
+                    skips.push_back(stop);
+                }
+            }
+
+            // moves to the next character an Until could match on, false if there is none
+            bool skipUntil(const Instruction & instruction, Iterator<std::string> &iterator) const {
+                const char * data = iterator.input.data();
+                const char * end = data + iterator.input.size();
+                const char * found = Scan::find(skips[instruction.skip], data + iterator.currentPosition(), end);
+                if (found == end) return false;
+                iterator.setCurrent(iterator.cbegin() + (found - data));
+                return true;
+            }
+
+            // advances a MatchBUntilA over the characters B would advance over one
+            // at a time, pushing the iterator before each one like B would
+            void skipRun(const Instruction & instruction, IteratorMatcher::MatchData & match, Iterator<std::string> &iterator) const {
+                const char * data = iterator.input.data();
+                const char * begin = data + iterator.currentPosition();
+                const char * found = Scan::find(skips[instruction.skip], begin, data + iterator.input.size());
+                if (found == begin) return;
+                for (const char * p = begin; p < found; p++) {
+                    iterator.pushIterator();
+                    iterator.advance();
+                }
+                match.matches += found - begin;
+                match.end = iterator.current();
+            }
+
+            const Candidates & candidatesFor(const Instruction & instruction, Iterator<std::string> &iterator) const {
+                uint32_t key = iterator.has_next() ? static_cast<unsigned char>(iterator.peekNext()) : endOfFileKey;
+                return dispatch[instruction.table * dispatchKeys + key];
+            }
+
+            // the slot of the child a frame enters at its current step
+            uint32_t stepSlot(const Instruction & instruction, const Frame & frame) const {
+                switch (instruction.opcode) {
+                    case Opcode::OneOrMore:
+                        // counts its repetitions in step, it has a single child
+                        return child(instruction, 0);
+                    case Opcode::Or:
+                        return child(instruction, candidates[frame.candidates.first + frame.step]);
+                    default:
+                        return child(instruction, frame.step);
+                }
+            }
+
+            static bool matchesWithoutActions(Opcode opcode) {
+                return opcode == Opcode::TemporaryAction || opcode == Opcode::At || opcode == Opcode::NotAt;
+            }
+
+            void analyse() {
+                calls.assign(code.size(), false);
+                actions.assign(code.size(), false);
+                // grow both sets until nothing changes, recursive slots reach
+                // their own flags through the cycle
+                bool changed = true;
+                while (changed) {
+                    changed = false;
+                    for (uint32_t slot = 0; slot < code.size(); slot++) {
+                        const Instruction & instruction = code[slot];
+                        bool call = instruction.opcode == Opcode::Call;
+                        bool action = call || instruction.hasAction;
+                        for (uint32_t i = 0; i < instruction.count; i++) {
+                            uint32_t next = child(instruction, i);
+                            call = call || calls[next];
+                            if (!matchesWithoutActions(instruction.opcode)) action = action || actions[next];
+                        }
+                        if (call != calls[slot] || action != actions[slot]) {
+                            calls[slot] = call;
+                            actions[slot] = action;
+                            changed = true;
+                        }
+                    }
+                }
+            }
+
+            bool memoizable(uint32_t slot, bool doAction) const {
+                return !memo.empty() && !calls[slot] && !(doAction && actions[slot]);
+            }
+
+            MemoEntry & memoEntry(uint32_t slot, uint64_t offset) {
+                uint64_t hash = (offset * 0x9E3779B97F4A7C15ull) ^ (slot * 0xC2B2AE3D27D4EB4Full);
+                return memo[(hash ^ (hash >> 29)) & (memo.size() - 1)];
+            }
+
+            void store(const Frame & frame, const IteratorMatcher::MatchData & result, Iterator<std::string> &iterator, uint64_t epoch) {
+                if (iterator.generation != frame.generation) return;
+                size_t pushes = iterator.iteratorStackSize() - frame.stackBase;
+                int matches = result ? result.matches : 0;
+                if (matches < 0 || pushes != static_cast<size_t>(matches) || pushes > memoPushLimit) return;
+                uint64_t offset = iterator.currentPosition(frame.match.begin);
+                MemoEntry & entry = memoEntry(frame.slot, offset);
+                entry.epoch = epoch;
+                entry.generation = frame.generation;
+                entry.slot = frame.slot;
+                entry.offset = offset;
+                entry.matched = result.matched;
+                // a failed Sequence ends after the children that matched
+                entry.end = iterator.currentPosition(result.end);
+                entry.current = iterator.currentPosition();
+                entry.pushes.clear();
+                for (size_t i = frame.stackBase; i < iterator.iteratorStackSize(); i++) {
+                    entry.pushes.push_back(iterator.currentPosition(iterator.iteratorStackAt(i)));
+                }
+            }
+
+            bool replay(uint32_t slot, Iterator<std::string> &iterator, uint64_t epoch, IteratorMatcher::MatchData & result) {
+                uint64_t offset = iterator.currentPosition();
+                const MemoEntry & entry = memoEntry(slot, offset);
+                if (entry.epoch != epoch || entry.generation != iterator.generation || entry.slot != slot || entry.offset != offset) {
+                    return false;
+                }
+                memoHits++;
+                result = emptyMatch(iterator);
+                for (uint64_t push : entry.pushes) {
+                    iterator.pushIterator(iterator.cbegin() + push);
+                }
+                result.matched = entry.matched;
+                result.matches = entry.pushes.size();
+                result.end = iterator.cbegin() + entry.end;
+                iterator.setCurrent(iterator.cbegin() + entry.current);
+                return true;
+            }
+
+            static IteratorMatcher::MatchData emptyMatch(Iterator<std::string> &iterator) {
+                IteratorMatcher::MatchData match;
+                match.begin = iterator.current();
+                match.end = iterator.current();
+                match.matched = false;
+                return match;
+            }
+
+            IteratorMatcher::MatchData execute(Iterator<std::string> &iterator, bool doAction) {
+                std::vector<Frame> frames;
+                frames.reserve(64);
+
+                IteratorMatcher::MatchData result;
+                uint32_t slot = 0;
+                bool entering = true;
+
+                // a match that runs inside an action of this one gets its own
+                // epoch, entries made for the other input can never be replayed
+                uint64_t epoch = ++memoEpoch;
+
+                while (true) {
+                    if (entering) {
+                        const Instruction & instruction = code[slot];
+                        switch (instruction.opcode) {
+                            case Opcode::Call:
+                                result = instruction.rule->match(iterator, doAction);
+                                break;
+                            case Opcode::Empty:
+                                result = emptyMatch(iterator);
+                                break;
+                            case Opcode::Success:
+                                result = emptyMatch(iterator);
+                                succeedEmpty(iterator, result);
+                                act(instruction, iterator, result, doAction);
+                                break;
+                            case Opcode::AdvanceInputBy:
+                                result = emptyMatch(iterator);
+                                result.matched = true;
+                                iterator.pushIterator();
+                                result.matches++;
+                                iterator.advance(instruction.n);
+                                result.end = iterator.current();
+                                act(instruction, iterator, result, doAction);
+                                break;
+                            case Opcode::Fail:
+                                result = emptyMatch(iterator);
+                                act(instruction, iterator, result, doAction);
+                                break;
+                            case Opcode::Any:
+                                result = IteratorMatcher::match(iterator);
+                                if (result) act(instruction, iterator, result, doAction);
+                                break;
+                            case Opcode::Char:
+                                result = IteratorMatcher::match(iterator, instruction.character);
+                                if (result) act(instruction, iterator, result, doAction);
+                                break;
+                            case Opcode::EndOfFile:
+                                result = emptyMatch(iterator);
+                                if (!iterator.has_next()) {
+                                    succeedEmpty(iterator, result);
+                                    act(instruction, iterator, result, doAction);
+                                }
+                                break;
+                            case Opcode::NewlineOrEOF:
+                                result = IteratorMatcher::match(iterator, '\n');
+                                if (result) {
+                                    act(instruction, iterator, result, doAction);
+                                } else if (!iterator.has_next()) {
+                                    succeedEmpty(iterator, result);
+                                    act(instruction, iterator, result, doAction);
+                                }
+                                break;
+                            case Opcode::String:
+                                result = IteratorMatcher::match(iterator, static_cast<Rules::String*>(instruction.rule)->string);
+                                if (result) act(instruction, iterator, result, doAction);
+                                break;
+                            case Opcode::Range:
+                                if (!iterator.has_next()) {
+                                    // fails where it began, so a failure that
+                                    // ends an Or can be memoized
+                                    result = emptyMatch(iterator);
+                                    break;
+                                }
+                                result = emptyMatch(iterator);
+                                iterator.pushIterator();
+                                if (static_cast<Rules::Range*>(instruction.rule)->contains(iterator.next())) {
+                                    result.end = iterator.current();
+                                    result.matched = true;
+                                    result.matches++;
+                                    act(instruction, iterator, result, doAction);
+                                } else {
+                                    iterator.popIterator();
+                                }
+                                break;
+                            case Opcode::RangeRun: {
+                                auto range = static_cast<Rules::Range*>(code[child(instruction, 0)].rule);
+                                result = emptyMatch(iterator);
+                                int length = range->matchRun(iterator);
+                                if (length != 0) {
+                                    result.matched = true;
+                                    result.matches = length;
+                                    result.end = iterator.current();
+                                    act(instruction, iterator, result, doAction);
+                                }
+                                break;
+                            }
+                            case Opcode::Holder:
+                                if (instruction.count == 0) {
+                                    result = emptyMatch(iterator);
+                                    succeedEmpty(iterator, result);
+                                    act(instruction, iterator, result, doAction);
+                                    break;
+                                }
+                                // fallthrough
+                            case Opcode::TemporaryAction:
+                            case Opcode::ErrorIfMatch:
+                            case Opcode::ErrorIfNotMatch:
+                            case Opcode::Optional:
+                            case Opcode::OneOrMore:
+                            case Opcode::ZeroOrMore:
+                            case Opcode::MatchBUntilA:
+                            case Opcode::Or:
+                            case Opcode::Sequence:
+                            case Opcode::Until:
+                            case Opcode::At:
+                            case Opcode::NotAt: {
+                                if (instruction.count == 0) {
+                                    // an empty Or or Sequence matches nothing and succeeds
+                                    result = emptyMatch(iterator);
+                                    succeedEmpty(iterator, result);
+                                    act(instruction, iterator, result, doAction);
+                                    break;
+                                }
+                                if (instruction.opcode == Opcode::Until && !iterator.has_next()) {
+                                    result = emptyMatch(iterator);
+                                    break;
+                                }
+                                bool memoize = (instruction.opcode == Opcode::Or || instruction.opcode == Opcode::Sequence) && memoizable(slot, doAction);
+                                if (memoize && replay(slot, iterator, epoch, result)) {
+                                    break;
+                                }
+                                Candidates picked;
+                                if (instruction.opcode == Opcode::Or) {
+                                    picked = candidatesFor(instruction, iterator);
+                                    if (picked.count == 0) {
+                                        // no alternative can match the next character
+                                        result = emptyMatch(iterator);
+                                        break;
+                                    }
+                                }
+                                frames.push_back({slot, 0, doAction, emptyMatch(iterator), picked});
+                                frames.back().picked = iterator.generation;
+                                if (memoize) {
+                                    frames.back().memoize = true;
+                                    frames.back().stackBase = iterator.iteratorStackSize();
+                                    frames.back().generation = iterator.generation;
+                                }
+                                if (instruction.skip != noSkip) {
+                                    if (instruction.opcode == Opcode::MatchBUntilA) {
+                                        skipRun(instruction, frames.back().match, iterator);
+                                    } else if (!skipUntil(instruction, iterator)) {
+                                        // nothing left the rule of the Until could match
+                                        result = frames.back().match;
+                                        frames.pop_back();
+                                        break;
+                                    }
+                                }
+                                switch (instruction.opcode) {
+                                    case Opcode::TemporaryAction:
+                                    case Opcode::At:
+                                    case Opcode::NotAt:
+                                        doAction = false;
+                                        break;
+                                    default:
+                                        break;
+                                }
+                                slot = stepSlot(instruction, frames.back());
+                                continue;
+                            }
+                        }
+                        entering = false;
+                        continue;
+                    }
+
+                    // return `result` to the frame that entered it
+                    if (frames.empty()) return result;
+
+                    Frame & frame = frames.back();
+                    const Instruction & instruction = code[frame.slot];
+                    IteratorMatcher::MatchData & match = frame.match;
+                    doAction = frame.doAction;
+
+                    // set to the slot of the next child to enter, or left as is to
+                    // return `result` to the parent frame
+                    bool enter = false;
+
+                    switch (instruction.opcode) {
+                        case Opcode::Holder:
+                        case Opcode::TemporaryAction:
+                        case Opcode::ZeroOrMore:
+                            if (result) act(instruction, iterator, result, doAction);
+                            break;
+                        case Opcode::ErrorIfMatch:
+                            if (result) {
+                                if (doAction) instruction.rule->action(Input(iterator, result, 0));
+                                XOut << static_cast<Rules::ErrorIfMatch*>(instruction.rule)->message << XLog::Abort;
+                            }
+                            break;
+                        case Opcode::ErrorIfNotMatch:
+                            if (!result) {
+                                if (doAction) instruction.rule->action(Input(iterator, result, 0));
+                                XOut << static_cast<Rules::ErrorIfNotMatch*>(instruction.rule)->message << XLog::Abort;
+                            }
+                            break;
+                        case Opcode::Optional:
+                            if (result) {
+                                match.end = result.end;
+                                match.matches = result.matches;
+                            }
+                            succeedEmpty(iterator, match);
+                            act(instruction, iterator, match, doAction);
+                            result = match;
+                            break;
+                        case Opcode::OneOrMore:
+                            if (frame.step == 0) {
+                                if (!result) break;
+                                match = result;
+                                frame.step = 1;
+                                enter = true;
+                            } else if (result) {
+                                match.end = result.end;
+                                match.matches += result.matches;
+                                enter = true;
+                            } else {
+                                act(instruction, iterator, match, doAction);
+                                result = match;
+                            }
+                            break;
+                        case Opcode::MatchBUntilA:
+                            if (frame.step == 0) {
+                                if (result) {
+                                    match.matched = true;
+                                    match.end = result.end;
+                                    match.matches += result.matches;
+                                    act(instruction, iterator, match, doAction);
+                                    result = match;
+                                } else {
+                                    frame.step = 1;
+                                    enter = true;
+                                }
+                            } else {
+                                if (result) {
+                                    match.end = result.end;
+                                    match.matches += result.matches;
+                                    frame.step = 0;
+                                    if (instruction.skip != noSkip) skipRun(instruction, match, iterator);
+                                    enter = true;
+                                } else {
+                                    result = match;
+                                }
+                            }
+                            break;
+                        case Opcode::Or:
+                            if (result) {
+                                act(instruction, iterator, result, doAction);
+                            } else if (iterator.generation != frame.picked) {
+                                // the alternative modified the input before it
+                                // failed, those after it are picked again
+                                uint32_t failed = candidates[frame.candidates.first + frame.step];
+                                frame.candidates = candidatesFor(instruction, iterator);
+                                frame.picked = iterator.generation;
+                                frame.step = 0;
+                                while (frame.step < frame.candidates.count && candidates[frame.candidates.first + frame.step] <= failed) frame.step++;
+                                enter = frame.step < frame.candidates.count;
+                            } else if (++frame.step < frame.candidates.count) {
+                                enter = true;
+                            }
+                            break;
+                        case Opcode::Sequence:
+                            if (!result) {
+                                iterator.popIterator(match.matches);
+                                match.matches = 0;
+                                result = match;
+                                break;
+                            }
+                            match.end = result.end;
+                            match.matches += result.matches;
+                            if (++frame.step < instruction.count) {
+                                enter = true;
+                                break;
+                            }
+                            succeedEmpty(iterator, match);
+                            act(instruction, iterator, match, doAction);
+                            result = match;
+                            break;
+                        case Opcode::Until:
+                            if (result) {
+                                match.matched = true;
+                                match.end = result.end;
+                                match.matches = result.matches;
+                                act(instruction, iterator, match, doAction);
+                                result = match;
+                                break;
+                            }
+                            iterator.advance();
+                            if (iterator.has_next() && (instruction.skip == noSkip || skipUntil(instruction, iterator))) {
+                                enter = true;
+                                break;
+                            }
+                            iterator.setCurrent(match.begin);
+                            result = match;
+                            break;
+                        case Opcode::At:
+                        case Opcode::NotAt:
+                            iterator.popIterator(result.matches);
+                            if ((instruction.opcode == Opcode::At) == result.matched) {
+                                succeedEmpty(iterator, match);
+                                act(instruction, iterator, match, doAction);
+                            } else {
+                                match.matched = false;
+                            }
+                            result = match;
+                            break;
+                        default:
+                            break;
+                    }
+
+                    if (enter) {
+                        slot = stepSlot(instruction, frame);
+                        switch (instruction.opcode) {
+                            case Opcode::TemporaryAction:
+                            case Opcode::At:
+                            case Opcode::NotAt:
+                                doAction = false;
+                                break;
+                            default:
+                                break;
+                        }
+                        entering = true;
+                        continue;
+                    }
+
+                    if (frame.memoize) store(frame, result, iterator, epoch);
+                    frames.pop_back();
+                }
+            }
+
+        public:
+            Program() = default;
+
+            Program(Rule * rule, Action action = NO_ACTION) : Rule(action) {
+                if (rule != nullptr) {
+                    lower(rule);
+                    fuse();
+                    analyseFirst();
+                    buildDispatch();
+                    buildSkips();
+                }
+            }
+
+            size_t size() const {
+                return code.size();
+            }
+
+            // enables packrat memoization of Or and Sequence results in a table
+            // of at least `entries` entries, 0 disables it
+            void memoize(size_t entries = 4096) {
+                memo.clear();
+                memo.shrink_to_fit();
+                if (entries == 0) return;
+                size_t capacity = 1;
+                while (capacity < entries) capacity <<= 1;
+                memo.resize(capacity);
+                analyse();
+            }
+
+            using Rule::match;
+
+            virtual IteratorMatcher::MatchData match(Iterator<std::string> &iterator, bool doAction = true) override {
+                if (code.empty()) {
+                    return Rule::match(iterator, doAction);
+                }
+                IteratorMatcher::MatchData match = execute(iterator, doAction);
+                if (match && doAction) {
+                    action(Input(iterator, match, match.matches));
+                }
+                return match;
+            }
+        };
+
+        // lowers the graph reachable from rule into a Program
+        inline Program compile(Rule * rule) {
+            return Program(rule);
+        }
+
+        inline Program compile(Rule & rule) {
+            return Program(&rule);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef CPP_SCAN_H
+#define CPP_SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CPP {
+    namespace Scan {
+
+        // a set of bytes as a 256 bit bitmap
+        //
+        // the set is also kept as a list of byte intervals while it has at most
+        // maxIntervals of them, vector code tests a byte against an interval
+        // with one subtract and one compare instead of a table lookup
+        struct CharacterSet {
+            static constexpr int maxIntervals = 8;
+
+            uint64_t bits[4] = {0, 0, 0, 0};
+            // -1 if the set has more than maxIntervals intervals
+            int intervals = 0;
+            uint8_t low[maxIntervals] = {};
+            uint8_t high[maxIntervals] = {};
+
+            bool contains(unsigned char character) const {
+                return (bits[character >> 6] >> (character & 63)) & 1;
+            }
+
+            bool contains(char character) const {
+                return contains(static_cast<unsigned char>(character));
+            }
+
+            void add(unsigned char character) {
+                bits[character >> 6] |= uint64_t(1) << (character & 63);
+                update();
+            }
+
+            // adds every byte in [first, last]
+            void add(unsigned char first, unsigned char last) {
+                for (int character = first; character <= last; character++) {
+                    bits[character >> 6] |= uint64_t(1) << (character & 63);
+                }
+                update();
+            }
+
+            void add(const CharacterSet & other) {
+                for (int i = 0; i < 4; i++) bits[i] |= other.bits[i];
+                update();
+            }
+
+            bool empty() const {
+                return (bits[0] | bits[1] | bits[2] | bits[3]) == 0;
+            }
+
+            bool full() const {
+                return (bits[0] & bits[1] & bits[2] & bits[3]) == ~uint64_t(0);
+            }
+
+            bool operator==(const CharacterSet & other) const {
+                for (int i = 0; i < 4; i++) {
+                    if (bits[i] != other.bits[i]) return false;
+                }
+                return true;
+            }
+
+            bool operator!=(const CharacterSet & other) const {
+                return !(*this == other);
+            }
+
+        private:
+            void update() {
+                intervals = 0;
+                int character = 0;
+                while (character < 256) {
+                    if (!contains(static_cast<unsigned char>(character))) {
+                        character++;
+                        continue;
+                    }
+                    int first = character;
+                    while (character < 256 && contains(static_cast<unsigned char>(character))) character++;
+                    if (intervals == maxIntervals) {
+                        intervals = -1;
+                        return;
+                    }
+                    low[intervals] = first;
+                    high[intervals] = character - 1;
+                    intervals++;
+                }
+            }
+        };
+
+        // returns the length of the longest prefix of [begin, end) made of bytes in set
+        //
+        // sets with few intervals are scanned 32 or 16 bytes at a time with AVX2
+        // or SSE2, picked at runtime, anything else a byte at a time
+        size_t span(const CharacterSet & set, const char * begin, const char * end);
+
+        // returns the first byte of [begin, end) in set, or end if there is none
+        //
+        // a single byte is found with memchr, sets with few intervals like
+        // span(), anything else a byte at a time
+        const char * find(const CharacterSet & set, const char * begin, const char * end);
+
+        // one bit for each of the 32 bytes at p, bit i is set if p[i] is in set
+        //
+        // the 32 bytes are classified at once with AVX2 or two SSE2 loads,
+        // picked at runtime, when set has few intervals
+        uint32_t mask(const CharacterSet & set, const char * p);
+
+        // the index of the lowest set bit of a non zero mask
+        inline int lowest(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+            return __builtin_ctz(mask);
+#else
+            int index = 0;
+            while (!(mask & 1)) {
+                mask >>= 1;
+                index++;
+            }
+            return index;
+#endif
+        }
+    }
+}
+
+#endif
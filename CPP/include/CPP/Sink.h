@@ -0,0 +1,187 @@
+#ifndef CPP_SINK_H
+#define CPP_SINK_H
+
+#include "Lexer.h"
+#include <cerrno>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace CPP {
+
+    // receives the output of a run as it is produced
+    //
+    // a run hands its tokens over as soon as they are expanded, nothing but
+    // what a sink keeps holds the output of a whole input
+    class Sink {
+    public:
+        virtual ~Sink() = default;
+
+        // a run begins, files locate its tokens if #line directives are wanted
+        virtual void begin(const SourceFiles *) {}
+
+        // the next token of the output, the last is the EndOfFile token
+        virtual void write(const Token & token, const Atoms & atoms) = 0;
+
+        // the run ended, everything written has been passed on
+        virtual void end() {}
+    };
+
+    // spells the tokens written to it and passes the text on a chunk at a time
+    class TextSink : public Sink {
+#ifdef GTEST_API_
+    public:
+#endif
+        Lexer::Speller speller;
+        std::string buffer;
+        size_t size;
+
+    protected:
+        // takes the next chunk of text, text may be left empty or moved from
+        virtual void chunk(std::string & text) = 0;
+
+    public:
+        explicit TextSink(size_t size = 64 * 1024) : size(size) {}
+
+        void begin(const SourceFiles * files) override {
+            speller = Lexer::Speller(files);
+            buffer.clear();
+        }
+
+        void write(const Token & token, const Atoms & atoms) override {
+            speller.spell(token, atoms, buffer);
+            if (buffer.size() >= size) {
+                chunk(buffer);
+                buffer.clear();
+            }
+        }
+
+        void end() override {
+            if (!buffer.empty()) chunk(buffer);
+            buffer.clear();
+        }
+    };
+
+    // appends the text to a string
+    class StringSink : public TextSink {
+        std::string & output;
+
+    protected:
+        void chunk(std::string & text) override {
+            output += text;
+        }
+
+    public:
+        explicit StringSink(std::string & output) : output(output) {}
+    };
+
+    // writes the text to a stream
+    class StreamSink : public TextSink {
+        std::ostream & stream;
+
+    protected:
+        void chunk(std::string & text) override {
+            stream.write(text.data(), static_cast<std::streamsize>(text.size()));
+        }
+
+    public:
+        explicit StreamSink(std::ostream & stream) : stream(stream) {}
+
+        void end() override {
+            TextSink::end();
+            stream.flush();
+        }
+    };
+
+    // writes the text to a file descriptor
+    //
+    // chunks are kept until chunks of them are held and written together by
+    // one writev
+    //
+    // once a write fails the sink keeps its errno, see error, and drops
+    // what it is given after
+    class FileSink : public TextSink {
+#ifdef GTEST_API_
+    public:
+#endif
+        static constexpr size_t chunks = 16;
+
+        int fd;
+        std::vector<std::string> held;
+        // the errno of the write that failed, 0 if none did
+        int failure = 0;
+
+        void flush() {
+            struct iovec vectors[chunks];
+            size_t first = 0;
+            size_t written = 0;
+            while (first != held.size()) {
+                int count = 0;
+                for (size_t index = first; index != held.size(); index++) {
+                    size_t skip = index == first ? written : 0;
+                    vectors[count].iov_base = const_cast<char*>(held[index].data() + skip);
+                    vectors[count].iov_len = held[index].size() - skip;
+                    count++;
+                }
+                ssize_t result = writev(fd, vectors, count);
+                if (result < 0) {
+                    if (errno == EINTR) continue;
+                    failure = errno;
+                    break;
+                }
+                // skip what a partial write wrote
+                size_t left = static_cast<size_t>(result);
+                while (first != held.size() && left >= held[first].size() - written) {
+                    left -= held[first].size() - written;
+                    written = 0;
+                    first++;
+                }
+                written += left;
+            }
+            held.clear();
+        }
+
+    protected:
+        void chunk(std::string & text) override {
+            if (failed()) return;
+            held.push_back(std::move(text));
+            text = std::string();
+            if (held.size() == chunks) flush();
+        }
+
+    public:
+        explicit FileSink(int fd) : fd(fd) {}
+
+        // true once a write failed
+        bool failed() const {
+            return failure != 0;
+        }
+
+        // the errno of the write that failed, 0 if none did
+        int error() const {
+            return failure;
+        }
+
+        void end() override {
+            TextSink::end();
+            if (!failed()) flush();
+        }
+    };
+
+    // hands every token to a callback with its spelling
+    class TokenSink : public Sink {
+        std::function<void(const Token &, std::string_view)> callback;
+
+    public:
+        explicit TokenSink(std::function<void(const Token &, std::string_view)> callback) : callback(std::move(callback)) {}
+
+        void write(const Token & token, const Atoms & atoms) override {
+            callback(token, atoms.spelling(token.atom));
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef CPP_SKIP_H
+#define CPP_SKIP_H
+
+#include <cstring>
+#include <string_view>
+
+namespace CPP {
+
+    // finds directives in text phases 1 and 2 left, without lexing it
+    //
+    // the text has no line continuations or comments left, so a directive
+    // is a line whose first byte after blanks is #, a line is only looked at
+    // up to the word after its #, the rest is passed by memchr
+    class Skip {
+    public:
+        static bool blank(char c) {
+            return c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r';
+        }
+
+        static bool identifier(char c) {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '$';
+        }
+
+        // the word at p after blanks, p is left after it
+        static std::string_view word(const char *& p, const char * end) {
+            while (p != end && blank(*p)) p++;
+            const char * begin = p;
+            while (p != end && identifier(*p)) p++;
+            return std::string_view(begin, p - begin);
+        }
+
+        // the start of the line after p
+        static const char * line(const char * p, const char * end) {
+            const void * newline = memchr(p, '\n', end - p);
+            return newline == nullptr ? end : static_cast<const char*>(newline) + 1;
+        }
+
+        // skips a group whose lines begin at offset, returns the offset of
+        // the line of the #elif, #else or #endif ending it, the size of text
+        // if the group does not end
+        //
+        // conditionals nested in the group are skipped whole
+        static size_t group(std::string_view text, size_t offset) {
+            const char * begin = text.data();
+            const char * end = begin + text.size();
+            const char * p = begin + offset;
+            size_t depth = 0;
+            while (p != end) {
+                const char * start = p;
+                while (p != end && blank(*p)) p++;
+                if (p != end && *p == '#') {
+                    p++;
+                    std::string_view directive = word(p, end);
+                    if (directive == "if" || directive == "ifdef" || directive == "ifndef") {
+                        depth++;
+                    } else if (directive == "endif") {
+                        if (depth == 0) return start - begin;
+                        depth--;
+                    } else if ((directive == "elif" || directive == "else") && depth == 0) {
+                        return start - begin;
+                    }
+                }
+                p = line(p, end);
+            }
+            return text.size();
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,297 @@
+#ifndef CPP_SNAPSHOT_H
+#define CPP_SNAPSHOT_H
+
+#include "Atoms.h"
+#include "CPP_Preprocessor_Data.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace CPP {
+
+    // the definitions of a context saved to a file, to start runs from
+    //
+    // a snapshot holds the atoms of the context, its macros as compiled by
+    // #define and the files that ran #pragma once, the macros that guard
+    // includes are among the macros
+    //
+    // a snapshot is mapped and read where it lies, a context based on it
+    // finds atoms in its table and reads a macro out of it the first time
+    // the macro is looked up, opening one checks its tables but reads none
+    // of its macros
+    //
+    // the file begins with a Header, every section is aligned to 8 bytes
+    //
+    //     offsets   uint32_t[atoms + 1], of each spelling in spellings
+    //     hashes    uint32_t[atoms]
+    //     slots     uint32_t[capacity], the table of Atoms::Shared
+    //     index     uint32_t[atoms], of the record of the macro each atom names
+    //     records   the macros, see CPP_Preprocessor_Data::Macro::write
+    //     once      a uint32_t length and the path, for every file
+    //     spellings the bytes of every spelling
+    //
+    // a snapshot is only read by the build that wrote it, the header keeps
+    // the version and the sizes of the structures copied as bytes
+    class Snapshot : public std::enable_shared_from_this<Snapshot> {
+    public:
+        static constexpr uint32_t version = 2;
+
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t tokenSize;
+            uint32_t elementSize;
+            uint32_t atoms;
+            uint32_t capacity;
+            uint32_t once;
+            uint64_t offsets;
+            uint64_t hashes;
+            uint64_t slots;
+            uint64_t index;
+            uint64_t records;
+            uint64_t paths;
+            uint64_t spellings;
+            uint64_t size;
+        };
+
+#ifdef GTEST_API_
+    public:
+#else
+    private:
+#endif
+        static constexpr char magic[8] = {'C', 'P', 'P', 'S', 'N', 'A', 'P', '\0'};
+
+        const uint8_t * data = nullptr;
+        size_t size = 0;
+
+        const Header & header() const {
+            return *reinterpret_cast<const Header*>(data);
+        }
+
+        template <typename T>
+        const T * at(uint64_t offset) const {
+            return reinterpret_cast<const T*>(data + offset);
+        }
+
+        static void align(std::string & output) {
+            output.resize((output.size() + 7) & ~size_t(7));
+        }
+
+        template <typename T>
+        static void put(std::string & output, const std::vector<T> & values) {
+            output.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+        }
+
+        // the header is consistent with the size of the file and the tables
+        // with the sections they point into
+        //
+        // the records are not read, Macro::read checks a record as it is
+        // looked up
+        bool valid() const {
+            if (size < sizeof(Header)) return false;
+            const Header & header = this->header();
+            if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version) return false;
+            if (header.tokenSize != sizeof(Token) || header.elementSize != sizeof(CPP_Preprocessor_Data::Macro::Element)) return false;
+            if (header.size != size || header.capacity == 0 || (header.capacity & (header.capacity - 1)) != 0) return false;
+            uint64_t atoms = header.atoms;
+            // the sections, aligned and in the order save writes them
+            const uint64_t sections[] = {header.offsets, header.hashes, header.slots, header.index, header.records, header.paths, header.spellings};
+            for (uint64_t section : sections) {
+                if (section < sizeof(Header) || section > size || (section & 7) != 0) return false;
+            }
+            if (header.offsets + (atoms + 1) * 4 > header.hashes || header.hashes + atoms * 4 > header.slots
+                || header.slots + uint64_t(header.capacity) * 4 > header.index || header.index + atoms * 4 > header.records
+                || header.records > header.paths || header.paths > header.spellings) {
+                return false;
+            }
+            // the spelling of every atom lies in the spellings
+            const uint32_t * offsets = at<uint32_t>(header.offsets);
+            if (offsets[0] != 0 || header.spellings + offsets[atoms] > size) return false;
+            for (uint64_t atom = 0; atom < atoms; atom++) {
+                if (offsets[atom] > offsets[atom + 1]) return false;
+            }
+            // every slot names an atom and one is empty, probes end
+            const uint32_t * slots = at<uint32_t>(header.slots);
+            uint64_t empty = 0;
+            for (uint32_t slot = 0; slot < header.capacity; slot++) {
+                if (slots[slot] > atoms) return false;
+                if (slots[slot] == 0) empty++;
+            }
+            if (empty == 0) return false;
+            // every record begins in the records
+            const uint32_t * index = at<uint32_t>(header.index);
+            for (uint64_t atom = 0; atom < atoms; atom++) {
+                if (index[atom] > header.paths - header.records) return false;
+            }
+            // every path lies before the spellings
+            const uint8_t * p = at<uint8_t>(header.paths);
+            const uint8_t * end = at<uint8_t>(header.spellings);
+            for (uint32_t file = 0; file < header.once; file++) {
+                uint32_t length;
+                if (static_cast<size_t>(end - p) < sizeof(length)) return false;
+                memcpy(&length, p, sizeof(length));
+                p += sizeof(length);
+                if (length > static_cast<size_t>(end - p)) return false;
+                p += length;
+            }
+            return true;
+        }
+
+    public:
+        Snapshot() = default;
+
+        Snapshot(const Snapshot &) = delete;
+        Snapshot & operator=(const Snapshot &) = delete;
+
+        ~Snapshot() {
+            if (data != nullptr) munmap(const_cast<uint8_t*>(data), size);
+        }
+
+        // writes atoms, definitions and once to a snapshot at path, returns
+        // false if it cannot be written
+        //
+        // the snapshot is written beside path and renamed over it, a run
+        // mapping the old one keeps reading it
+        static bool save(const std::string & path, const Atoms & atoms, CPP_Preprocessor_Data::Definitions & definitions, const std::unordered_set<std::string> & once) {
+            uint32_t count = static_cast<uint32_t>(atoms.size());
+            std::vector<uint32_t> offsets(count + 1, 0);
+            std::vector<uint32_t> hashes(count);
+            std::string spellings;
+            for (uint32_t atom = 0; atom < count; atom++) {
+                std::string_view spelling = atoms.spelling(atom);
+                offsets[atom] = static_cast<uint32_t>(spellings.size());
+                hashes[atom] = Atoms::hash(spelling);
+                spellings += spelling;
+            }
+            offsets[count] = static_cast<uint32_t>(spellings.size());
+            // at most half full
+            uint32_t capacity = 1024;
+            while (capacity < count * 2) capacity *= 2;
+            std::vector<uint32_t> slots(capacity, 0);
+            for (uint32_t atom = 0; atom < count; atom++) {
+                size_t slot = hashes[atom] & (capacity - 1);
+                while (slots[slot] != 0) slot = (slot + 1) & (capacity - 1);
+                slots[slot] = atom + 1;
+            }
+            std::vector<uint32_t> index(count, 0);
+            std::string records;
+            definitions.each([&](uint32_t atom, const std::shared_ptr<const CPP_Preprocessor_Data::Macro> & macro) {
+                index[atom] = static_cast<uint32_t>(records.size()) + 1;
+                macro->write(records);
+            });
+            Header header = {};
+            memcpy(header.magic, magic, sizeof(magic));
+            header.version = version;
+            header.tokenSize = sizeof(Token);
+            header.elementSize = sizeof(CPP_Preprocessor_Data::Macro::Element);
+            header.atoms = count;
+            header.capacity = capacity;
+            header.once = static_cast<uint32_t>(once.size());
+            std::string output(sizeof(Header), '\0');
+            align(output);
+            header.offsets = output.size();
+            put(output, offsets);
+            align(output);
+            header.hashes = output.size();
+            put(output, hashes);
+            align(output);
+            header.slots = output.size();
+            put(output, slots);
+            align(output);
+            header.index = output.size();
+            put(output, index);
+            align(output);
+            header.records = output.size();
+            output += records;
+            align(output);
+            header.paths = output.size();
+            for (const std::string & file : once) {
+                uint32_t length = static_cast<uint32_t>(file.size());
+                output.append(reinterpret_cast<const char*>(&length), sizeof(length));
+                output += file;
+            }
+            align(output);
+            header.spellings = output.size();
+            output += spellings;
+            header.size = output.size();
+            memcpy(&output[0], &header, sizeof(Header));
+            std::string temporary = path + ".tmp";
+            FILE * file = fopen(temporary.c_str(), "wb");
+            if (file == nullptr) return false;
+            bool written = fwrite(output.data(), 1, output.size(), file) == output.size();
+            written = fclose(file) == 0 && written;
+            if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+                remove(temporary.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        // maps the snapshot at path, nullptr if it cannot be read or was
+        // written by another version
+        static std::shared_ptr<const Snapshot> open(const std::string & path) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return nullptr;
+            struct stat status;
+            if (fstat(fd, &status) != 0 || status.st_size < static_cast<off_t>(sizeof(Header))) {
+                close(fd);
+                return nullptr;
+            }
+            void * mapped = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED) return nullptr;
+            auto snapshot = std::make_shared<Snapshot>();
+            snapshot->data = static_cast<const uint8_t*>(mapped);
+            snapshot->size = static_cast<size_t>(status.st_size);
+            if (!snapshot->valid()) return nullptr;
+            return snapshot;
+        }
+
+        // the table of the atoms, it keeps the snapshot alive
+        Atoms::Shared atoms() const {
+            Atoms::Shared table;
+            table.offsets = at<uint32_t>(header().offsets);
+            table.spellings = at<char>(header().spellings);
+            table.hashes = at<uint32_t>(header().hashes);
+            table.slots = at<uint32_t>(header().slots);
+            table.count = header().atoms;
+            table.mask = header().capacity - 1;
+            table.owner = shared_from_this();
+            return table;
+        }
+
+        // the records of the macros, they keep the snapshot alive
+        CPP_Preprocessor_Data::Definitions::Shared definitions() const {
+            CPP_Preprocessor_Data::Definitions::Shared records;
+            records.index = at<uint32_t>(header().index);
+            records.count = header().atoms;
+            records.records = at<uint8_t>(header().records);
+            records.size = header().paths - header().records;
+            records.owner = shared_from_this();
+            return records;
+        }
+
+        // the canonical paths of the files that ran #pragma once
+        std::unordered_set<std::string> once() const {
+            std::unordered_set<std::string> paths;
+            const uint8_t * p = at<uint8_t>(header().paths);
+            for (uint32_t file = 0; file < header().once; file++) {
+                uint32_t length;
+                memcpy(&length, p, sizeof(length));
+                paths.emplace(reinterpret_cast<const char*>(p + sizeof(length)), length);
+                p += sizeof(length) + length;
+            }
+            return paths;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef CPP_SOURCE_MAP_H
+#define CPP_SOURCE_MAP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace CPP {
+
+    // maps offsets in the text phases 1 and 2 leave back to lines and
+    // columns of the input they were given
+    //
+    // the text is a list of runs copied from the input, each run starts with
+    // an edit giving the input offset it was copied from, an edit is kept as
+    // two variable length numbers, the bytes the text advanced since the
+    // last edit and the input bytes skipped since then, so most edits take
+    // two or three bytes
+    //
+    // every interval edits a checkpoint holds the offsets reached, a lookup
+    // binary searches the checkpoints and decodes at most interval edits
+    class SourceMap {
+#ifdef GTEST_API_
+    public:
+#endif
+        static constexpr uint32_t interval = 16;
+
+        struct Checkpoint {
+            // the offset in the text and in the input of the last edit
+            uint32_t offset = 0;
+            uint32_t original = 0;
+            // the index in edits of the next edit
+            uint32_t index = 0;
+        };
+
+        std::vector<uint8_t> edits;
+        std::vector<Checkpoint> checkpoints;
+        Checkpoint last;
+        uint32_t count = 0;
+        // the input offset of the start of every line
+        std::vector<uint32_t> lines;
+
+        void put(uint32_t value) {
+            while (value >= 0x80) {
+                edits.push_back(static_cast<uint8_t>(value | 0x80));
+                value >>= 7;
+            }
+            edits.push_back(static_cast<uint8_t>(value));
+        }
+
+        uint32_t get(uint32_t & index) const {
+            uint32_t value = 0;
+            for (unsigned shift = 0;; shift += 7) {
+                uint8_t byte = edits[index++];
+                value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) return value;
+            }
+        }
+
+    public:
+        struct Location {
+            // both count from 1
+            uint32_t line = 1;
+            uint32_t column = 1;
+        };
+
+        // maps the text to input one to one, until edits are made
+        void clear(std::string_view input) {
+            edits.clear();
+            checkpoints.assign(1, Checkpoint());
+            last = Checkpoint();
+            count = 0;
+            lines.assign(1, 0);
+            const char * begin = input.data();
+            const char * end = begin + input.size();
+            for (const char * p = begin; p != end;) {
+                const void * newline = memchr(p, '\n', end - p);
+                if (newline == nullptr) break;
+                p = static_cast<const char*>(newline) + 1;
+                lines.push_back(static_cast<uint32_t>(p - begin));
+            }
+        }
+
+        // the text from offset on is copied from the input at original
+        //
+        // edits are made in order, offset and original never decrease and
+        // original advances at least as far as offset
+        void edit(uint32_t offset, uint32_t original) {
+            uint32_t advanced = offset - last.offset;
+            put(advanced);
+            put(original - last.original - advanced);
+            last.offset = offset;
+            last.original = original;
+            last.index = static_cast<uint32_t>(edits.size());
+            if (++count % interval == 0) checkpoints.push_back(last);
+        }
+
+        // the input offset the text at offset was copied from
+        uint32_t original(uint32_t offset) const {
+            auto after = std::upper_bound(checkpoints.begin(), checkpoints.end(), offset, [](uint32_t offset, const Checkpoint & checkpoint) {
+                return offset < checkpoint.offset;
+            });
+            Checkpoint at = *(after - 1);
+            uint32_t index = at.index;
+            while (index < edits.size()) {
+                uint32_t next = index;
+                uint32_t advanced = get(next);
+                uint32_t skipped = get(next);
+                if (at.offset + advanced > offset) break;
+                at.offset += advanced;
+                at.original += advanced + skipped;
+                index = next;
+            }
+            return at.original + (offset - at.offset);
+        }
+
+        // the line and column in the input of the text at offset
+        Location locate(uint32_t offset) const {
+            uint32_t original = this->original(offset);
+            size_t line = std::upper_bound(lines.begin(), lines.end(), original) - lines.begin();
+            Location location;
+            location.line = static_cast<uint32_t>(line);
+            location.column = original - lines[line - 1] + 1;
+            return location;
+        }
+
+        // the number of bytes the edits take
+        size_t size() const {
+            return edits.size();
+        }
+    };
+
+    // the files read by a run, a token refers to the file it was read from
+    // by its index, the input of the run is file 0
+    struct SourceFiles {
+        std::vector<const SourceMap *> maps;
+        std::vector<std::string> names;
+
+        SourceMap::Location locate(uint16_t file, uint32_t offset) const {
+            return maps[file]->locate(offset);
+        }
+    };
+}
+
+#endif
@@ -1,3 +1,2 @@
 #include "../include/CPP/Rules.h"
-CPP::Rules::Action CPP::Rules::NO_ACTION = [](CPP::Rules::Input) {};
-std::vector<CPP::Rules::RuleHolder::Reference*> CPP::Rules::RuleHolder::rules;
\ No newline at end of file
+CPP::Rules::Action CPP::Rules::NO_ACTION = [](CPP::Rules::Input) {};
\ No newline at end of file
@@ -0,0 +1,166 @@
+#include "../include/CPP/Scan.h"
+#include <cstring>
+
+// the vector paths need the gcc and clang builtins for bit scans, cpu
+// detection and per function target attributes
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define CPP_SCAN_X86
+#define CPP_SCAN_AVX2
+#include <immintrin.h>
+#endif
+
+namespace CPP {
+    namespace Scan {
+
+        // each scanner returns the first byte of [begin, end) whose membership in
+        // set is `member`, or end, span() looks for a byte outside the set and
+        // find() for a byte inside it
+
+        static const char * scanScalar(const CharacterSet & set, const char * begin, const char * end, bool member) {
+            const char * p = begin;
+            while (p < end && set.contains(*p) != member) p++;
+            return p;
+        }
+
+#ifdef CPP_SCAN_X86
+        // a byte is in [low, high] if byte - low, wrapping, is at most high - low,
+        // the saturating subtract of the width is zero exactly then
+        static const char * scanSSE2(const CharacterSet & set, const char * begin, const char * end, bool member) {
+            __m128i low[CharacterSet::maxIntervals];
+            __m128i width[CharacterSet::maxIntervals];
+            for (int i = 0; i < set.intervals; i++) {
+                low[i] = _mm_set1_epi8(static_cast<char>(set.low[i]));
+                width[i] = _mm_set1_epi8(static_cast<char>(set.high[i] - set.low[i]));
+            }
+            const __m128i zero = _mm_setzero_si128();
+            const unsigned flip = member ? 0 : 0xFFFF;
+            const char * p = begin;
+            while (end - p >= 16) {
+                __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                __m128i in = zero;
+                for (int i = 0; i < set.intervals; i++) {
+                    __m128i offset = _mm_sub_epi8(bytes, low[i]);
+                    in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_subs_epu8(offset, width[i]), zero));
+                }
+                unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(in)) ^ flip;
+                if (mask != 0) return p + __builtin_ctz(mask);
+                p += 16;
+            }
+            return scanScalar(set, p, end, member);
+        }
+
+        static uint32_t maskSSE2(const CharacterSet & set, const char * p) {
+            const __m128i zero = _mm_setzero_si128();
+            __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16));
+            __m128i inFirst = zero;
+            __m128i inSecond = zero;
+            for (int i = 0; i < set.intervals; i++) {
+                __m128i low = _mm_set1_epi8(static_cast<char>(set.low[i]));
+                __m128i width = _mm_set1_epi8(static_cast<char>(set.high[i] - set.low[i]));
+                inFirst = _mm_or_si128(inFirst, _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(first, low), width), zero));
+                inSecond = _mm_or_si128(inSecond, _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(second, low), width), zero));
+            }
+            return static_cast<uint32_t>(_mm_movemask_epi8(inFirst)) | (static_cast<uint32_t>(_mm_movemask_epi8(inSecond)) << 16);
+        }
+#endif
+
+#ifdef CPP_SCAN_AVX2
+        __attribute__((target("avx2")))
+        static const char * scanAVX2(const CharacterSet & set, const char * begin, const char * end, bool member) {
+            __m256i low[CharacterSet::maxIntervals];
+            __m256i width[CharacterSet::maxIntervals];
+            for (int i = 0; i < set.intervals; i++) {
+                low[i] = _mm256_set1_epi8(static_cast<char>(set.low[i]));
+                width[i] = _mm256_set1_epi8(static_cast<char>(set.high[i] - set.low[i]));
+            }
+            const __m256i zero = _mm256_setzero_si256();
+            const uint32_t flip = member ? 0 : ~uint32_t(0);
+            const char * p = begin;
+            while (end - p >= 32) {
+                __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+                __m256i in = zero;
+                for (int i = 0; i < set.intervals; i++) {
+                    __m256i offset = _mm256_sub_epi8(bytes, low[i]);
+                    in = _mm256_or_si256(in, _mm256_cmpeq_epi8(_mm256_subs_epu8(offset, width[i]), zero));
+                }
+                uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(in)) ^ flip;
+                if (mask != 0) return p + __builtin_ctz(mask);
+                p += 32;
+            }
+            return scanSSE2(set, p, end, member);
+        }
+
+        __attribute__((target("avx2")))
+        static uint32_t maskAVX2(const CharacterSet & set, const char * p) {
+            const __m256i zero = _mm256_setzero_si256();
+            __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            __m256i in = zero;
+            for (int i = 0; i < set.intervals; i++) {
+                __m256i offset = _mm256_sub_epi8(bytes, _mm256_set1_epi8(static_cast<char>(set.low[i])));
+                __m256i width = _mm256_set1_epi8(static_cast<char>(set.high[i] - set.low[i]));
+                in = _mm256_or_si256(in, _mm256_cmpeq_epi8(_mm256_subs_epu8(offset, width), zero));
+            }
+            return static_cast<uint32_t>(_mm256_movemask_epi8(in));
+        }
+
+        static bool hasAVX2() {
+            static const bool supported = __builtin_cpu_supports("avx2");
+            return supported;
+        }
+#endif
+
+        static const char * scan(const CharacterSet & set, const char * begin, const char * end, bool member) {
+            if (set.intervals <= 0) return scanScalar(set, begin, end, member);
+#ifdef CPP_SCAN_AVX2
+            if (hasAVX2()) return scanAVX2(set, begin, end, member);
+#endif
+#ifdef CPP_SCAN_X86
+            return scanSSE2(set, begin, end, member);
+#else
+            return scanScalar(set, begin, end, member);
+#endif
+        }
+
+        static uint32_t maskScalar(const CharacterSet & set, const char * p) {
+            uint32_t mask = 0;
+            for (int i = 0; i < 32; i++) {
+                if (set.contains(p[i])) mask |= uint32_t(1) << i;
+            }
+            return mask;
+        }
+
+        size_t span(const CharacterSet & set, const char * begin, const char * end) {
+            // most runs are short, identifiers and whitespace, do not pay for
+            // vector setup when the first bytes already end the run
+            const char * p = begin;
+            for (int i = 0; i < 4; i++) {
+                if (p == end || !set.contains(*p)) return p - begin;
+                p++;
+            }
+            return scan(set, p, end, false) - begin;
+        }
+
+        const char * find(const CharacterSet & set, const char * begin, const char * end) {
+            if (begin == end || set.empty()) return end;
+            if (set.contains(*begin)) return begin;
+            if (set.intervals == 1 && set.low[0] == set.high[0]) {
+                const void * found = memchr(begin, set.low[0], end - begin);
+                return found == nullptr ? end : static_cast<const char*>(found);
+            }
+            return scan(set, begin, end, true);
+        }
+
+        uint32_t mask(const CharacterSet & set, const char * p) {
+            if (set.intervals <= 0) return maskScalar(set, p);
+#ifdef CPP_SCAN_AVX2
+            if (hasAVX2()) return maskAVX2(set, p);
+#endif
+#ifdef CPP_SCAN_X86
+            return maskSSE2(set, p);
+#else
+            return maskScalar(set, p);
+#endif
+        }
+    }
+}
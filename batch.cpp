@@ -0,0 +1,120 @@
+#include "CPP/Batch.h"
+#include "CPP/Snapshot.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+// preprocesses many inputs in parallel, each into a file of its own
+//
+//     cpp_batch [options] input... [@list]
+//
+// an input is written to input.i, or to output if given as input=output, a
+// list file holds one input a line, written the same way
+//
+//     -j N             N worker threads, one for each core by default
+//     -I dir           searched for files included by "name" and <name>
+//     -iquote dir      searched for files included by "name"
+//     --snapshot file  the inputs start from the definitions of a snapshot
+//     --prelude file   the inputs start from the definitions file makes,
+//                      after those of the snapshot
+//     --save file      saves the definitions the inputs start from
+//     --line-markers   the outputs have #line directives
+
+static void usage() {
+    fprintf(stderr, "usage: cpp_batch [-j N] [-I dir] [-iquote dir] [--snapshot file] [--prelude file] [--save file] [--line-markers] input[=output]... [@list]\n");
+    exit(2);
+}
+
+static void add(std::vector<CPP::Batch::Unit> & units, const std::string & argument) {
+    size_t equals = argument.find('=');
+    if (equals == std::string::npos) {
+        units.push_back({argument, argument + ".i"});
+    } else {
+        units.push_back({argument.substr(0, equals), argument.substr(equals + 1)});
+    }
+}
+
+int main(int argc, char ** argv) {
+    CPP::Preprocessor::Context base;
+    base.trace = false;
+    std::vector<CPP::Batch::Unit> units;
+    unsigned workers = 0;
+    std::string snapshot;
+    std::string prelude;
+    std::string save;
+    for (int index = 1; index < argc; index++) {
+        std::string argument = argv[index];
+        auto value = [&]() -> std::string {
+            if (index + 1 == argc) usage();
+            return argv[++index];
+        };
+        if (argument == "-j") {
+            workers = static_cast<unsigned>(atoi(value().c_str()));
+        } else if (argument == "-I") {
+            base.systemPaths.push_back(value());
+        } else if (argument == "-iquote") {
+            base.quotePaths.push_back(value());
+        } else if (argument == "--snapshot") {
+            snapshot = value();
+        } else if (argument == "--prelude") {
+            prelude = value();
+        } else if (argument == "--save") {
+            save = value();
+        } else if (argument == "--line-markers") {
+            base.lineMarkers = true;
+        } else if (argument[0] == '@') {
+            std::ifstream list(argument.substr(1));
+            if (!list) {
+                fprintf(stderr, "cpp_batch: cannot read %s\n", argument.c_str() + 1);
+                return 1;
+            }
+            for (std::string line; std::getline(list, line);) {
+                if (!line.empty()) add(units, line);
+            }
+        } else if (argument[0] == '-') {
+            usage();
+        } else {
+            add(units, argument);
+        }
+    }
+    if (!snapshot.empty()) {
+        auto mapped = CPP::Snapshot::open(snapshot);
+        if (mapped == nullptr || !CPP::Preprocessor::use(base, mapped)) {
+            fprintf(stderr, "cpp_batch: cannot use the snapshot %s\n", snapshot.c_str());
+            return 1;
+        }
+    }
+    if (!prelude.empty()) {
+        int fd = open(prelude.c_str(), O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "cpp_batch: cannot read %s: %s\n", prelude.c_str(), strerror(errno));
+            return 1;
+        }
+        // only its definitions are kept
+        std::string output;
+        CPP::StringSink sink(output);
+        CPP::Preprocessor preprocessor;
+        base.name = prelude;
+        bool ran = preprocessor.parse(fd, base, sink);
+        close(fd);
+        if (!ran) {
+            fprintf(stderr, "cpp_batch: %s: %s\n", prelude.c_str(), base.error.c_str());
+            return 1;
+        }
+    }
+    if (!save.empty() && !CPP::Preprocessor::save(base, save)) {
+        fprintf(stderr, "cpp_batch: cannot save the snapshot %s\n", save.c_str());
+        return 1;
+    }
+    if (units.empty()) {
+        if (save.empty()) usage();
+        return 0;
+    }
+    std::vector<std::string> errors;
+    std::vector<size_t> failed = CPP::Batch::run(base, units, workers, &errors);
+    for (size_t index = 0; index < failed.size(); index++) {
+        fprintf(stderr, "cpp_batch: %s: %s\n", units[failed[index]].input.c_str(), errors[index].c_str());
+    }
+    return failed.empty() ? 0 : 1;
+}